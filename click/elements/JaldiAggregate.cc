@@ -0,0 +1,212 @@
+/*
+ * JaldiAggregate.{cc,hh} -- packs several bulk Jaldi frames into one
+ */
+
+#include <click/config.h>
+#include <click/confparse.hh>
+#include <click/error.hh>
+#include <click/glue.hh>
+
+#include "JaldiClick.hh"
+#include "JaldiAggregate.hh"
+
+using namespace jaldimac;
+
+CLICK_DECLS
+
+JaldiAggregate::JaldiAggregate() : max_size(0), max_delay_us(1000), timer(this),
+                                   held(NULL), aggregate(NULL), count(0), next_seq(0),
+                                   frames(0), aggregates(0), subframes(0), saved_bytes(0)
+{
+}
+
+JaldiAggregate::~JaldiAggregate()
+{
+}
+
+int JaldiAggregate::configure(Vector<String>& conf, ErrorHandler* errh)
+{
+    max_size = Frame::empty_frame_size + BULK_MTU__BYTES;
+    max_delay_us = 1000;
+
+    // Parse configuration parameters
+    if (cp_va_kparse(conf, this, errh,
+             "MAXSIZE", 0, cpUnsigned, &max_size,
+             "MAXDELAY", 0, cpUnsigned, &max_delay_us,
+             cpEnd) < 0)
+        return -1;
+
+    // Subframe lengths are 16 bits
+    if (max_size > 0xFFFF)
+        return errh->error("MAXSIZE too large; the most is %<65535%>");
+
+    return 0;
+}
+
+int JaldiAggregate::initialize(ErrorHandler*)
+{
+    timer.initialize(this);
+    return 0;
+}
+
+void JaldiAggregate::cleanup(CleanupStage)
+{
+    if (held)
+        held->kill();
+
+    if (aggregate)
+        aggregate->kill();
+
+    held = NULL;
+    aggregate = NULL;
+    count = 0;
+}
+
+bool JaldiAggregate::can_aggregate(const Frame* f) const
+{
+    return f->type == BULK_FRAME && f->ext_words == 0;
+}
+
+bool JaldiAggregate::append(Packet* p)
+{
+    const Frame* f = (const Frame*) p->data();
+    const Frame* first = (const Frame*) (held ? held->data() : aggregate->data());
+
+    if (f->src_id != first->src_id || f->dest_id != first->dest_id
+        || f->seq != next_seq || count == 0xFFFF)
+        return false;
+
+    // Would the combined frame still fit?
+    uint32_t length = (held ? aggregate_header_size + sizeof(AggregateSubframe) + first->payload_length()
+                            : aggregate->length())
+                      + sizeof(AggregateSubframe) + f->payload_length() + Frame::footer_size;
+
+    if (length > max_size)
+        return false;
+
+    if (held)
+    {
+        // Start the combined frame, with room for all it can hold so that
+        // adding to it never moves it, and make the held frame its first
+        // subframe.
+        if (! (aggregate = Packet::make(Packet::default_headroom, NULL, aggregate_header_size,
+                                        max_size - aggregate_header_size)))
+            return false;
+
+        Frame* af = (Frame*) aggregate->data();
+        af->initialize();
+        af->src_id = first->src_id;
+        af->dest_id = first->dest_id;
+        af->type = BULK_FRAME;
+        af->ext_words = (aggregate_header_size - sizeof(Frame)) / 4;
+        af->seq = first->seq;
+
+        FrameExtension* ext = (FrameExtension*) af->extensions();
+        ext->type = EXT_AGGREGATE;
+        ext->length = sizeof(AggregateExtension);
+
+        add_subframe(first);
+        held->kill();
+        held = NULL;
+    }
+
+    add_subframe(f);
+    p->kill();
+
+    ++count;
+    ++next_seq;
+    return true;
+}
+
+void JaldiAggregate::add_subframe(const Frame* f)
+{
+    AggregateSubframe subframe;
+    subframe.length = f->payload_length();
+
+    // There's always tailroom; see append()
+    aggregate = aggregate->put(sizeof(subframe) + subframe.length);
+    uint8_t* end = aggregate->end_data();
+    memcpy(end - subframe.length - sizeof(subframe), &subframe, sizeof(subframe));
+    memcpy(end - subframe.length, f->payload(), subframe.length);
+}
+
+void JaldiAggregate::flush()
+{
+    timer.unschedule();
+
+    Packet* p = held;
+
+    if (aggregate)
+    {
+        // Finish off the combined frame
+        WritablePacket* wp = aggregate->put(Frame::footer_size);
+        Frame* af = (Frame*) wp->data();
+        af->length = wp->length();
+        af->set_tx_timestamp(0);        // Stamped by the driver
+
+        AggregateExtension ae;
+        ae.count = count;
+        memcpy(((FrameExtension*) af->extensions())->value, &ae, sizeof(ae));
+
+        ++aggregates;
+        subframes += count;
+        saved_bytes += (count - 1) * Frame::empty_frame_size - af->extension_length()
+                       - count * sizeof(AggregateSubframe);
+        p = wp;
+    }
+
+    held = NULL;
+    aggregate = NULL;
+    count = 0;
+
+    if (p)
+        output(out_port).push(p);
+}
+
+void JaldiAggregate::push(int, Packet* p)
+{
+    const Frame* f = (const Frame*) p->data();
+    ++frames;
+
+    if (! frame_is_valid(f, p->length()) || ! can_aggregate(f))
+    {
+        // Pass it on, keeping the order
+        flush();
+        output(out_port).push(p);
+        return;
+    }
+
+    if (count > 0 && append(p))
+        return;
+
+    // Send what we have and start again with this frame
+    flush();
+
+    held = p;
+    count = 1;
+    next_seq = f->seq + 1;
+    timer.schedule_after_us(max_delay_us);
+}
+
+void JaldiAggregate::run_timer(Timer*)
+{
+    flush();
+}
+
+String JaldiAggregate::read_handler(Element* e, void*)
+{
+    JaldiAggregate* a = static_cast<JaldiAggregate*>(e);
+
+    return "frames aggregates subframes saved_bytes\n"
+           + String(a->frames) + " " + String(a->aggregates) + " " + String(a->subframes)
+           + " " + String(a->saved_bytes) + "\n";
+}
+
+void JaldiAggregate::add_handlers()
+{
+    add_read_handler("stats", read_handler, (void*) 0);
+}
+
+CLICK_ENDDECLS
+ELEMENT_REQUIRES(Frame)
+EXPORT_ELEMENT(JaldiAggregate)
@@ -0,0 +1,114 @@
+#ifndef CLICK_JALDIAGGREGATE_HH
+#define CLICK_JALDIAGGREGATE_HH
+#include <click/element.hh>
+#include "Frame.hh"
+#include "JaldiClock.hh"
+CLICK_DECLS
+
+/*
+=c
+
+JaldiAggregate([I<keywords> MAXSIZE, MAXDELAY])
+
+=s jaldi
+
+packs several bulk Jaldi frames into one
+
+=d
+
+Combines consecutive BULK_FRAMEs with the same source and destination into a
+single BULK_FRAME, so that small packets such as TCP ACKs share one Jaldi
+header and footer (and, on the radio, one PHY preamble). Each packet is
+carried as a subframe: its length in two bytes, followed by the packet. The
+combined frame carries an EXT_AGGREGATE extension giving the number of
+subframes, and the sequence number of the first; JaldiDecap splits it up
+again.
+
+Frames are held back until the next one wouldn't fit within MAXSIZE, or
+MAXDELAY has passed since the first of them arrived. Only frames with
+consecutive sequence numbers are combined, and a frame on its own is passed
+on unchanged. Frames of other types, and frames which already carry
+extensions, are passed on as they are (after any frames being held, so that
+the order is kept).
+
+JaldiAggregate belongs just after the JaldiEncap of a bulk path, before the
+queue. It should not be pushed to from more than one thread.
+
+Keyword arguments are:
+
+=over 8
+
+=item MAXSIZE
+
+Unsigned. The largest combined frame to build, in bytes, including the Jaldi
+header and footer. Default is the size of a frame carrying a full-sized
+(1500 byte) packet, so combined frames are never longer than those the gate
+and scheduler already handle.
+
+=item MAXDELAY
+
+Unsigned. The longest time to hold a frame back, in microseconds, on the
+JaldiClock. Default is 1000.
+
+=back
+
+This element is push only.
+
+=h stats read-only
+
+Returns the number of frames received, the number of combined frames sent,
+the number of frames they contained, and the number of bytes saved.
+
+=a
+
+JaldiEncap, JaldiDecap */
+
+class JaldiAggregate : public Element { public:
+
+    JaldiAggregate();
+    ~JaldiAggregate();
+
+    const char* class_name() const  { return "JaldiAggregate"; }
+    const char* port_count() const  { return PORTS_1_1; }
+    const char* processing() const  { return PUSH; }
+    const char* flow_code() const   { return COMPLETE_FLOW; }
+
+    int configure(Vector<String>&, ErrorHandler*);
+    int initialize(ErrorHandler*);
+    void cleanup(CleanupStage);
+    void add_handlers();
+
+    void push(int, Packet*);
+    void run_timer(Timer*);
+
+  private:
+    bool can_aggregate(const jaldimac::Frame* f) const;
+    bool append(Packet* p);
+    void add_subframe(const jaldimac::Frame* f);
+    void flush();
+
+    static String read_handler(Element*, void*);
+
+    static const int in_port = 0;
+    static const int out_port = 0;
+
+    // Room for the Jaldi header and the EXT_AGGREGATE extension
+    static const uint32_t aggregate_header_size = sizeof(jaldimac::Frame) + 4;
+
+    uint32_t max_size;
+    uint32_t max_delay_us;
+    JaldiTimer timer;
+
+    Packet* held;               // A single frame, not yet combined
+    WritablePacket* aggregate;  // Or the combined frame being built
+    uint16_t count;             // Frames held, either way
+    uint32_t next_seq;          // The one the next frame must have
+
+    uint32_t frames;
+    uint32_t aggregates;
+    uint32_t subframes;
+    uint32_t saved_bytes;
+};
+
+CLICK_ENDDECLS
+#endif
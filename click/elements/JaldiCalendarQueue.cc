@@ -0,0 +1,268 @@
+/*
+ * JaldiCalendarQueue.{cc,hh} -- stores Jaldi frames until their transmit time
+ */
+
+#include <click/config.h>
+#include <click/confparse.hh>
+#include <click/error.hh>
+#include <click/glue.hh>
+
+#include "JaldiCalendarQueue.hh"
+
+CLICK_DECLS
+
+JaldiCalendarQueue::JaldiCalendarQueue() : _buckets(NULL), _nbuckets(0), _mask(0),
+                                           _cursor_tick(0), _count(0), _nready(0),
+                                           _capacity(1000), _tick_us(100),
+                                           _delay_us(0), _drops(0), _late(0)
+{
+    _ready.head = _ready.tail = NULL;
+}
+
+JaldiCalendarQueue::~JaldiCalendarQueue()
+{
+}
+
+void* JaldiCalendarQueue::cast(const char* n)
+{
+    if (strcmp(n, "JaldiCalendarQueue") == 0)
+        return (Element*) this;
+    else
+        return NULL;
+}
+
+int JaldiCalendarQueue::configure(Vector<String>& conf, ErrorHandler* errh)
+{
+    unsigned slots = 8192;
+
+    // Parse configuration parameters
+    if (cp_va_kparse(conf, this, errh,
+             "CAPACITY", cpkP, cpUnsigned, &_capacity,
+             "TICK", cpkP, cpUnsigned, &_tick_us,
+             "SLOTS", cpkP, cpUnsigned, &slots,
+             "DELAY", 0, cpUnsigned, &_delay_us,
+             cpEnd) < 0)
+        return -1;
+
+    if (_tick_us == 0)
+        return errh->error("TICK must be at least 1 microsecond");
+
+    if (slots == 0 || slots > (1U << 24))
+        return errh->error("SLOTS must be between 1 and %u", 1U << 24);
+
+    // Round the number of buckets up to a power of two so that hashing a
+    // tick to its bucket is a mask
+    for (_nbuckets = 1 ; _nbuckets < slots ; _nbuckets <<= 1)
+        ;
+
+    _mask = _nbuckets - 1;
+
+    return 0;
+}
+
+int JaldiCalendarQueue::initialize(ErrorHandler* errh)
+{
+    _buckets = new Bucket[_nbuckets];
+
+    if (! _buckets)
+        return errh->error("out of memory");
+
+    for (unsigned i = 0 ; i < _nbuckets ; ++i)
+        _buckets[i].head = _buckets[i].tail = NULL;
+
+    _ready.head = _ready.tail = NULL;
+    _count = _nready = 0;
+    _drops = _late = 0;
+
+    // Nothing before now can be in the wheel yet
+    _cursor_tick = tick_of(JaldiClock::now_us());
+
+    return 0;
+}
+
+void JaldiCalendarQueue::cleanup(CleanupStage)
+{
+    if (_buckets)
+    {
+        for (unsigned i = 0 ; i < _nbuckets ; ++i)
+        {
+            while (Packet* p = _buckets[i].head)
+            {
+                _buckets[i].head = p->next();
+                p->kill();
+            }
+        }
+
+        delete[] _buckets;
+        _buckets = NULL;
+    }
+
+    while (Packet* p = _ready.head)
+    {
+        _ready.head = p->next();
+        p->kill();
+    }
+}
+
+bool JaldiCalendarQueue::enq(Packet* p, uint64_t now_us)
+{
+    if (_count >= _capacity)
+        return false;
+
+    // Packets without a transmit time are due DELAY after they arrive
+    if (! jaldi_tx_time_anno(p))
+        set_jaldi_tx_time_anno(p, uint32_t(now_us + _delay_us));
+
+    uint64_t due_tick = tick_of(due_us(p, now_us));
+
+    if (due_tick <= _cursor_tick)
+    {
+        // The bucket for this tick has already been expired, so this packet
+        // is late; it goes straight to the ready list
+        _ready.append(p);
+        ++_nready;
+        ++_late;
+    }
+    else
+        _buckets[due_tick & _mask].append(p);
+
+    ++_count;
+    return true;
+}
+
+void JaldiCalendarQueue::expire(Bucket& bucket, uint64_t now_us)
+{
+    uint64_t now_tick = tick_of(now_us);
+
+    // Move every packet in the bucket which is due to the end of the ready
+    // list. Packets due on a later revolution of the wheel stay behind.
+    Packet* p = bucket.head;
+    bucket.head = bucket.tail = NULL;
+
+    while (p)
+    {
+        Packet* next = p->next();
+
+        if (tick_of(due_us(p, now_us)) <= now_tick)
+        {
+            _ready.append(p);
+            ++_nready;
+        }
+        else
+            bucket.append(p);
+
+        p = next;
+    }
+}
+
+void JaldiCalendarQueue::advance(uint64_t now_us)
+{
+    uint64_t now_tick = tick_of(now_us);
+
+    if (now_tick <= _cursor_tick)
+        return;
+
+    // Expire each tick we've passed since the last call, in order. If we've
+    // been away for more than a full revolution, every bucket only needs to
+    // be visited once.
+    uint64_t steps = now_tick - _cursor_tick;
+
+    if (steps > _nbuckets)
+        steps = _nbuckets;
+
+    for (uint64_t step = 1 ; step <= steps ; ++step)
+    {
+        Bucket& bucket = _buckets[(_cursor_tick + step) & _mask];
+
+        if (bucket.head)
+            expire(bucket, now_us);
+    }
+
+    _cursor_tick = now_tick;
+}
+
+Packet* JaldiCalendarQueue::deq(uint64_t now_us)
+{
+    if (! _ready.head)
+        advance(now_us);
+
+    Packet* p = _ready.head;
+
+    if (p)
+    {
+        _ready.head = p->next();
+
+        if (! _ready.head)
+            _ready.tail = NULL;
+
+        p->set_next(NULL);
+        --_nready;
+        --_count;
+    }
+
+    return p;
+}
+
+void JaldiCalendarQueue::push(int, Packet* p)
+{
+    if (! enq(p, JaldiClock::now_us()))
+    {
+        if (_drops == 0)
+            click_chatter("%{element}: overflow", this);
+
+        ++_drops;
+        checked_output_push(out_port_drop, p);
+    }
+}
+
+Packet* JaldiCalendarQueue::pull(int)
+{
+    if (_count == 0)
+        return NULL;
+
+    return deq(JaldiClock::now_us());
+}
+
+enum { H_LENGTH, H_READY, H_CAPACITY, H_DROPS, H_LATE };
+
+String JaldiCalendarQueue::read_handler(Element* e, void* thunk)
+{
+    JaldiCalendarQueue* q = static_cast<JaldiCalendarQueue*>(e);
+
+    switch (reinterpret_cast<intptr_t>(thunk))
+    {
+        case H_LENGTH:
+            return String(q->_count);
+        case H_READY:
+            return String(q->_nready);
+        case H_CAPACITY:
+            return String(q->_capacity);
+        case H_DROPS:
+            return String(q->_drops);
+        case H_LATE:
+            return String(q->_late);
+        default:
+            return "";
+    }
+}
+
+int JaldiCalendarQueue::write_handler(const String&, Element* e, void*, ErrorHandler*)
+{
+    JaldiCalendarQueue* q = static_cast<JaldiCalendarQueue*>(e);
+    q->_drops = 0;
+    q->_late = 0;
+    return 0;
+}
+
+void JaldiCalendarQueue::add_handlers()
+{
+    add_read_handler("length", read_handler, (void*) H_LENGTH);
+    add_read_handler("ready", read_handler, (void*) H_READY);
+    add_read_handler("capacity", read_handler, (void*) H_CAPACITY, Handler::CALM);
+    add_read_handler("drops", read_handler, (void*) H_DROPS);
+    add_read_handler("late", read_handler, (void*) H_LATE);
+    add_write_handler("reset_counts", write_handler, (void*) 0, Handler::BUTTON);
+}
+
+CLICK_ENDDECLS
+EXPORT_ELEMENT(JaldiCalendarQueue)
@@ -0,0 +1,157 @@
+#ifndef CLICK_JALDICALENDARQUEUE_HH
+#define CLICK_JALDICALENDARQUEUE_HH
+#include <click/element.hh>
+#include "JaldiClick.hh"
+#include "JaldiClock.hh"
+CLICK_DECLS
+
+/*
+=c
+
+JaldiCalendarQueue(CAPACITY, TICK, SLOTS [, I<keywords> DELAY])
+
+=s jaldi
+
+stores Jaldi frames until their transmit time
+
+=d
+
+Stores incoming packets in a hashed timing wheel keyed by the time at which
+they should be transmitted, and releases them once that time has come. This is
+the Click counterpart of the tx_time-ordered transmit queue in the JaldiMAC
+kernel driver.
+
+The transmit time of a packet is taken from a user annotation of its own
+(JALDI_TX_TIME_ANNO in JaldiClick.hh), in microseconds on the JaldiClock,
+rather than from the timestamp annotation, which FromDevice and KernelTun set
+to the time the packet arrived. A packet whose transmit time annotation is
+zero is due DELAY microseconds after it arrives. Transmit times must be within
+about half an hour of the present.
+
+The wheel has SLOTS buckets, each covering TICK microseconds; SLOTS is rounded
+up to a power of two. Inserting a packet and releasing a due packet both take
+constant time; a bucket holding packets more than one revolution of the wheel
+in the future is simply revisited on the next revolution, so TICK * SLOTS
+should be at least as long as the furthest-ahead transmit time in use (for
+example, one round). The defaults are a TICK of 100 microseconds and 8192
+SLOTS, which covers more than 800 milliseconds.
+
+Packets due in the same tick are released in the order they arrived, and
+packets are never released before the tick they are due in.
+
+Pulling from the output returns the next due packet, or nothing if no packet
+is due yet. Driver elements can pull repeatedly to get every packet that is
+due now. If the queue already holds CAPACITY packets, incoming packets are
+dropped, or emitted on output 1 if it exists. The default for CAPACITY is
+1000.
+
+=h length read-only
+
+Returns the current number of packets in the queue.
+
+=h ready read-only
+
+Returns the number of packets that were due at the last pull but have not been
+pulled yet.
+
+=h capacity read-only
+
+Returns the queue's capacity.
+
+=h drops read-only
+
+Returns the number of packets dropped by the queue so far.
+
+=h late read-only
+
+Returns the number of packets that were already due when they arrived.
+
+=h reset_counts write-only
+
+When written, resets the C<drops> and C<late> counters.
+
+=a
+
+JaldiQueue, JaldiFakeDriver, JaldiFakeDriverPrecise, JaldiClock */
+
+class JaldiCalendarQueue : public Element { public:
+
+    JaldiCalendarQueue();
+    ~JaldiCalendarQueue();
+
+    const char* class_name() const  { return "JaldiCalendarQueue"; }
+    const char* port_count() const  { return PORTS_1_1X2; }
+    const char* processing() const  { return "h/lh"; }
+    void* cast(const char*);
+
+    int configure(Vector<String>&, ErrorHandler*);
+    int initialize(ErrorHandler*);
+    void cleanup(CleanupStage);
+    void add_handlers();
+
+    unsigned size() const               { return _count; }
+    bool empty() const                  { return _count == 0; }
+
+    bool enq(Packet*, uint64_t now_us);
+    Packet* deq(uint64_t now_us);
+
+    void push(int port, Packet*);
+    Packet* pull(int port);
+
+  private:
+    static const int in_port = 0;
+    static const int out_port = 0;
+    static const int out_port_drop = 1;
+
+    // Each bucket and the ready list is a FIFO linked through Packet::next().
+    struct Bucket
+    {
+        Packet* head;
+        Packet* tail;
+
+        void append(Packet* p)
+        {
+            p->set_next(0);
+            if (tail)
+                tail->set_next(p);
+            else
+                head = p;
+            tail = p;
+        }
+    };
+
+    inline uint64_t tick_of(uint64_t us) const
+    {
+        return us / _tick_us;
+    }
+
+    // The transmit time of P on the full 64-bit clock, given the time now
+    static inline uint64_t due_us(const Packet* p, uint64_t now_us)
+    {
+        return now_us + int32_t(jaldi_tx_time_anno(p) - uint32_t(now_us));
+    }
+
+    void advance(uint64_t now_us);
+    void expire(Bucket& bucket, uint64_t now_us);
+
+    Bucket* _buckets;
+    unsigned _nbuckets;
+    unsigned _mask;
+    Bucket _ready;
+
+    uint64_t _cursor_tick;      // Every bucket up to this tick has been expired
+
+    unsigned _count;
+    unsigned _nready;
+    unsigned _capacity;
+    uint32_t _tick_us;
+    uint32_t _delay_us;
+    unsigned _drops;
+    unsigned _late;
+
+    static String read_handler(Element*, void*);
+    static int write_handler(const String&, Element*, void*, ErrorHandler*);
+};
+
+CLICK_ENDDECLS
+#endif
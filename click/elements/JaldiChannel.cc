@@ -0,0 +1,345 @@
+/*
+ * JaldiChannel.{cc,hh} -- emulates the shared half-duplex radio medium between a master and its stations
+ */
+
+#include <click/config.h>
+#include <click/confparse.hh>
+#include <click/error.hh>
+#include <click/glue.hh>
+#include <algorithm>
+
+#include "Frame.hh"
+#include "JaldiChannel.hh"
+
+using namespace jaldimac;
+using namespace std;
+
+CLICK_DECLS
+
+JaldiChannel::JaldiChannel() : nstations(0),
+                               master_rate_kbps(BITRATE__BYTES_PER_US * 8 * 1000),
+                               propagation_us(0), turnaround_us(0),
+                               last_sender(-1), medium_free_us(0),
+                               next_order(0), timer(this), busy_us(0)
+{
+}
+
+JaldiChannel::~JaldiChannel()
+{
+}
+
+// Parse a space-separated list of unsigned values, one per station, into
+// VALUES (indexed by port). Stations not listed keep their current value.
+static int parse_station_list(const String& str, const char* name, unsigned nstations,
+                              Vector<uint32_t>& values, ErrorHandler* errh)
+{
+    Vector<String> words;
+    cp_spacevec(str, words);
+
+    if (words.size() > int(nstations))
+        return errh->error("%s lists %d values, but there are only %u stations", name, words.size(), nstations);
+
+    for (int i = 0 ; i < words.size() ; ++i)
+    {
+        if (! cp_unsigned(words[i], &values[i + 1]))
+            return errh->error("%s value %<%s%> is not an unsigned integer", name, words[i].c_str());
+    }
+
+    return 0;
+}
+
+int JaldiChannel::configure(Vector<String>& conf, ErrorHandler* errh)
+{
+    String rates_str;
+    String losses_str;
+    uint32_t loss = 0;
+
+    // Parse configuration parameters
+    if (cp_va_kparse(conf, this, errh,
+             "STATIONS", cpkP+cpkM, cpUnsigned, &nstations,
+             "BITRATE", 0, cpUnsigned, &master_rate_kbps,
+             "RATES", 0, cpArgument, &rates_str,
+             "PROPAGATION", 0, cpUnsigned, &propagation_us,
+             "TURNAROUND", 0, cpUnsigned, &turnaround_us,
+             "LOSS", 0, cpUnsigned, &loss,
+             "LOSSES", 0, cpArgument, &losses_str,
+             cpEnd) < 0)
+        return -1;
+
+    if (nstations < 1)
+        return errh->error("need at least one station");
+
+    // Check that we have a port for the master and each station
+    if (ninputs() != int(nstations + 1) || noutputs() != int(nstations + 1))
+        return errh->error("wrong number of ports; need %<%u%> inputs and outputs (the master, then one per station)", nstations + 1);
+
+    if (master_rate_kbps == 0)
+        return errh->error("BITRATE must be positive");
+
+    if (loss > 1000)
+        return errh->error("LOSS must be at most 1000 parts per thousand");
+
+    rate_kbps.clear();
+    rate_kbps.resize(nstations + 1, master_rate_kbps);
+    loss_permille.clear();
+    loss_permille.resize(nstations + 1, loss);
+
+    if (parse_station_list(rates_str, "RATES", nstations, rate_kbps, errh) < 0
+        || parse_station_list(losses_str, "LOSSES", nstations, loss_permille, errh) < 0)
+        return -1;
+
+    for (unsigned port = 1 ; port <= nstations ; ++port)
+    {
+        if (rate_kbps[port] == 0)
+            return errh->error("station %u has a zero bitrate", port);
+
+        if (loss_permille[port] > 1000)
+            return errh->error("station %u has a loss probability above 1000 parts per thousand", port);
+    }
+
+    return 0;
+}
+
+int JaldiChannel::initialize(ErrorHandler*)
+{
+    sender_free_us.clear();
+    sender_free_us.resize(nstations + 1, 0);
+    stats.resize(nstations + 1, NodeStats());
+    clear_stats();
+
+    timer.initialize(this);
+
+    return 0;
+}
+
+void JaldiChannel::cleanup(CleanupStage)
+{
+    for (int i = 0 ; i < deliveries.size() ; ++i)
+    {
+        deliveries[i].p->kill();
+        release(deliveries[i].tx);
+    }
+
+    for (int i = 0 ; i < in_flight.size() ; ++i)
+        release(in_flight[i]);
+
+    deliveries.clear();
+    in_flight.clear();
+}
+
+uint64_t JaldiChannel::now_us()
+{
+    return JaldiClock::now_us();
+}
+
+uint32_t JaldiChannel::airtime_us(int sender, uint32_t bytes) const
+{
+    uint32_t kbps = rate_kbps[sender];
+    return uint32_t((uint64_t(bytes) * 8 * 1000 + kbps - 1) / kbps);
+}
+
+void JaldiChannel::release(Transmission* tx)
+{
+    if (--tx->refs == 0)
+        delete tx;
+}
+
+void JaldiChannel::push(int port, Packet* p)
+{
+    transmit(port, p);
+}
+
+void JaldiChannel::transmit(int sender, Packet* p)
+{
+    uint64_t now = now_us();
+    const Frame* f = (const Frame*) p->data();
+
+    // Delays for the driver hold up the sender's next frame rather than
+    // going on the air.
+    if (frame_is_valid(f, p->length()) && f->type == DELAY_MESSAGE && f->dest_id == DRIVER_ID)
+    {
+        const DelayMessagePayload* dmp = &payload_of<DELAY_MESSAGE>(f);
+        sender_free_us[sender] = max(sender_free_us[sender], now) + dmp->duration_us;
+        p->kill();
+        return;
+    }
+
+    // Work out when this frame is on the air.
+    uint64_t start_us = max(now, sender_free_us[sender]);
+
+    if (last_sender >= 0 && last_sender != sender)
+        start_us += turnaround_us;
+
+    uint64_t end_us = start_us + airtime_us(sender, p->length());
+    sender_free_us[sender] = end_us;
+
+    // Forget transmissions which are over; nothing from now on can overlap
+    // them.
+    for (int i = 0 ; i < in_flight.size() ; )
+    {
+        if (in_flight[i]->end_us <= now)
+        {
+            release(in_flight[i]);
+            in_flight[i] = in_flight.back();
+            in_flight.pop_back();
+        }
+        else
+            ++i;
+    }
+
+    // Overlapping transmissions from different senders destroy each other.
+    Transmission* tx = new Transmission;
+    tx->sender = sender;
+    tx->start_us = start_us;
+    tx->end_us = end_us;
+    tx->collided = false;
+    tx->refs = 1;
+
+    for (int i = 0 ; i < in_flight.size() ; ++i)
+    {
+        Transmission* other = in_flight[i];
+
+        if (other->sender != sender && other->start_us < end_us && start_us < other->end_us)
+            other->collided = tx->collided = true;
+    }
+
+    in_flight.push_back(tx);
+
+    // Update statistics.
+    if (end_us > medium_free_us)
+    {
+        busy_us += end_us - max(start_us, medium_free_us);
+        medium_free_us = end_us;
+    }
+
+    last_sender = sender;
+    stats[sender].tx_frames += 1;
+    stats[sender].tx_bytes += p->length();
+
+    // Schedule deliveries: from the master to every station, and from a
+    // station to the master.
+    Delivery d;
+    d.at_us = end_us + propagation_us;
+    d.order = next_order++;
+    d.tx = tx;
+
+    if (sender == port_master)
+    {
+        for (unsigned port = 1 ; port <= nstations ; ++port)
+        {
+            d.port = port;
+            d.p = (port == nstations ? p : p->clone());
+
+            if (! d.p)
+                continue;
+
+            ++tx->refs;
+            deliveries.push_back(d);
+            push_heap(deliveries.begin(), deliveries.end());
+        }
+    }
+    else
+    {
+        d.port = port_master;
+        d.p = p;
+        ++tx->refs;
+        deliveries.push_back(d);
+        push_heap(deliveries.begin(), deliveries.end());
+    }
+
+    schedule_timer();
+}
+
+void JaldiChannel::schedule_timer()
+{
+    if (deliveries.size() == 0)
+        return;
+
+    timer.schedule_at_us(deliveries.front().at_us);
+}
+
+void JaldiChannel::run_timer(Timer*)
+{
+    uint64_t now = now_us();
+
+    while (deliveries.size() > 0 && deliveries.front().at_us <= now)
+    {
+        // Take the delivery off the heap before pushing anything, since the
+        // receiver may transmit in response.
+        pop_heap(deliveries.begin(), deliveries.end());
+        Delivery d = deliveries.back();
+        deliveries.pop_back();
+
+        // The loss probability of a link is that of its station.
+        int station_port = (d.port == port_master ? d.tx->sender : d.port);
+        NodeStats& sender_stats = stats[d.tx->sender];
+
+        if (d.tx->collided)
+        {
+            ++sender_stats.collided;
+            d.p->kill();
+        }
+        else if (loss_permille[station_port] > 0 && click_random(0, 999) < loss_permille[station_port])
+        {
+            ++sender_stats.lost;
+            d.p->kill();
+        }
+        else
+        {
+            ++sender_stats.delivered;
+            output(d.port).push(d.p);
+        }
+
+        release(d.tx);
+    }
+
+    schedule_timer();
+}
+
+void JaldiChannel::clear_stats()
+{
+    for (int i = 0 ; i < stats.size() ; ++i)
+    {
+        stats[i].tx_frames = 0;
+        stats[i].tx_bytes = 0;
+        stats[i].delivered = 0;
+        stats[i].lost = 0;
+        stats[i].collided = 0;
+    }
+
+    busy_us = 0;
+}
+
+String JaldiChannel::read_handler(Element* e, void*)
+{
+    JaldiChannel* c = static_cast<JaldiChannel*>(e);
+    String s = "node tx_frames tx_bytes delivered lost collided\n";
+
+    for (int i = 0 ; i < c->stats.size() ; ++i)
+    {
+        const NodeStats& ns = c->stats[i];
+        s += String(i == port_master ? unsigned(MASTER_ID) : unsigned(FIRST_STATION_ID + i - 1))
+             + " " + String(ns.tx_frames) + " " + String(ns.tx_bytes)
+             + " " + String(ns.delivered) + " " + String(ns.lost)
+             + " " + String(ns.collided) + "\n";
+    }
+
+    s += "busy_us " + String(c->busy_us) + "\n";
+    return s;
+}
+
+int JaldiChannel::write_handler(const String&, Element* e, void*, ErrorHandler*)
+{
+    static_cast<JaldiChannel*>(e)->clear_stats();
+    return 0;
+}
+
+void JaldiChannel::add_handlers()
+{
+    add_read_handler("stats", read_handler, (void*) 0);
+    add_write_handler("reset_stats", write_handler, (void*) 0, Handler::BUTTON);
+}
+
+CLICK_ENDDECLS
+ELEMENT_REQUIRES(Frame)
+EXPORT_ELEMENT(JaldiChannel)
@@ -0,0 +1,185 @@
+#ifndef CLICK_JALDICHANNEL_HH
+#define CLICK_JALDICHANNEL_HH
+#include <click/element.hh>
+#include <click/timer.hh>
+#include "Frame.hh"
+#include "JaldiClock.hh"
+CLICK_DECLS
+
+/*
+=c
+
+JaldiChannel(STATIONS [, I<keywords> BITRATE, RATES, PROPAGATION, TURNAROUND, LOSS, LOSSES])
+
+=s jaldi
+
+emulates the shared half-duplex radio medium between a master and its stations
+
+=d
+
+JaldiChannel stands in for the radios and the air between one JaldiMAC master
+and STATIONS stations, so that a whole cell can be run and benchmarked in a
+single Click process.
+
+Input 0 and output 0 connect to the master: frames the master transmits
+arrive on input 0, and frames the stations transmit leave on output 0. Input i
+and output i, for i from 1 to STATIONS, connect to station i, whose station ID
+is i + 1. Everything arriving on the inputs should be encapsulated in Jaldi
+frames. All ports are push.
+
+Every frame occupies the medium for its length divided by the sender's
+bitrate. A sender's frames are serialized behind each other; a sender which
+has to switch from receiving to transmitting (because the last transmission on
+the medium was someone else's) first waits TURNAROUND microseconds. A frame
+reaches its receivers PROPAGATION microseconds after it has been completely
+transmitted. Frames from the master are delivered to every station (as with the
+radios in monitor mode; JaldiDecap discards frames for other stations), and
+frames from a station are delivered to the master.
+
+If transmissions from two different senders overlap in time, every one of them
+is lost; this is how contention slot collisions between stations show up, as
+well as stations overrunning the end of their slot. In addition, each delivery
+is lost independently with the sending or receiving station's loss
+probability.
+
+A DELAY_MESSAGE addressed to the driver (ID 0) is not transmitted; instead, the
+sender does not start another frame until that many microseconds have passed.
+This is how the random contention slot offsets chosen by JaldiGate take effect.
+
+All times are on the JaldiClock. Together with JaldiClock(VIRTUAL true), this
+lets a whole cell run in virtual time.
+
+Keyword arguments are:
+
+=over 8
+
+=item BITRATE
+
+Unsigned. The master's bitrate in kilobits per second. The default corresponds
+to BITRATE__BYTES_PER_US in Frame.hh.
+
+=item RATES
+
+A space-separated list of STATIONS bitrates, in kilobits per second, one for
+each station. Stations not listed use BITRATE.
+
+=item PROPAGATION
+
+Unsigned. Propagation delay in microseconds. Default is 0.
+
+=item TURNAROUND
+
+Unsigned. Receive-to-transmit turnaround time in microseconds. Default is 0.
+
+=item LOSS
+
+Unsigned. Probability, in parts per thousand, that any one delivery is lost.
+Default is 0.
+
+=item LOSSES
+
+A space-separated list of STATIONS loss probabilities, in parts per thousand,
+one for each station's link to the master. Stations not listed use LOSS.
+
+=back
+
+=h stats read-only
+
+Returns one line per node (the master first): frames and bytes transmitted,
+frames delivered, frames lost to random loss, and frames lost to collisions.
+The last line gives the number of microseconds the medium was busy.
+
+=h reset_stats write-only
+
+When written, clears the statistics.
+
+=a
+
+JaldiFakeDriver, JaldiFakeDriverPrecise, JaldiGate, JaldiScheduler, JaldiClock */
+
+class JaldiChannel : public Element { public:
+
+    JaldiChannel();
+    ~JaldiChannel();
+
+    const char* class_name() const  { return "JaldiChannel"; }
+    const char* port_count() const  { return "2-/2-"; }
+    const char* processing() const  { return PUSH; }
+    const char* flow_code() const   { return COMPLETE_FLOW; }
+
+    int configure(Vector<String>&, ErrorHandler*);
+    int initialize(ErrorHandler*);
+    void cleanup(CleanupStage);
+    void add_handlers();
+
+    void push(int, Packet*);
+    void run_timer(Timer*);
+
+  private:
+    static const int port_master = 0;
+
+    // One frame on the air, shared by all of its deliveries.
+    struct Transmission
+    {
+        int sender;
+        uint64_t start_us;
+        uint64_t end_us;
+        bool collided;
+        unsigned refs;          // Deliveries and the in-flight list
+    };
+
+    struct Delivery
+    {
+        uint64_t at_us;
+        uint32_t order;         // Ties are delivered in transmission order
+        int port;
+        Packet* p;
+        Transmission* tx;
+
+        bool operator<(const Delivery& d) const
+        {
+            // Reversed, so that the standard heap algorithms give a min-heap
+            return at_us > d.at_us || (at_us == d.at_us && order > d.order);
+        }
+    };
+
+    struct NodeStats
+    {
+        uint32_t tx_frames;
+        uint64_t tx_bytes;
+        uint32_t delivered;
+        uint32_t lost;
+        uint32_t collided;
+    };
+
+    static uint64_t now_us();
+    uint32_t airtime_us(int sender, uint32_t bytes) const;
+    void transmit(int sender, Packet* p);
+    void release(Transmission* tx);
+    void schedule_timer();
+    void clear_stats();
+
+    static String read_handler(Element*, void*);
+    static int write_handler(const String&, Element*, void*, ErrorHandler*);
+
+    unsigned nstations;
+    uint32_t master_rate_kbps;
+    Vector<uint32_t> rate_kbps;         // Indexed by port
+    Vector<uint32_t> loss_permille;     // Indexed by port
+    uint32_t propagation_us;
+    uint32_t turnaround_us;
+
+    Vector<uint64_t> sender_free_us;    // When each node can start its next frame
+    int last_sender;
+    uint64_t medium_free_us;
+    Vector<Transmission*> in_flight;
+    Vector<Delivery> deliveries;        // Heap ordered by delivery time
+    uint32_t next_order;
+    JaldiTimer timer;
+
+    Vector<NodeStats> stats;
+    uint64_t busy_us;
+};
+
+CLICK_ENDDECLS
+#endif
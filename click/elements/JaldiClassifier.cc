@@ -0,0 +1,233 @@
+/*
+ * JaldiClassifier.{cc,hh} -- classifies IP packets by destination or DSCP, and encapsulates them
+ */
+
+#include <click/config.h>
+#include <click/confparse.hh>
+#include <click/error.hh>
+#include <click/glue.hh>
+#include <click/ipaddress.hh>
+
+#include "JaldiClick.hh"
+#include "JaldiEncap.hh"
+#include "JaldiClassifier.hh"
+
+using namespace jaldimac;
+
+CLICK_DECLS
+
+JaldiClassifier::JaldiClassifier() : src_id(0), dst_rules(0), sequences(0), copies(0)
+{
+}
+
+JaldiClassifier::~JaldiClassifier()
+{
+}
+
+int JaldiClassifier::configure(Vector<String>& conf, ErrorHandler* errh)
+{
+    if (conf.size() < 1)
+        return errh->error("missing SRC");
+
+    // The first argument is SRC; the rest are rules
+    Vector<String> src_conf;
+    src_conf.push_back(conf[0]);
+
+    if (cp_va_kparse(src_conf, this, errh,
+             "SRC", cpkP+cpkM, cpByte, &src_id,
+             cpEnd) < 0)
+        return -1;
+
+    Target none;
+    none.port = -1;
+    none.seq = NULL;
+
+    for (unsigned dscp = 0 ; dscp < 64 ; ++dscp)
+        dscp_table[dscp] = none;
+
+    for (unsigned i = 0 ; i < dst_table_size ; ++i)
+        dst_table[i].used = false;
+
+    dst_rules = 0;
+    default_target = none;
+
+    for (int i = 1 ; i < conf.size() ; ++i)
+    {
+        if (parse_rule(conf[i], errh) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+int JaldiClassifier::parse_rule(const String& rule, ErrorHandler* errh)
+{
+    Vector<String> words;
+    cp_spacevec(rule, words);
+
+    if (words.size() == 0)
+        return errh->error("empty rule");
+
+    if (words[0].equals("-", -1))
+    {
+        uint32_t port;
+
+        if (words.size() != 2 || ! cp_unsigned(words[1], &port) || port >= uint32_t(noutputs()))
+            return errh->error("rule %<%s%> should be %<- PORT%>, with PORT an output", rule.c_str());
+
+        default_target.port = port;
+        default_target.seq = NULL;
+        return 0;
+    }
+
+    if (words.size() != 5)
+        return errh->error("rule %<%s%> should be %<dst ADDR TYPE DEST PORT%> or %<dscp VALUE TYPE DEST PORT%>", rule.c_str());
+
+    if (words[0].equals("dscp", -1))
+    {
+        uint32_t dscp;
+
+        if (! cp_unsigned(words[1], &dscp) || dscp > 63)
+            return errh->error("rule %<%s%>: DSCP must be between 0 and 63", rule.c_str());
+
+        if (dscp_table[dscp].port >= 0)
+            return errh->error("rule %<%s%>: DSCP %u already has a rule", rule.c_str(), dscp);
+
+        return parse_target(words, dscp_table[dscp], errh);
+    }
+    else if (words[0].equals("dst", -1))
+    {
+        IPAddress addr;
+
+        if (! cp_ip_address(words[1], &addr))
+            return errh->error("rule %<%s%>: %<%s%> is not an IP address", rule.c_str(), words[1].c_str());
+
+        if (dst_rules == max_dst_rules)
+            return errh->error("too many %<dst%> rules; the most is %u", max_dst_rules);
+
+        unsigned i = dst_hash(addr.addr());
+
+        for ( ; dst_table[i].used ; i = (i + 1) % dst_table_size)
+        {
+            if (dst_table[i].addr == addr.addr())
+                return errh->error("rule %<%s%>: %<%s%> already has a rule", rule.c_str(), words[1].c_str());
+        }
+
+        dst_table[i].used = true;
+        dst_table[i].addr = addr.addr();
+        ++dst_rules;
+
+        return parse_target(words, dst_table[i].target, errh);
+    }
+    else
+        return errh->error("rule %<%s%> should start with %<dst%>, %<dscp%> or %<-%>", rule.c_str());
+}
+
+int JaldiClassifier::parse_target(const Vector<String>& words, Target& target, ErrorHandler* errh)
+{
+    uint32_t dest_id;
+    uint32_t port;
+
+    if (! JaldiEncap::parse_type(words[2], target.type))
+        return errh->error("invalid Jaldi frame type: %s", words[2].c_str());
+
+    if (! cp_unsigned(words[3], &dest_id) || dest_id > 255)
+        return errh->error("invalid station identifier: %s", words[3].c_str());
+
+    if (! cp_unsigned(words[4], &port) || port >= uint32_t(noutputs()))
+        return errh->error("invalid output port: %s", words[4].c_str());
+
+    target.dest_id = dest_id;
+    target.port = port;
+
+    if (! (target.seq = JaldiEncap::acquire_sequence(src_id, target.dest_id, target.type)))
+        return errh->error("out of memory");
+
+    ++sequences;
+    return 0;
+}
+
+void JaldiClassifier::release_sequences()
+{
+    for ( ; sequences > 0 ; --sequences)
+        JaldiEncap::release_sequence(src_id);
+}
+
+void JaldiClassifier::cleanup(CleanupStage)
+{
+    release_sequences();
+}
+
+const JaldiClassifier::Target* JaldiClassifier::lookup_dst(uint32_t addr) const
+{
+    for (unsigned i = dst_hash(addr) ; dst_table[i].used ; i = (i + 1) % dst_table_size)
+    {
+        if (dst_table[i].addr == addr)
+            return &dst_table[i].target;
+    }
+
+    return NULL;
+}
+
+void JaldiClassifier::push(int, Packet* p)
+{
+    const uint8_t* data = p->data();
+    const Target* target = NULL;
+
+    if (p->length() < 20 || (data[0] >> 4) != 4)
+    {
+        // Not IPv4, so only the default rule can take it
+        target = &default_target;
+    }
+    else
+    {
+        // Destination first, then DSCP
+        uint32_t dst;
+        memcpy(&dst, data + 16, sizeof(dst));
+
+        if (dst_rules > 0)
+            target = lookup_dst(dst);
+
+        if (! target)
+            target = &dscp_table[data[1] >> 2];
+
+        if (target->port < 0)
+            target = &default_target;
+    }
+
+    if (target->port < 0)
+    {
+        p->kill();
+        return;
+    }
+
+    if (! target->seq)
+    {
+        output(target->port).push(p);
+        return;
+    }
+
+    bool copied;
+    WritablePacket* wp = jaldi_encapsulate(p, src_id, target->dest_id, target->type, (*target->seq)++, copied);
+
+    if (copied)
+        ++copies;
+
+    if (wp)
+        output(target->port).push(wp);
+}
+
+String JaldiClassifier::read_handler(Element* e, void*)
+{
+    JaldiClassifier* jc = static_cast<JaldiClassifier*>(e);
+    return String(jc->copies);
+}
+
+void JaldiClassifier::add_handlers()
+{
+    add_read_handler("copies", read_handler, (void*) 0);
+}
+
+CLICK_ENDDECLS
+ELEMENT_REQUIRES(Frame JaldiEncap)
+EXPORT_ELEMENT(JaldiClassifier)
@@ -0,0 +1,131 @@
+#ifndef CLICK_JALDICLASSIFIER_HH
+#define CLICK_JALDICLASSIFIER_HH
+#include <click/element.hh>
+#include "Frame.hh"
+CLICK_DECLS
+
+/*
+=c
+
+JaldiClassifier(SRC, RULE1, RULE2, ...)
+
+=s jaldi
+
+classifies IP packets by destination or DSCP, and encapsulates them
+
+=d
+
+Picks the station, frame type and output port for each IP packet pushed to
+it, and encapsulates the packet in a Jaldi header for that station, doing
+the job of an IPClassifier followed by one JaldiEncap per station and type.
+Packets are looked up in two tables built at configuration time, so the cost
+per packet is the same however many stations there are.
+
+SRC is the station identifier of the sending station. Each RULE is one of:
+
+=over 8
+
+=item B<dst> ADDR TYPE DEST PORT
+
+Packets addressed to the IP address ADDR are encapsulated in frames of type
+TYPE for station DEST, and sent to output PORT.
+
+=item B<dscp> VALUE TYPE DEST PORT
+
+Packets with DSCP VALUE (0 to 63) are encapsulated in frames of type TYPE for
+station DEST, and sent to output PORT.
+
+=item B<-> PORT
+
+Packets that match no other rule, including packets that aren't IPv4 or are
+too short to hold an IPv4 header, are sent to output PORT as they are.
+
+=back
+
+TYPE is a frame type, as for JaldiEncap. A matching B<dst> rule takes
+precedence over the DSCP. When there's no B<-> rule, packets that match no
+rule are dropped. Frames are numbered from the same sequences as JaldiEncap's,
+so the two can be mixed freely.
+
+JaldiClassifier expects packets to start with their IP header; it reads the
+header directly, and doesn't need the IP header annotation. As with
+JaldiEncap, packets without room for the header and footer are copied; see
+JaldiReserve.
+
+=e
+
+  JaldiClassifier(1,
+                  dscp 1 BULK_FRAME 2 2,
+                  dscp 2 VOIP_FRAME 2 1,
+                  dst 10.0.0.3 BULK_FRAME 3 3,
+                  - 0)
+
+=h copies read-only
+
+Returns the number of packets which had to be copied to make room for the
+header and footer.
+
+=a
+
+JaldiEncap, JaldiReserve, IPClassifier */
+
+class JaldiClassifier : public Element { public:
+
+    JaldiClassifier();
+    ~JaldiClassifier();
+
+    const char* class_name() const  { return "JaldiClassifier"; }
+    const char* port_count() const  { return "1/1-"; }
+    const char* processing() const  { return PUSH; }
+
+    int configure(Vector<String>&, ErrorHandler*);
+    void cleanup(CleanupStage);
+    void add_handlers();
+
+    void push(int, Packet*);
+
+  private:
+    struct Target
+    {
+        int port;               // -1 if none
+        uint8_t dest_id;
+        uint8_t type;
+        uint32_t* seq;          // Null to pass packets on unencapsulated
+    };
+
+    struct DstEntry
+    {
+        uint32_t addr;          // In network byte order
+        bool used;
+        Target target;
+    };
+
+    int parse_rule(const String& rule, ErrorHandler* errh);
+    int parse_target(const Vector<String>& words, Target& target, ErrorHandler* errh);
+    const Target* lookup_dst(uint32_t addr) const;
+    void release_sequences();
+
+    static const int in_port = 0;
+
+    // Open addressing, with linear probing; kept at most half full
+    static const unsigned dst_table_size = 512;
+    static const unsigned max_dst_rules = dst_table_size / 2;
+
+    static unsigned dst_hash(uint32_t addr)
+    {
+        return (addr * 0x9E3779B1u) >> 23;      // The top 9 bits
+    }
+
+    uint8_t src_id;
+    Target dscp_table[64];
+    DstEntry dst_table[dst_table_size];
+    unsigned dst_rules;
+    Target default_target;
+    unsigned sequences;         // Acquired from JaldiEncap for src_id
+    uint32_t copies;
+
+    static String read_handler(Element*, void*);
+};
+
+CLICK_ENDDECLS
+#endif
@@ -2,7 +2,109 @@
 #define JALDI_CLICK_HH
 
 #include <click/packet.hh>
+#include <click/timestamp.hh>
 #include "Frame.hh"
+#include "JaldiClock.hh"
+
+// Index of the 32-bit user annotation in which JaldiQueue records the time (in
+// microseconds, modulo 2^32) at which a packet was enqueued.
+const int JALDI_ENQUEUE_TIME_ANNO = 5;
+
+// The current time on the JaldiClock, in microseconds modulo 2^32.
+inline uint32_t jaldi_now_us()
+{
+    return uint32_t(JaldiClock::now_us());
+}
+
+// Index of the 32-bit user annotation holding the time at which a frame is
+// to be transmitted, in microseconds modulo 2^32 on the JaldiClock (as
+// jaldi_now_us()), or 0 if it has none; see JaldiCalendarQueue. This is kept
+// apart from the timestamp annotation, which FromDevice and KernelTun set to
+// the time a packet arrived.
+const int JALDI_TX_TIME_ANNO = 6;
+
+inline void set_jaldi_enqueue_time_anno(Packet* p, uint32_t now_us)
+{
+    p->set_user_anno_u32(JALDI_ENQUEUE_TIME_ANNO, now_us);
+}
+
+inline uint32_t jaldi_tx_time_anno(const Packet* p)
+{
+    return p->user_anno_u32(JALDI_TX_TIME_ANNO);
+}
+
+inline void set_jaldi_tx_time_anno(Packet* p, uint32_t tx_us)
+{
+    // 0 means "no transmit time"
+    p->set_user_anno_u32(JALDI_TX_TIME_ANNO, tx_us ? tx_us : 1);
+}
+
+// Time since the packet was enqueued, in microseconds. Correct as long as the
+// packet spent less than about 71 minutes in the queue.
+inline uint32_t jaldi_sojourn_us(const Packet* p, uint32_t now_us)
+{
+    return now_us - p->user_anno_u32(JALDI_ENQUEUE_TIME_ANNO);
+}
+
+// The time as written in frames' TX timestamp footers: microseconds, modulo
+// 2^32, of the time of day (or of virtual time; see JaldiClock), so that the
+// master and stations can compare each other's timestamps if their clocks are
+// synchronized.
+inline uint32_t jaldi_timestamp_us()
+{
+    return uint32_t(JaldiClock::now_timestamp().usecval());
+}
+
+// Stamps the footer of the frame in P with the current time, as the frame is
+// handed to the radio. Frames which aren't valid are passed on unstamped.
+//
+// If P's data is shared (with the clone a sender keeps for retransmission,
+// say, or a Tee's copy), it's copied first, so that the other holders never
+// see the stamp change under them. Returns the stamped packet, or null if
+// memory ran out (in which case P has been freed, as with uniqueify()).
+inline Packet* jaldi_stamp_tx(Packet* p)
+{
+    if (! jaldimac::frame_is_valid((const jaldimac::Frame*) p->data(), p->length()))
+        return p;
+
+    WritablePacket* wp = p->uniqueify();
+
+    if (! wp)
+        return NULL;
+
+    // 0 means "not stamped"
+    uint32_t now_us = jaldi_timestamp_us();
+    ((jaldimac::Frame*) wp->data())->set_tx_timestamp(now_us ? now_us : 1);
+    return wp;
+}
+
+// Hashes the flow of the IPv4 packet in the LENGTH bytes at DATA (typically a
+// frame's payload): its addresses and protocol, and its ports if it's an
+// unfragmented TCP or UDP packet. Returns false if DATA doesn't start with an
+// IPv4 header, in which case there's no telling which flow it belongs to.
+inline bool jaldi_flow_hash(const uint8_t* data, uint32_t length, uint32_t& hash_out)
+{
+    if (length < 20 || (data[0] >> 4) != 4)
+        return false;
+
+    uint32_t header_length = (data[0] & 0x0F) * 4;
+    uint8_t protocol = data[9];
+    uint32_t src, dst, ports = 0;
+    memcpy(&src, data + 12, sizeof(src));
+    memcpy(&dst, data + 16, sizeof(dst));
+
+    // Later fragments don't carry the ports, so none of the fragments use them
+    bool fragment = ((data[6] & 0x3F) | data[7]) != 0;
+
+    if ((protocol == 6 || protocol == 17) && ! fragment && length >= header_length + 4)
+        memcpy(&ports, data + header_length, sizeof(ports));
+
+    uint32_t h = src * 0x9E3779B1u;
+    h ^= (dst + protocol) * 0x85EBCA6Bu;
+    h ^= ports * 0xC2B2AE35u;
+    hash_out = h ^ (h >> 16);
+    return true;
+}
 
 template<uint8_t FrameType, uint8_t DestId, typename PayloadType>
 WritablePacket* make_jaldi_frame(uint8_t src_id, PayloadType*& payload_out)
@@ -14,7 +116,8 @@ WritablePacket* make_jaldi_frame(uint8_t src_id, PayloadType*& payload_out)
     f->src_id = src_id;
     f->dest_id = DestId;
     f->length = jaldimac::Frame::empty_frame_size + sizeof(PayloadType);
-    payload_out = (PayloadType*) f->payload;
+    f->set_tx_timestamp(0);
+    payload_out = (PayloadType*) f->payload();
     return wp;
 }
 
@@ -28,10 +131,168 @@ WritablePacket* make_jaldi_frame_dyn_dest(uint8_t src_id, uint8_t dest_id, Paylo
     f->src_id = src_id;
     f->dest_id = dest_id;
     f->length = jaldimac::Frame::empty_frame_size + sizeof(PayloadType);
-    payload_out = (PayloadType*) f->payload;
+    f->set_tx_timestamp(0);
+    payload_out = (PayloadType*) f->payload();
     return wp;
 }
 
+// Makes sure the packet in P can be written to and has at least HEADROOM
+// bytes free in front of it and TAILROOM behind it, copying it if not. Unlike
+// a push() followed by a put(), this copies at most once. The copy keeps P's
+// annotations, but not its header annotations, and has the default headroom
+// on top of HEADROOM for any headers added further on. Sets COPIED to whether
+// it copied. Returns the packet, or null if memory ran out (in which case P
+// has been freed).
+inline WritablePacket* jaldi_reserve(Packet* p, uint32_t headroom, uint32_t tailroom, bool& copied)
+{
+    copied = p->shared() || p->headroom() < headroom || p->tailroom() < tailroom;
+
+    if (! copied)
+        return p->uniqueify();
+
+    WritablePacket* q = Packet::make(Packet::default_headroom + headroom, p->data(), p->length(), tailroom);
+
+    if (q)
+        q->copy_annotations(p);
+
+    p->kill();
+    return q;
+}
+
+// Wraps the packet in P in a Jaldi header and footer, in place if it has the
+// room (see jaldi_reserve() and JaldiReserve), and otherwise in a single
+// copy. Sets COPIED to whether it copied. Returns the frame, or null if memory
+// ran out (in which case P has been freed, as with Packet::push()).
+inline WritablePacket* jaldi_encapsulate(Packet* p, uint8_t src_id, uint8_t dest_id, uint8_t type, uint32_t seq, bool& copied)
+{
+    using namespace jaldimac;
+
+    uint32_t length = p->length();
+    WritablePacket* wp = jaldi_reserve(p, Frame::header_size, Frame::footer_size, copied);
+
+    if (! wp)
+        return NULL;
+
+    // jaldi_reserve() made the room, but check anyway
+    if (! (wp = wp->push(Frame::header_size)) || ! (wp = wp->put(Frame::footer_size)))
+        return NULL;
+
+    Frame* f = (Frame*) wp->data();
+    f->initialize();
+    f->dest_id = dest_id;
+    f->src_id = src_id;
+    f->type = type;
+    f->length = Frame::empty_frame_size + length;
+    f->seq = seq;
+    f->set_tx_timestamp(0);         // Stamped by the driver
+    return wp;
+}
+
+// Adds an extension of the given type, with room for a value of VALUE_LENGTH
+// bytes, to the frame in P, and points VALUE_OUT at the value for the caller
+// to fill in. The extension block grows by whole words as needed; only the
+// header and the existing extensions move, never the payload. Returns the
+// packet, which may have been reallocated, or null if memory ran out (in which
+// case P has been freed, as with Packet::push()). If the block is already at
+// its maximum size, returns P unchanged and sets VALUE_OUT to null.
+inline WritablePacket* jaldi_add_extension(WritablePacket* p, uint8_t type, uint8_t value_length, uint8_t*& value_out)
+{
+    using namespace jaldimac;
+
+    Frame* f = (Frame*) p->data();
+    size_t old_length = f->extension_length();
+    size_t used = 0;
+
+    for (FrameExtensionIterator it(f) ; it.valid() ; it.next())
+        used += extension_size(it->length);
+
+    size_t new_length = (used + extension_size(value_length) + 3) & ~size_t(3);
+    value_out = NULL;
+
+    if (new_length > 255 * 4)
+        return p;
+
+    if (new_length > old_length)
+    {
+        size_t grow = new_length - old_length;
+
+        if (! (p = p->push(grow)))
+            return NULL;
+
+        memmove(p->data(), p->data() + grow, sizeof(Frame) + old_length);
+        f = (Frame*) p->data();
+        f->ext_words = new_length / 4;
+        f->length += grow;
+    }
+
+    // Everything after the used part of the block becomes padding.
+    memset(f->extensions() + used, EXT_PAD, new_length - used);
+
+    FrameExtension* ext = (FrameExtension*) (f->extensions() + used);
+    ext->type = type;
+    ext->length = value_length;
+    value_out = ext->value;
+    return p;
+}
+
+// A control frame of one type, built once by the element that sends it.
+// make() copies the prebuilt frame into a new packet with a single memcpy, so
+// the preamble, IDs, type and length never have to be written on the hot
+// path; only the payload fields that vary (and the destination, for frames
+// whose destination changes) are filled in afterwards.
+template<uint8_t FrameType, typename PayloadType>
+class JaldiFrameTemplate { public:
+
+    static const uint32_t frame_size = jaldimac::FrameSize<PayloadType>::value;
+
+    JaldiFrameTemplate()                                { initialize(0, 0); }
+    JaldiFrameTemplate(uint8_t src_id, uint8_t dest_id) { initialize(src_id, dest_id); }
+
+    void initialize(uint8_t src_id, uint8_t dest_id)
+    {
+        memset(_frame, 0, sizeof(_frame));
+        jaldimac::Frame* f = (jaldimac::Frame*) _frame;
+        f->initialize();
+        f->type = FrameType;
+        f->src_id = src_id;
+        f->dest_id = dest_id;
+        f->length = frame_size;
+    }
+
+    WritablePacket* make(PayloadType*& payload_out) const
+    {
+        WritablePacket* wp = Packet::make(_frame, frame_size);
+        payload_out = (PayloadType*) ((jaldimac::Frame*) wp->data())->payload();
+        return wp;
+    }
+
+    WritablePacket* make(uint8_t dest_id, PayloadType*& payload_out) const
+    {
+        WritablePacket* wp = make(payload_out);
+        ((jaldimac::Frame*) wp->data())->dest_id = dest_id;
+        return wp;
+    }
+
+    // For payloads with a variable-length tail, like VoIPSlotPayload's
+    // station list: the frame is TAIL_LENGTH bytes longer, and the tail is
+    // left for the caller to fill in.
+    WritablePacket* make(PayloadType*& payload_out, uint32_t tail_length) const
+    {
+        WritablePacket* wp = Packet::make(frame_size + tail_length);
+
+        if (! wp)
+            return NULL;
+
+        jaldimac::Frame* f = (jaldimac::Frame*) wp->data();
+        memcpy(f, _frame, frame_size - jaldimac::Frame::footer_size);
+        f->length = frame_size + tail_length;
+        f->set_tx_timestamp(0);
+        payload_out = (PayloadType*) f->payload();
+        return wp;
+    }
 
+  private:
+    uint8_t _frame[frame_size];
+};
 
 #endif
@@ -0,0 +1,165 @@
+/*
+ * JaldiClock.{cc,hh} -- supplies the time to the Jaldi elements, optionally as simulated virtual time
+ */
+
+#include <click/config.h>
+#include <click/confparse.hh>
+#include <click/error.hh>
+#include <click/glue.hh>
+#include <click/router.hh>
+#include <click/routerthread.hh>
+#include <click/standard/scheduleinfo.hh>
+#include <algorithm>
+
+#include "JaldiClock.hh"
+
+using namespace std;
+
+CLICK_DECLS
+
+bool JaldiClock::_virtual = false;
+uint64_t JaldiClock::_virtual_now_us = 0;
+Vector<JaldiClock::Event> JaldiClock::_events;
+uint32_t JaldiClock::_next_order = 0;
+
+JaldiClock::JaldiClock() : _task(this), _duration_us(0), _start_us(0), _fired(0)
+{
+}
+
+JaldiClock::~JaldiClock()
+{
+}
+
+int JaldiClock::configure(Vector<String>& conf, ErrorHandler* errh)
+{
+    bool is_virtual = false;
+    Timestamp duration;
+
+    // Parse configuration parameters
+    if (cp_va_kparse(conf, this, errh,
+             "VIRTUAL", 0, cpBool, &is_virtual,
+             "DURATION", 0, cpTimestamp, &duration,
+             cpEnd) < 0)
+        return -1;
+
+    _duration_us = duration.usecval();
+
+    // Other elements may read the clock as they initialize, so switch it now.
+    // Virtual time starts at the time of day, so that timestamp annotations
+    // look sensible.
+    if (is_virtual && ! _virtual)
+        _virtual_now_us = Timestamp::now().usecval();
+
+    _virtual = is_virtual;
+    _events.clear();
+    _next_order = 0;
+
+    return 0;
+}
+
+int JaldiClock::initialize(ErrorHandler* errh)
+{
+    _start_us = now_us();
+    _fired = 0;
+
+    if (_virtual)
+        ScheduleInfo::initialize_task(this, &_task, true, errh);
+
+    return 0;
+}
+
+void JaldiClock::cleanup(CleanupStage)
+{
+    // The timers belong to elements which are going away too.
+    _events.clear();
+    _virtual = false;
+}
+
+void JaldiClock::schedule(JaldiTimer* timer, uint64_t at_us)
+{
+    Event e;
+    e.at_us = at_us;
+    e.order = _next_order++;
+    e.timer = timer;
+    e.generation = ++timer->_generation;
+
+    _events.push_back(e);
+    push_heap(_events.begin(), _events.end());
+}
+
+void JaldiClock::fire(const Event& e)
+{
+    JaldiTimer* t = e.timer;
+
+    if (! t->_scheduled || t->_generation != e.generation)
+        return;
+
+    t->_scheduled = false;
+    ++_fired;
+    t->_element->run_timer(&t->_timer);
+}
+
+bool JaldiClock::run_task(Task*)
+{
+    // With nothing due, jump to the next event, but only once every other
+    // task is idle: one that's still runnable may have more to do at the
+    // current time. Events scheduled for the current time while we run are
+    // run straight away too, up to a limit so that other tasks still get a
+    // turn.
+    if (_events.size() > 0 && _events.front().at_us > _virtual_now_us
+        && ! _task.thread()->active())
+        _virtual_now_us = _events.front().at_us;
+
+    unsigned fired = 0;
+    while (_events.size() > 0 && _events.front().at_us <= _virtual_now_us
+           && fired < max_events_per_run)
+    {
+        // Take the event off the heap before running it, since it's likely
+        // to schedule another.
+        pop_heap(_events.begin(), _events.end());
+        Event e = _events.back();
+        _events.pop_back();
+
+        fire(e);
+        ++fired;
+    }
+
+    if (_duration_us && _virtual_now_us - _start_us >= _duration_us)
+    {
+        router()->please_stop_driver();
+        return fired > 0;
+    }
+
+    _task.fast_reschedule();
+    return fired > 0;
+}
+
+String JaldiClock::read_handler(Element* e, void* thunk)
+{
+    JaldiClock* c = static_cast<JaldiClock*>(e);
+
+    switch (reinterpret_cast<intptr_t>(thunk))
+    {
+        case 0:
+            return String(now_us());
+        case 1:
+            return String(_virtual ? "true" : "false");
+        case 2:
+            return String(_events.size());
+        case 3:
+            return String(c->_fired);
+        default:
+            return "";
+    }
+}
+
+void JaldiClock::add_handlers()
+{
+    add_read_handler("now", read_handler, (void*) 0);
+    add_read_handler("virtual", read_handler, (void*) 1);
+    add_read_handler("pending", read_handler, (void*) 2);
+    add_read_handler("fired", read_handler, (void*) 3);
+}
+
+CLICK_ENDDECLS
+EXPORT_ELEMENT(JaldiClock)
@@ -0,0 +1,229 @@
+#ifndef CLICK_JALDICLOCK_HH
+#define CLICK_JALDICLOCK_HH
+#include <click/element.hh>
+#include <click/task.hh>
+#include <click/timer.hh>
+#include <click/timestamp.hh>
+#include <click/vector.hh>
+#if CLICK_USERLEVEL
+# include <time.h>
+#endif
+CLICK_DECLS
+
+/*
+=c
+
+JaldiClock([I<keywords> VIRTUAL, DURATION])
+
+=s jaldi
+
+supplies the time to the Jaldi elements, optionally as simulated virtual time
+
+=d
+
+Every Jaldi element that reads the time or waits for it to pass (the
+schedulers' rate limits, the fake drivers' slots and delays, JaldiChannel,
+JaldiCalendarQueue, queue sojourn times and the VoIP demultiplexer's flow
+timeouts) does so through JaldiClock. A configuration needs at most one
+JaldiClock element; without one, the Jaldi elements run in real time, as if
+JaldiClock(VIRTUAL false) were present.
+
+In real time, the clock is the host's monotonic clock and waits are carried
+out with ordinary Click timers.
+
+In virtual time, the clock only moves when JaldiClock moves it. Waits are
+recorded as events, and JaldiClock's task repeatedly runs every event that is
+due and, once none is, jumps the clock straight to the next one. Nothing in a
+virtual run busy waits or sleeps, so a whole cell (for instance masters and
+stations joined by JaldiChannel) runs as fast as the CPU allows, and timing
+results do not depend on the host's load or timer resolution. Other tasks,
+such as traffic sources, get their turn between events as usual, and see the
+clock stand still while they run. Virtual time starts at the real time of day
+when the configuration is installed, so that the TX timestamps in frame
+footers look sensible, but timestamps from elements which don't use
+JaldiClock (SetTimestamp, for example) are still real time; don't mix the two
+in a virtual run.
+
+The clock only jumps ahead while no other task is runnable, so a task that
+always reschedules itself (a RatedSource, say, or anything that polls) holds
+virtual time still for as long as it stays active. The Jaldi elements sleep
+rather than poll while they wait.
+
+Keyword arguments are:
+
+=over 8
+
+=item VIRTUAL
+
+Boolean. If true, run in virtual time. Default is false.
+
+=item DURATION
+
+Timestamp. In virtual time, stop the driver once this much virtual time has
+passed. Default is to run until stopped some other way.
+
+=back
+
+=h now read-only
+
+Returns the current time on the clock, in microseconds.
+
+=h virtual read-only
+
+Returns true if the clock runs in virtual time.
+
+=h pending read-only
+
+Returns the number of events waiting to run in virtual time.
+
+=h fired read-only
+
+Returns the number of events run so far in virtual time.
+
+=a
+
+JaldiChannel, JaldiCalendarQueue, JaldiFakeDriver, JaldiFakeDriverPrecise, JaldiScheduler */
+
+class JaldiTimer;
+
+class JaldiClock : public Element { public:
+
+    JaldiClock();
+    ~JaldiClock();
+
+    const char* class_name() const  { return "JaldiClock"; }
+    const char* port_count() const  { return PORTS_0_0; }
+
+    int configure(Vector<String>&, ErrorHandler*);
+    int initialize(ErrorHandler*);
+    void cleanup(CleanupStage);
+    void add_handlers();
+
+    bool run_task(Task*);
+
+    // Microseconds since an arbitrary starting point. Only differences
+    // between two readings are meaningful.
+    static inline uint64_t now_us();
+    static bool is_virtual()    { return _virtual; }
+
+    // The time of day: the wall clock in real time, and the clock itself in
+    // virtual time.
+    static inline Timestamp now_timestamp();
+
+  private:
+    friend class JaldiTimer;
+
+    struct Event
+    {
+        uint64_t at_us;
+        uint32_t order;         // Ties run in the order they were scheduled
+        JaldiTimer* timer;
+        uint32_t generation;    // Stale if the timer was rescheduled since
+
+        bool operator<(const Event& e) const
+        {
+            // Reversed, so that the standard heap algorithms give a min-heap
+            return at_us > e.at_us || (at_us == e.at_us && order > e.order);
+        }
+    };
+
+    static const unsigned max_events_per_run = 1024;
+
+    static uint64_t real_now_us();
+    static void schedule(JaldiTimer* timer, uint64_t at_us);
+    void fire(const Event& e);
+
+    static String read_handler(Element*, void*);
+
+    static bool _virtual;
+    static uint64_t _virtual_now_us;
+    static Vector<Event> _events;       // Heap ordered by time
+    static uint32_t _next_order;
+
+    Task _task;
+    uint64_t _duration_us;
+    uint64_t _start_us;
+    uint64_t _fired;
+};
+
+// A timer on JaldiClock's time. When it expires, it calls its element's
+// run_timer() with the underlying Click Timer, exactly as a Timer would.
+class JaldiTimer { public:
+
+    JaldiTimer(Element* e) : _element(e), _timer(e), _scheduled(false),
+                             _generation(0), _expiry_us(0) {}
+
+    void initialize(Element* e)         { _timer.initialize(e); }
+
+    void schedule_at_us(uint64_t at_us);
+    void schedule_after_us(uint64_t us) { schedule_at_us(JaldiClock::now_us() + us); }
+    void unschedule();
+    bool scheduled() const;
+    uint64_t expiry_us() const          { return _expiry_us; }
+
+  private:
+    friend class JaldiClock;
+
+    Element* _element;
+    Timer _timer;
+    bool _scheduled;            // Virtual time only
+    uint32_t _generation;
+    uint64_t _expiry_us;
+};
+
+inline uint64_t JaldiClock::real_now_us()
+{
+#if CLICK_USERLEVEL && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+#else
+    return Timestamp::now().usecval();
+#endif
+}
+
+inline uint64_t JaldiClock::now_us()
+{
+    return _virtual ? _virtual_now_us : real_now_us();
+}
+
+inline Timestamp JaldiClock::now_timestamp()
+{
+    if (! _virtual)
+        return Timestamp::now();
+
+    return Timestamp::make_usec(_virtual_now_us / 1000000, _virtual_now_us % 1000000);
+}
+
+inline void JaldiTimer::schedule_at_us(uint64_t at_us)
+{
+    _expiry_us = at_us;
+
+    if (JaldiClock::is_virtual())
+    {
+        _scheduled = true;
+        JaldiClock::schedule(this, at_us);
+    }
+    else
+    {
+        uint64_t now_us = JaldiClock::real_now_us();
+        uint64_t after_us = (at_us > now_us ? at_us - now_us : 0);
+        _timer.schedule_after(Timestamp::make_usec(after_us / 1000000, after_us % 1000000));
+    }
+}
+
+inline void JaldiTimer::unschedule()
+{
+    // Any event already queued for this timer is now stale.
+    _scheduled = false;
+    ++_generation;
+    _timer.unschedule();
+}
+
+inline bool JaldiTimer::scheduled() const
+{
+    return JaldiClock::is_virtual() ? _scheduled : _timer.scheduled();
+}
+
+CLICK_ENDDECLS
+#endif
@@ -13,7 +13,8 @@ using namespace jaldimac;
 
 CLICK_DECLS
 
-JaldiDecap::JaldiDecap()
+JaldiDecap::JaldiDecap() : should_filter_by_dest(false), dest_id(0),
+                           latency_enabled(true), seq_enabled(true)
 {
 }
 
@@ -23,49 +24,193 @@ JaldiDecap::~JaldiDecap()
 
 int JaldiDecap::configure(Vector<String>& conf, ErrorHandler* errh)
 {
+    latency_enabled = true;
+    seq_enabled = true;
+
     // Parse configuration parameters
     if (cp_va_kparse(conf, this, errh,
              "DEST", cpkP+cpkC, &should_filter_by_dest, cpByte, &dest_id,
+             "LATENCY", 0, cpBool, &latency_enabled,
+             "SEQ", 0, cpBool, &seq_enabled,
              cpEnd) < 0)
         return -1;
     else
         return 0;
 }
 
+bool JaldiDecap::for_us(const Frame* f) const
+{
+    // Filter by dest_id if requested
+    return ! should_filter_by_dest || f->dest_id == BROADCAST_ID || f->dest_id == dest_id;
+}
+
 void JaldiDecap::push(int, Packet* p)
 {
-    // Treat the packet as a Frame
-    const Frame* f = (const Frame*) p->data();
+    // Classify the packet (Control, Data, or Bad)
+    dispatch_frame<void>(*this, p, (const Frame*) p->data(), p->length());
+}
 
-    // Filter by dest_id if requested
-    if (should_filter_by_dest && !(f->dest_id == BROADCAST_ID || f->dest_id == dest_id))
+void JaldiDecap::visit_data(Packet* p, const Frame* f)
+{
+    if (! for_us(f))
+    {
         checked_output_push(out_port_bad, p);
+        return;
+    }
+
+    // A fragment goes on once the frame it's part of is complete
+    const FrameExtension* frag = (f->ext_words ? find_extension(f, EXT_FRAGMENT) : NULL);
 
-    // Classify the packet (Control, Data, or Bad)?
-    switch (f->type)
+    if (frag)
     {
-        case BULK_FRAME:
-        case VOIP_FRAME:
-            // Strip Jaldi header and footer
-            p->pull(Frame::header_size);
-            p->take(Frame::footer_size);
-            output(out_port_data).push(p);
-            break;
+        FragmentExtension fe;
 
-        case REQUEST_FRAME:
-        case CONTENTION_SLOT:
-        case VOIP_SLOT:
-        case TRANSMIT_SLOT:
-        case BITRATE_MESSAGE:
-        case ROUND_COMPLETE_MESSAGE:
-        case DELAY_MESSAGE:
-            output(out_port_control).push(p);
-            break;
+        if (frag->length < sizeof(fe))
+        {
+            checked_output_push(out_port_bad, p);
+            return;
+        }
 
-        default:
+        memcpy(&fe, frag->value, sizeof(fe));
+
+        if (Packet* q = reassembler.add(p, f, fe))
+            push(in_port, q);
+
+        return;
+    }
+
+    // An aggregate (see JaldiAggregate) stands for several packets
+    const FrameExtension* agg = (f->ext_words ? find_extension(f, EXT_AGGREGATE) : NULL);
+    AggregateExtension ae;
+    ae.count = 1;
+
+    if (agg)
+    {
+        if (agg->length < sizeof(ae) || ! subframes_valid(f->payload(), f->payload_length()))
+        {
             checked_output_push(out_port_bad, p);
+            return;
+        }
+
+        memcpy(&ae, agg->value, sizeof(ae));
+    }
+
+    measure_latency(f);
+
+    if (! track_seq(f, ae.count))
+    {
+        checked_output_push(out_port_bad, p);
+        return;
+    }
+
+    // Strip Jaldi header, extensions and footer, along with anything after
+    // the frame
+    size_t header_length = Frame::header_size + f->extension_length();
+    p->take(p->length() - f->length + Frame::footer_size);
+    p->pull(header_length);
+
+    if (agg)
+        deaggregate(p);
+    else
+        output(out_port_data).push(p);
+}
+
+bool JaldiDecap::subframes_valid(const uint8_t* data, uint32_t length)
+{
+    // The subframes must exactly fill the payload, and none may be empty
+    uint32_t pos = 0;
+
+    while (pos + sizeof(AggregateSubframe) <= length)
+    {
+        AggregateSubframe subframe;
+        memcpy(&subframe, data + pos, sizeof(subframe));
+
+        if (subframe.length == 0)
+            return false;
+
+        pos += sizeof(subframe) + subframe.length;
+    }
+
+    return pos == length && length > 0;
+}
+
+void JaldiDecap::deaggregate(Packet* p)
+{
+    // Each subframe becomes a clone of P trimmed down to its packet, without
+    // copying; the last is P itself.
+    const uint8_t* data = p->data();
+    uint32_t length = p->length();
+    uint32_t pos = 0;
+
+    while (pos < length)
+    {
+        AggregateSubframe subframe;
+        memcpy(&subframe, data + pos, sizeof(subframe));
+
+        uint32_t start = pos + sizeof(subframe);
+        pos = start + subframe.length;
+
+        if (Packet* q = (pos < length ? p->clone() : p))
+        {
+            q->pull(start);
+            q->take(q->length() - subframe.length);
+            output(out_port_data).push(q);
+        }
+    }
+}
+
+void JaldiDecap::visit_bad(Packet* p, const Frame*)
+{
+    checked_output_push(out_port_bad, p);
+}
+
+String JaldiDecap::read_handler(Element* e, void* thunk)
+{
+    JaldiDecap* d = static_cast<JaldiDecap*>(e);
+
+    switch (reinterpret_cast<intptr_t>(thunk))
+    {
+        case 0:
+            return d->latency.unparse();
+        case 1:
+            return d->latency.unparse_histograms();
+        case 2:
+            return d->seq.unparse();
+        case 3:
+            return d->seq.unparse_loss();
+        case 4:
+            return d->reassembler.unparse();
+        default:
+            return "";
+    }
+}
+
+int JaldiDecap::write_handler(const String&, Element* e, void* thunk, ErrorHandler*)
+{
+    JaldiDecap* d = static_cast<JaldiDecap*>(e);
+
+    switch (reinterpret_cast<intptr_t>(thunk))
+    {
+        case 0:
+            d->latency.clear();
+            break;
+        case 1:
+            d->seq.clear();
             break;
     }
+
+    return 0;
+}
+
+void JaldiDecap::add_handlers()
+{
+    add_read_handler("latency", read_handler, (void*) 0);
+    add_read_handler("latency_histograms", read_handler, (void*) 1);
+    add_write_handler("reset_latency", write_handler, (void*) 0, Handler::BUTTON);
+    add_read_handler("seq", read_handler, (void*) 2);
+    add_read_handler("loss", read_handler, (void*) 3);
+    add_write_handler("reset_seq", write_handler, (void*) 1, Handler::BUTTON);
+    add_read_handler("fragments", read_handler, (void*) 4);
 }
 
 CLICK_ENDDECLS
@@ -1,12 +1,17 @@
 #ifndef CLICK_JALDIDECAP_HH
 #define CLICK_JALDIDECAP_HH
 #include <click/element.hh>
+#include "Frame.hh"
+#include "JaldiClick.hh"
+#include "JaldiLinkLatency.hh"
+#include "JaldiSeqTracker.hh"
+#include "JaldiFragment.hh"
 CLICK_DECLS
 
 /*
 =c
 
-JaldiDecap(DEST)
+JaldiDecap(DEST [, I<keywords> LATENCY, SEQ])
 
 =s jaldi
 
@@ -17,8 +22,15 @@ decapsulates packets which are wrapped in a Jaldi header
 Decapsulates Jaldi frames into IP packets. Jaldi control messages, for which
 decapsulation is not meaningful, are placed on output 0. IP packets are placed
 on output 1. Jaldi frames which could not be decapsulated for whatever reason
-(for example, they have an invalid type, or they failed the CRC check) are
-placed on output 2 if that output is connected.
+(for example, they have an invalid type, their length field does not match the
+packet or is too short for their type's payload, or they failed the CRC check)
+are placed on output 2 if that output is connected.
+
+Frames built by JaldiAggregate are split back into the packets they carry,
+each placed on output 1 in turn. The packets share the frame's buffer rather
+than being copied. Frames which JaldiGate or JaldiScheduler split into
+fragments to fill the end of a slot are put back together, and then handled
+like any other frame; if a fragment is lost, the whole frame is abandoned.
 
 DEST an optional parameter which specifies the destination station id we are
 interested in. If DEST is not supplied, JaldiDecap will decapsulate all incoming
@@ -27,11 +39,84 @@ Jaldi frames which are either destined for station DEST, or are destined for
 station 0 (broadcast). Frames which are not decapsulated because of these rules
 are placed on output 2 if that output is connected.
 
+JaldiDecap also measures the one-way latency and jitter of the frames it
+accepts, per source, from the TX timestamps that the sending driver (or
+JaldiTxStamp) wrote in their footers. Unstamped frames are ignored. Latency
+is only meaningful if the sender's and receiver's clocks are synchronized;
+jitter is not affected by a constant offset between them.
+
+It also follows the sequence numbers that JaldiEncap gives data frames, one
+sequence per source and type (BULK_FRAME or VOIP_FRAME), and counts the
+frames lost (skipped over and not seen since), duplicated, and reordered
+(received after a later frame, which uncounts their loss). Each frame costs a
+constant amount of work. Frames that arrive more than 64 numbers late can't
+be told apart from duplicates, and are counted as late. A jump of more than
+65536 numbers is taken to mean that the sender restarted. Frames which are
+not for us (see DEST) aren't counted, so with DEST set, losses of frames
+sent to other stations don't show up as gaps. Duplicates, which may arrive
+when the sender retransmits a frame whose ACK was lost, are placed on output
+2 instead of being decapsulated.
+
+A JaldiGate or JaldiScheduler downstream of JaldiDecap's control output finds
+it, and reports which BULK_FRAMEs have arrived back to their senders in block
+ACKs, so that lost frames can be retransmitted; see JaldiGate.
+
+Keyword arguments are:
+
+=over 8
+
+=item LATENCY
+
+Boolean. If false, don't measure latency. Default is true.
+
+=item SEQ
+
+Boolean. If false, don't track sequence numbers. Default is true.
+
+=back
+
 This element is push only.
 
+=h latency read-only
+
+Returns one line per source: its ID, the number of stamped frames received,
+the mean, 50th, 90th and 99th percentile and maximum latency, the number of
+frames that appeared to arrive before they were sent (because of clock
+offset), the 50th, 90th and 99th percentile and maximum jitter (the change in
+latency between consecutive frames), and the smoothed jitter estimate of RFC
+3550. All times are in microseconds; percentiles are accurate to within 12.5%.
+
+=h latency_histograms read-only
+
+Returns the latency and jitter histograms for each source.
+
+=h reset_latency write-only
+
+When written, clears the latency statistics.
+
+=h seq read-only
+
+Returns one line per sequence: the source ID, the frame type, and the number
+of frames received, lost, duplicated, reordered and late, and the number of
+times the sequence was restarted.
+
+=h loss read-only
+
+Returns one line per source: its ID, the number of data frames received from
+it and lost, and its loss rate as a percentage of the frames it sent.
+
+=h reset_seq write-only
+
+When written, clears the sequence statistics.
+
+=h fragments read-only
+
+Returns the number of fragmented frames put back together, and the number
+abandoned because a fragment was lost.
+
 =a
 
-JaldiEncap */
+JaldiEncap, JaldiAggregate, JaldiTxStamp */
 
 class JaldiDecap : public Element { public:
 
@@ -46,9 +131,39 @@ class JaldiDecap : public Element { public:
     int configure(Vector<String>&, ErrorHandler*);
     bool can_live_reconfigure() const   { return true; }
 
+    void add_handlers();
+
     void push(int, Packet*);
 
+    // Frame visitor (see dispatch_frame() in Frame.hh)
+    void visit_data(Packet*, const jaldimac::Frame*);
+    template<typename Payload> void visit(Packet*, const jaldimac::Frame*, const Payload&);
+    void visit_bad(Packet*, const jaldimac::Frame*);
+
+    // For JaldiGate and JaldiScheduler, which send our block ACKs
+    bool take_block_ack(uint8_t src_id, jaldimac::BlockAckExtension& ack)
+    {
+        return seq_enabled && seq.take_block_ack(src_id, ack);
+    }
+
+    // An upper bound on the latency of most frames from SRC_ID; see
+    // JaldiLinkLatency. False if latency isn't being measured, or no frames
+    // from SRC_ID have been.
+    bool latency_bound(uint8_t src_id, uint32_t& us) const
+    {
+        return latency_enabled && latency.latency_bound(src_id, us);
+    }
+
     private:
+      bool for_us(const jaldimac::Frame* f) const;
+      inline void measure_latency(const jaldimac::Frame* f);
+      inline bool track_seq(const jaldimac::Frame* f, uint16_t count);
+      static bool subframes_valid(const uint8_t* data, uint32_t length);
+      void deaggregate(Packet* p);
+
+      static String read_handler(Element*, void*);
+      static int write_handler(const String&, Element*, void*, ErrorHandler*);
+
       static const int in_port = 0;
       static const int out_port_control = 0;
       static const int out_port_data = 1;
@@ -56,7 +171,47 @@ class JaldiDecap : public Element { public:
 
       bool should_filter_by_dest;
       uint8_t dest_id;
+      bool latency_enabled;
+      JaldiLinkLatency latency;
+      bool seq_enabled;
+      JaldiSeqTracker seq;
+      JaldiReassembler reassembler;
 };
 
+inline void JaldiDecap::measure_latency(const jaldimac::Frame* f)
+{
+    if (! latency_enabled)
+        return;
+
+    if (uint32_t tx_us = f->tx_timestamp())
+        latency.add(f->src_id, tx_us, jaldi_timestamp_us());
+}
+
+inline bool JaldiDecap::track_seq(const jaldimac::Frame* f, uint16_t count)
+{
+    if (! seq_enabled || ! JaldiSeqTracker::tracks(f->type))
+        return true;
+
+    // An aggregate takes up the sequence numbers of all its subframes
+    bool fresh = seq.add(f->src_id, f->type, f->seq);
+
+    for (uint16_t i = 1 ; i < count ; ++i)
+        seq.add(f->src_id, f->type, f->seq + i);
+
+    return fresh;
+}
+
+template<typename Payload>
+inline void JaldiDecap::visit(Packet* p, const jaldimac::Frame* f, const Payload&)
+{
+    if (for_us(f))
+    {
+        measure_latency(f);
+        output(out_port_control).push(p);
+    }
+    else
+        checked_output_push(out_port_bad, p);
+}
+
 CLICK_ENDDECLS
 #endif
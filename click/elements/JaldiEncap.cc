@@ -10,12 +10,16 @@
 #include <click/error.hh>
 #include <click/glue.hh>
 #include "Frame.hh"
+#include "JaldiClick.hh"
 
 using namespace jaldimac;
 
 CLICK_DECLS
 
-JaldiEncap::JaldiEncap()
+uint32_t* JaldiEncap::seq_tables[256];
+unsigned JaldiEncap::seq_table_users[256];
+
+JaldiEncap::JaldiEncap() : seq(NULL), seq_src_id(0), encapsulated(0), copies(0)
 {
 }
 
@@ -36,42 +40,91 @@ int JaldiEncap::configure(Vector<String>& conf, ErrorHandler* errh)
         return -1;
 
     // Convert TYPE field from a string to the appropriate code
-    if (name_of_type.equals("BULK_FRAME", -1))
-        type = BULK_FRAME;
-    else if (name_of_type.equals("VOIP_FRAME", -1))
-        type = VOIP_FRAME;
-    else if (name_of_type.equals("REQUEST_FRAME", -1))
-        type = REQUEST_FRAME;
-    else if (name_of_type.equals("CONTENTION_SLOT", -1))
-        type = CONTENTION_SLOT;
-    else if (name_of_type.equals("VOIP_SLOT", -1))
-        type = VOIP_SLOT;
-    else if (name_of_type.equals("TRANSMIT_SLOT", -1))
-        type = TRANSMIT_SLOT;
-    else if (name_of_type.equals("BITRATE_MESSAGE", -1))
-        type = BITRATE_MESSAGE;
-    else if (name_of_type.equals("ROUND_COMPLETE_MESSAGE", -1))
-        type = ROUND_COMPLETE_MESSAGE;
-    else if (name_of_type.equals("DELAY_MESSAGE", -1))
-        type = DELAY_MESSAGE;
-    else
+    if (! parse_type(name_of_type, type))
     {
         errh->error("invalid Jaldi frame type: %s", name_of_type.c_str());
         return -1;
     }
 
-    // Initialize the sequence number to 0
-    seq = 0;
+    // Find the sequence to number frames from. On reconfiguration, let go
+    // of the old one only afterwards, so that if we were its source's only
+    // user, the table isn't freed and the sequence carries on.
+    uint32_t* new_seq = acquire_sequence(src_id, dest_id, type);
+
+    if (! new_seq)
+        return errh->error("out of memory");
+
+    release_seq();
+    seq = new_seq;
+    seq_src_id = src_id;
 
     return 0;
 }
 
-void JaldiEncap::take_state(Element* old, ErrorHandler*)
+bool JaldiEncap::parse_type(const String& name, uint8_t& type_out)
 {
-    JaldiEncap* oldJE = (JaldiEncap*) old->cast("JaldiEncap");
+    if (name.equals("BULK_FRAME", -1))
+        type_out = BULK_FRAME;
+    else if (name.equals("VOIP_FRAME", -1))
+        type_out = VOIP_FRAME;
+    else if (name.equals("REQUEST_FRAME", -1))
+        type_out = REQUEST_FRAME;
+    else if (name.equals("CONTENTION_SLOT", -1))
+        type_out = CONTENTION_SLOT;
+    else if (name.equals("VOIP_SLOT", -1))
+        type_out = VOIP_SLOT;
+    else if (name.equals("TRANSMIT_SLOT", -1))
+        type_out = TRANSMIT_SLOT;
+    else if (name.equals("BITRATE_MESSAGE", -1))
+        type_out = BITRATE_MESSAGE;
+    else if (name.equals("ROUND_COMPLETE_MESSAGE", -1))
+        type_out = ROUND_COMPLETE_MESSAGE;
+    else if (name.equals("DELAY_MESSAGE", -1))
+        type_out = DELAY_MESSAGE;
+    else
+        return false;
 
-    if (oldJE)
-        seq = oldJE->seq;
+    return true;
+}
+
+uint32_t* JaldiEncap::acquire_sequence(uint8_t src_id, uint8_t dest_id, uint8_t type)
+{
+    // Start the source's sequences at 0 if this is the first user
+    if (! seq_tables[src_id])
+    {
+        seq_tables[src_id] = new uint32_t[256 * ntypes];
+
+        if (! seq_tables[src_id])
+            return NULL;
+
+        memset(seq_tables[src_id], 0, sizeof(uint32_t) * 256 * ntypes);
+    }
+
+    ++seq_table_users[src_id];
+    return &seq_tables[src_id][dest_id * ntypes + type];
+}
+
+void JaldiEncap::release_sequence(uint8_t src_id)
+{
+    if (seq_table_users[src_id] > 0 && --seq_table_users[src_id] == 0)
+    {
+        delete[] seq_tables[src_id];
+        seq_tables[src_id] = NULL;
+    }
+}
+
+void JaldiEncap::release_seq()
+{
+    if (! seq)
+        return;
+
+    release_sequence(seq_src_id);
+    seq = NULL;
+}
+
+void JaldiEncap::cleanup(CleanupStage)
+{
+    release_seq();
 }
 
 Packet* JaldiEncap::action(Packet* p)
@@ -86,21 +139,16 @@ Packet* JaldiEncap::action(Packet* p)
         return NULL;
     }
 
-    // Add space for Jaldi frame header and footer to packet
-    WritablePacket* p0 = p->push(Frame::header_size);
-    WritablePacket* p1 = p0->put(Frame::footer_size);
+    // Return the final encapsulated packet
+    bool copied;
+    WritablePacket* wp = jaldi_encapsulate(p, src_id, dest_id, type, (*seq)++, copied);
+
+    ++encapsulated;
 
-    // Create header
-    Frame* f = (Frame*) p1->data();
-    f->initialize();
-    f->dest_id = dest_id;
-    f->src_id = src_id;
-    f->type = type;
-    f->length = Frame::empty_frame_size + length;
-    f->seq = seq++;
+    if (copied)
+        ++copies;
 
-    // Return the final encapsulated packet
-    return p1;
+    return wp;
 }
 
 void JaldiEncap::push(int, Packet* p)
@@ -117,6 +165,35 @@ Packet* JaldiEncap::pull(int)
         return NULL;
 }
 
+String JaldiEncap::read_handler(Element* e, void* thunk)
+{
+    JaldiEncap* je = static_cast<JaldiEncap*>(e);
+
+    switch (reinterpret_cast<intptr_t>(thunk))
+    {
+        case 0:
+            return String(je->encapsulated);
+        case 1:
+            return String(je->copies);
+        default:
+            return "";
+    }
+}
+
+int JaldiEncap::write_handler(const String&, Element* e, void*, ErrorHandler*)
+{
+    JaldiEncap* je = static_cast<JaldiEncap*>(e);
+    je->encapsulated = je->copies = 0;
+    return 0;
+}
+
+void JaldiEncap::add_handlers()
+{
+    add_read_handler("encapsulated", read_handler, (void*) 0);
+    add_read_handler("copies", read_handler, (void*) 1);
+    add_write_handler("reset_counts", write_handler, (void*) 0);
+}
+
 CLICK_ENDDECLS
 ELEMENT_REQUIRES(Frame)
 EXPORT_ELEMENT(JaldiEncap)
@@ -1,6 +1,7 @@
 #ifndef CLICK_JALDIENCAP_HH
 #define CLICK_JALDIENCAP_HH
 #include <click/element.hh>
+#include "Frame.hh"
 CLICK_DECLS
 
 /*
@@ -24,6 +25,12 @@ SRC is the station identifier of the sending station.
 
 DEST is the station identifier of the station the Jaldi frame is intended for.
 
+Each frame gets the next sequence number of its (SRC, DEST, TYPE) triple.
+JaldiEncap elements with the same arguments share one sequence, so a station
+whose VoIP queues each have their own JaldiEncap still sends a single,
+gapless sequence of VOIP_FRAMEs, and JaldiDecap can detect loss and
+reordering from it. The sequence carries on across reconfiguration.
+
 Successfully encapsulated packets are sent to the first output (output 0).
 Certain erroneous packets may be dropped by JaldiEncap - in particular, packets
 which have a size larger than the limit of the Jaldi frame length field will be
@@ -31,6 +38,11 @@ dropped. If the second output (output 1) is connected, such packets will be
 sent there instead of being dropped. Although the first input and first
 output are agnostic, the second output is always push.
 
+The header and footer are written in place when the packet has room for them
+in front and behind and isn't shared; otherwise the packet is copied, once,
+and the copy counted. Put a JaldiReserve just after the source of the
+packets to make sure they always have room.
+
 =e
 
 Encapsulate packets in a Jaldi header with type BULK_FRAME,
@@ -38,9 +50,22 @@ destination station 2:
 
   JaldiEncap(BULK_FRAME, 2)
 
+=h encapsulated read-only
+
+Returns the number of packets encapsulated.
+
+=h copies read-only
+
+Returns the number of packets which had to be copied to make room for the
+header and footer.
+
+=h reset_counts write-only
+
+When written, resets the C<encapsulated> and C<copies> counters.
+
 =a
 
-JaldiDecap */
+JaldiDecap, JaldiReserve */
 
 class JaldiEncap : public Element { public:
 
@@ -54,12 +79,22 @@ class JaldiEncap : public Element { public:
 
     int configure(Vector<String>&, ErrorHandler*);
     bool can_live_reconfigure() const   { return true; }
-    void take_state(Element*, ErrorHandler*);
+    void cleanup(CleanupStage);
+    void add_handlers();
 
     Packet* action(Packet* p);
     void push(int, Packet*);
     Packet* pull(int);
 
+    // The frame type named NAME (one of the TYPE values above)
+    static bool parse_type(const String& name, uint8_t& type_out);
+
+    // The shared sequence counter for (SRC_ID, DEST_ID, TYPE), for other
+    // elements that build data frames. Each acquire must be matched by a
+    // release of SRC_ID. Returns null if memory ran out.
+    static uint32_t* acquire_sequence(uint8_t src_id, uint8_t dest_id, uint8_t type);
+    static void release_sequence(uint8_t src_id);
+
   private:
     static const int in_port = 0;
     static const int out_port = 0;
@@ -68,8 +103,23 @@ class JaldiEncap : public Element { public:
     uint8_t src_id;
     uint8_t dest_id;
     uint8_t type;
-    uint32_t seq;
+    uint32_t* seq;          // In the sequence table of seq_src_id
+    uint8_t seq_src_id;     // src_id when seq was looked up
+
+    // Sequence numbers, by source, for every (dest, type) pair. A source's
+    // table is allocated by the first JaldiEncap that uses it and freed with
+    // the last.
+    static const unsigned ntypes = jaldimac::DELAY_MESSAGE + 1;
+    static uint32_t* seq_tables[256];
+    static unsigned seq_table_users[256];
+
+    void release_seq();
+
+    uint32_t encapsulated;
+    uint32_t copies;        // Packets without room for the header and footer
 
+    static String read_handler(Element*, void*);
+    static int write_handler(const String&, Element*, void*, ErrorHandler*);
 };
 
 CLICK_ENDDECLS
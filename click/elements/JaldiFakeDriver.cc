@@ -19,7 +19,8 @@ CLICK_DECLS
 
 JaldiFakeDriver::JaldiFakeDriver() : timer(this), max_frames_per_trigger(1),
                                      voip_queue_connected(false),
-                                     scheduled_queue(NULL), voip_queue(NULL)
+                                     scheduled_queue(NULL), voip_queue(NULL),
+                                     round_complete_template(DRIVER_ID, MASTER_ID)
 {
 }
 
@@ -36,8 +37,7 @@ int JaldiFakeDriver::configure(Vector<String>& conf, ErrorHandler* errh)
         return -1;
 
     // Record input port configuration
-    if (ninputs() == 2)
-        voip_queue_connected = false;
+    voip_queue_connected = (ninputs() > in_port_upstream_voip);
 
     return 0;
 }
@@ -67,7 +67,7 @@ int JaldiFakeDriver::initialize(ErrorHandler* errh)
 
     // Initialize timer
     timer.initialize(this);
-    timer.schedule_now();
+    timer.schedule_after_us(0);
 
     // Success!
     return 0;
@@ -79,149 +79,167 @@ void JaldiFakeDriver::push(int, Packet* p)
     output(out_port_to_master).push(p);
 }
 
+void JaldiFakeDriver::transmit(Packet* p)
+{
+    // Stamp the frame's footer as it goes on the air.
+    if (Packet* sp = jaldi_stamp_tx(p))
+        output(out_port_to_stations).push(sp);
+}
+
 void JaldiFakeDriver::run_timer(Timer*)
 {
     // Pull scheduled frames
     unsigned pulled_frames = 0;
-    while (pulled_frames < max_frames_per_trigger)
+    while (pulled_frames < max_frames_per_trigger && ! timer.scheduled())
     {
         Packet* p = input(in_port_scheduled).pull();
         ++pulled_frames;
 
         if (p == NULL)
             break;
+
+        // If we were waiting out a slot or delay, it's over now.
+        if (slot_timing.pending())
+            slot_timing.finish(JaldiClock::now_us());
             
         // Got a Jaldi frame from the scheduler; decode it to decide what to do.
-        const Frame* f = (const Frame*) p->data();
+        // A timed event schedules the timer for its end, which stops us.
+        pulled_frames += dispatch_frame<unsigned>(*this, p, (const Frame*) p->data(), p->length());
+    }
 
-        switch (f->type)
-        {
-            case BULK_FRAME:
-            case VOIP_FRAME:
-            case REQUEST_FRAME:
-            {
-                // Transmit a VoIP frame from upstream if one is waiting.
-                if (voip_queue_connected)
-                {
-                    Packet* vp = input(in_port_upstream_voip).pull();
-                
-                    if (vp)
-                    {
-                        ++pulled_frames;
-                        output(out_port_to_stations).push(vp);
-                    }
-                }
-
-                // Transmit the scheduled frame.
-                output(out_port_to_stations).push(p);
-
-                break;
-            }
-
-            case CONTENTION_SLOT:
-            {
-                // Convert duration to milliseconds.
-                const ContentionSlotPayload* csp = (const ContentionSlotPayload*) f->payload;
-                uint32_t duration_ms = csp->duration_us / 1000;
-
-                if (duration_ms < 1)
-                    duration_ms = 1;
-
-                // Let the master know that the round is complete.
-                RoundCompleteMessagePayload* rcmp;
-                WritablePacket* rcp = make_jaldi_frame<ROUND_COMPLETE_MESSAGE, MASTER_ID>(DRIVER_ID, rcmp);
-                output(out_port_to_master).push(rcp);
-
-                // Announce the contention slot.
-                output(out_port_to_stations).push(p);
-
-                // Wait until it's over. (as best we can with this timer resolution)
-                timer.reschedule_after_msec(duration_ms);
-
-                return;
-            }
-
-            case VOIP_SLOT:
-            {
-                // Convert duration to milliseconds.
-                const VoIPSlotPayload* vsp = (const VoIPSlotPayload*) f->payload;
-                uint32_t duration_ms = vsp->duration_us / 1000;
-
-                if (duration_ms < 1)
-                    duration_ms = 1;
-
-                // Announce the VoIP slot.
-                output(out_port_to_stations).push(p);
-
-                // Wait until it's over. (as best we can with this timer resolution)
-                timer.reschedule_after_msec(duration_ms);
-
-                return;
-            }
-
-            case TRANSMIT_SLOT:
-            {
-                // Convert duration to milliseconds.
-                const TransmitSlotPayload* tsp = (const TransmitSlotPayload*) f->payload;
-                uint32_t duration_ms = tsp->duration_us / 1000;
-
-                if (duration_ms < 1)
-                    duration_ms = 1;
-
-                // Announce the transmit slot.
-                output(out_port_to_stations).push(p);
-
-                // Wait until it's over. (as best we can with this timer resolution)
-                timer.reschedule_after_msec(duration_ms);
-
-                return;
-            }
-
-            case BITRATE_MESSAGE:
-            {
-                // This isn't implemented.
-                click_chatter("%s: BITRATE_MESSAGE is unsupported\n", declaration().c_str());
-                p->kill();
-                break;
-            }
-
-            case ROUND_COMPLETE_MESSAGE:
-            {
-                // This isn't meant to be broadcast.
-                p->kill();
-                break;
-            }
-
-            case DELAY_MESSAGE:
-            {
-                // Convert duration to milliseconds.
-                const DelayMessagePayload* tsp = (const DelayMessagePayload*) f->payload;
-                uint32_t duration_ms = tsp->duration_us / 1000;
-
-                if (duration_ms < 1)
-                    duration_ms = 1;
-
-                // Delays aren't meant to be broadcast, so kill this frame.
-                p->kill();
-
-                // Wait until it's over. (as best we can with this timer resolution)
-                timer.reschedule_after_msec(duration_ms);
-
-                return;
-            }
+    if (timer.scheduled())
+        return;
+
+    // We've pulled all of the frames we're allowed to until the timer is
+    // triggered again, so reschedule and return.
+    timer.schedule_after_us(timer_period_ms * 1000);
+}
+
+void JaldiFakeDriver::wait_out(uint8_t type, uint32_t duration_us)
+{
+    // Convert duration to milliseconds.
+    uint32_t duration_ms = duration_us / 1000;
+
+    if (duration_ms < 1)
+        duration_ms = 1;
+
+    // Wait until it's over. (as best we can with this timer resolution)
+    slot_timing.start(type, duration_us, JaldiClock::now_us());
+    timer.schedule_after_us(duration_ms * 1000);
+}
+
+unsigned JaldiFakeDriver::visit_data(Packet* p, const Frame*)
+{
+    unsigned pulled_frames = 0;
 
-            default:
-            {
-                // Bad stuff; dump it out the optional output
-                checked_output_push(out_port_bad, p);
-                break;
-            }
+    // Transmit a VoIP frame from upstream if one is waiting.
+    if (voip_queue_connected)
+    {
+        Packet* vp = input(in_port_upstream_voip).pull();
+
+        if (vp)
+        {
+            ++pulled_frames;
+            transmit(vp);
         }
     }
 
-    // We've pulled all of the frames we're allowed to until the timer is
-    // triggered again, so reschedule and return.
-    timer.reschedule_after_msec(timer_period_ms);
+    // Transmit the scheduled frame.
+    transmit(p);
+
+    return pulled_frames;
+}
+
+unsigned JaldiFakeDriver::visit(Packet* p, const Frame*, const ContentionSlotPayload& csp)
+{
+    // Let the master know that the round is complete.
+    RoundCompleteMessagePayload* rcmp;
+    WritablePacket* rcp = round_complete_template.make(rcmp);
+    output(out_port_to_master).push(rcp);
+
+    // Announce the contention slot, and wait until it's over.
+    transmit(p);
+    wait_out(CONTENTION_SLOT, csp.duration_us);
+    return 0;
+}
+
+unsigned JaldiFakeDriver::visit(Packet* p, const Frame*, const VoIPSlotPayload& vsp)
+{
+    // Announce the VoIP slot, and wait until it's over.
+    transmit(p);
+    wait_out(VOIP_SLOT, vsp.duration_us);
+    return 0;
+}
+
+unsigned JaldiFakeDriver::visit(Packet* p, const Frame*, const TransmitSlotPayload& tsp)
+{
+    // Announce the transmit slot, and wait until it's over.
+    transmit(p);
+    wait_out(TRANSMIT_SLOT, tsp.duration_us);
+    return 0;
+}
+
+unsigned JaldiFakeDriver::visit(Packet* p, const Frame*, const BitrateMessagePayload&)
+{
+    // This isn't implemented.
+    click_chatter("%s: BITRATE_MESSAGE is unsupported\n", declaration().c_str());
+    p->kill();
+    return 0;
+}
+
+unsigned JaldiFakeDriver::visit(Packet* p, const Frame*, const RoundCompleteMessagePayload&)
+{
+    // This isn't meant to be broadcast.
+    p->kill();
+    return 0;
+}
+
+unsigned JaldiFakeDriver::visit(Packet* p, const Frame*, const DelayMessagePayload& dmp)
+{
+    uint32_t duration_us = dmp.duration_us;
+
+    // Delays aren't meant to be broadcast, so kill this frame.
+    p->kill();
+
+    // Wait until it's over.
+    wait_out(DELAY_MESSAGE, duration_us);
+    return 0;
+}
+
+unsigned JaldiFakeDriver::visit_bad(Packet* p, const Frame*)
+{
+    // Bad stuff; dump it out the optional output
+    checked_output_push(out_port_bad, p);
+    return 0;
+}
+
+String JaldiFakeDriver::read_handler(Element* e, void* thunk)
+{
+    JaldiFakeDriver* d = static_cast<JaldiFakeDriver*>(e);
+
+    switch (reinterpret_cast<intptr_t>(thunk))
+    {
+        case 0:
+            return d->slot_timing.unparse();
+        case 1:
+            return d->slot_timing.unparse_histograms();
+        default:
+            return "";
+    }
+}
+
+int JaldiFakeDriver::write_handler(const String&, Element* e, void*, ErrorHandler*)
+{
+    JaldiFakeDriver* d = static_cast<JaldiFakeDriver*>(e);
+    d->slot_timing.clear();
+    return 0;
+}
+
+void JaldiFakeDriver::add_handlers()
+{
+    add_read_handler("slot_timing", read_handler, (void*) 0);
+    add_read_handler("slot_timing_histograms", read_handler, (void*) 1);
+    add_write_handler("reset_slot_timing", write_handler, (void*) 0, Handler::BUTTON);
 }
 
 CLICK_ENDDECLS
@@ -2,6 +2,9 @@
 #define CLICK_JALDIFAKEDRIVER_HH
 #include <click/element.hh>
 #include <click/timer.hh>
+#include "JaldiClick.hh"
+#include "JaldiClock.hh"
+#include "JaldiSlotTiming.hh"
 CLICK_DECLS
 
 /*
@@ -32,6 +35,10 @@ time it is trigger. This should be set large enough that we get reasonable
 performance (since JaldiFakeDriver only runs once per millisecond) but small
 enough that other timers and periodic events get a chance to run.
 
+JaldiFakeDriver waits on the JaldiClock, rounding each wait up to whole
+milliseconds. Under virtual time (see JaldiClock) it therefore reproduces the
+rounding, but none of the timer lateness, of a real run.
+
 JaldiFakeDriver's first input (push) receives traffic from downstream (the
 stations) and passes it along on its first output (push) unchanged. Input 1
 (pull) receives the output of a JaldiScheduler element. Input 2 (pull) receives
@@ -41,12 +48,31 @@ connected to a JaldiQueue.
 
 There are two push outputs; the first is for traffic from downstream (the
 stations) to the master, and the second is for scheduled traffic being sent to
-the stations. A third push output may be connected to receive erroneous
+the stations. Every valid frame sent to the stations has its footer stamped
+with the time it was sent (see JaldiTxStamp). A third push output may be connected to receive erroneous
 packets. 
 
+=h slot_timing read-only
+
+Returns, for each kind of timed frame (CONTENTION_SLOT, VOIP_SLOT,
+TRANSMIT_SLOT and DELAY_MESSAGE), how long JaldiFakeDriver actually waited
+between announcing it and releasing the next frame, compared to the duration
+that was requested: the number of waits, the mean requested and actual
+durations, the 50th, 90th and 99th percentile and maximum lateness, and the
+number of waits that ended early along with the earliest. All times are in
+microseconds; percentiles are accurate to within 12.5%.
+
+=h slot_timing_histograms read-only
+
+Returns the lateness histogram for each kind of timed frame.
+
+=h reset_slot_timing write-only
+
+When written, clears the slot timing statistics.
+
 =a
 
-JaldiScheduler, JaldiFakeDriverPrecise */
+JaldiScheduler, JaldiFakeDriverPrecise, JaldiClock */
 
 class JaldiQueue;
 
@@ -64,24 +90,46 @@ class JaldiFakeDriver : public Element { public:
     int initialize(ErrorHandler*);
     bool can_live_reconfigure() const   { return true; }
 
+    void add_handlers();
+
     void push(int, Packet*);
     void run_timer(Timer*);
 
+    // Frame visitor (see dispatch_frame() in Frame.hh); each returns the
+    // number of frames it pulled besides the one it was given
+    unsigned visit_data(Packet*, const jaldimac::Frame*);
+    unsigned visit(Packet* p, const jaldimac::Frame* f, const jaldimac::RequestFramePayload&)  { return visit_data(p, f); }
+    unsigned visit(Packet*, const jaldimac::Frame*, const jaldimac::ContentionSlotPayload&);
+    unsigned visit(Packet*, const jaldimac::Frame*, const jaldimac::VoIPSlotPayload&);
+    unsigned visit(Packet*, const jaldimac::Frame*, const jaldimac::TransmitSlotPayload&);
+    unsigned visit(Packet*, const jaldimac::Frame*, const jaldimac::BitrateMessagePayload&);
+    unsigned visit(Packet*, const jaldimac::Frame*, const jaldimac::RoundCompleteMessagePayload&);
+    unsigned visit(Packet*, const jaldimac::Frame*, const jaldimac::DelayMessagePayload&);
+    unsigned visit_bad(Packet*, const jaldimac::Frame*);
+
   private:
+    static String read_handler(Element*, void*);
+    static int write_handler(const String&, Element*, void*, ErrorHandler*);
+
+    void transmit(Packet*);
+    void wait_out(uint8_t type, uint32_t duration_us);
+
     static const int in_port_from_stations = 0;
     static const int in_port_scheduled = 1;
     static const int in_port_upstream_voip = 2;
     static const int out_port_to_master = 0;
     static const int out_port_to_stations = 1;
-    static const int out_port_bad = 1;
+    static const int out_port_bad = 2;
 
     static const uint32_t timer_period_ms = 1;
 
-    Timer timer;
+    JaldiTimer timer;
     unsigned max_frames_per_trigger;
     bool voip_queue_connected;
     JaldiQueue* scheduled_queue;
     JaldiQueue* voip_queue;
+    JaldiSlotTiming slot_timing;
+    JaldiFrameTemplate<jaldimac::ROUND_COMPLETE_MESSAGE, jaldimac::RoundCompleteMessagePayload> round_complete_template;
 };
 
 CLICK_ENDDECLS
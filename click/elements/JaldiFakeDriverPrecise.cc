@@ -18,11 +18,15 @@ using namespace jaldimac;
 
 CLICK_DECLS
 
-JaldiFakeDriverPrecise::JaldiFakeDriverPrecise() : task(this),
+JaldiFakeDriverPrecise::JaldiFakeDriverPrecise() : task(this), timer(this),
+                                                   max_frames_per_trigger(64),
                                                    voip_queue_connected(false),
                                                    scheduled_queue(NULL),
                                                    voip_queue(NULL),
-                                                   sleeping(false)
+                                                   round_complete_template(DRIVER_ID, MASTER_ID),
+                                                   hybrid(false), spin_us(200),
+                                                   sleeping(false),
+                                                   sleep_until_us(0)
 {
 }
 
@@ -30,11 +34,21 @@ JaldiFakeDriverPrecise::~JaldiFakeDriverPrecise()
 {
 }
 
-int JaldiFakeDriverPrecise::configure(Vector<String>&, ErrorHandler*)
+int JaldiFakeDriverPrecise::configure(Vector<String>& conf, ErrorHandler* errh)
 {
+    // Parse configuration parameters
+    if (cp_va_kparse(conf, this, errh,
+             "BURST", 0, cpUnsigned, &max_frames_per_trigger,
+             "HYBRID", 0, cpBool, &hybrid,
+             "SPIN", 0, cpUnsigned, &spin_us,
+             cpEnd) < 0)
+        return -1;
+
+    if (max_frames_per_trigger < 1)
+        return errh->error("BURST must be at least 1");
+
     // Record input port configuration
-    if (ninputs() == 2)
-        voip_queue_connected = false;
+    voip_queue_connected = (ninputs() > in_port_upstream_voip);
 
     return 0;
 }
@@ -65,8 +79,14 @@ int JaldiFakeDriverPrecise::initialize(ErrorHandler* errh)
     // Initialize state
     sleeping = false;
 
-    // Initialize task
+    // Initialize task and the timer that wakes it in hybrid mode
     ScheduleInfo::initialize_task(this, &task, true, errh);
+    timer.initialize(this);
+
+    // Sleep while there's nothing to pull, rather than polling. In virtual
+    // time this matters: JaldiClock only moves the clock on once no other
+    // task is runnable.
+    scheduled_signal = Notifier::upstream_empty_signal(this, in_port_scheduled, &task);
 
     // Success!
     return 0;
@@ -79,8 +99,7 @@ void JaldiFakeDriverPrecise::take_state(Element* old, ErrorHandler*)
     if (oldJFDP)
     {
         sleeping = oldJFDP->sleeping;
-        sleep_until.tv_sec = oldJFDP->sleep_until.tv_sec;
-        sleep_until.tv_usec = oldJFDP->sleep_until.tv_usec;
+        sleep_until_us = oldJFDP->sleep_until_us;
     }
 }
 
@@ -90,157 +109,230 @@ void JaldiFakeDriverPrecise::push(int, Packet* p)
     output(out_port_to_master).push(p);
 }
 
+void JaldiFakeDriverPrecise::transmit(Packet* p)
+{
+    // Stamp the frame's footer as it goes on the air.
+    if (Packet* sp = jaldi_stamp_tx(p))
+        output(out_port_to_stations).push(sp);
+}
+
 void JaldiFakeDriverPrecise::sleep_for_us(uint32_t us)
 {
-    // Get current time.
-    gettimeofday(&sleep_until, NULL);
+    sleeping = true;
+    sleep_until_us = JaldiClock::now_us() + us;
+}
+
+bool JaldiFakeDriverPrecise::still_sleeping()
+{
+    // Returns true, having arranged for the task to run again, if we're still
+    // waiting for the current sleep to end.
+    uint64_t now_us = JaldiClock::now_us();
+
+    if (now_us >= sleep_until_us)
+    {
+        sleeping = false;
+        return false;
+    }
 
-    // Advance.
-    sleep_until.tv_usec += us;
+    uint64_t remaining_us = sleep_until_us - now_us;
 
-    // Normalize.
-    while (sleep_until.tv_usec > 1000000)
+    if (JaldiClock::is_virtual())
     {
-        ++sleep_until.tv_sec;
-        sleep_until.tv_usec -= 1000000;
+        // Virtual time only moves between events, so busy waiting would
+        // never end; the timer releases the next frames itself.
+        timer.schedule_at_us(sleep_until_us);
     }
+    else if (hybrid && remaining_us > spin_us)
+    {
+        // Sleep on the timer until the last SPIN microseconds; the timer
+        // will reschedule the task.
+        timer.schedule_at_us(sleep_until_us - spin_us);
+    }
+    else
+    {
+        // Busy wait.
+        task.fast_reschedule();
+    }
+
+    return true;
 }
 
 bool JaldiFakeDriverPrecise::run_task(Task*)
 {
     // Sleep if needed.
-    if (sleeping)
-    {
-        timeval now;
-        gettimeofday(&now, NULL);
+    if (sleeping && still_sleeping())
+        return false;
+
+    release_frames();
 
-        if (now.tv_sec < sleep_until.tv_sec || (now.tv_sec == sleep_until.tv_sec && now.tv_usec < sleep_until.tv_usec))
-            return false;   // Keep sleeping.
-        else
-            sleeping = false;
+    // We've pulled all of the frames we're allowed to until the timer is
+    // triggered again, so reschedule and return. If the queue has run dry,
+    // it will reschedule us when there's more.
+    if (! (sleeping && still_sleeping()) && scheduled_signal)
+        task.fast_reschedule();
+
+    return true;
+}
+
+void JaldiFakeDriverPrecise::run_timer(Timer*)
+{
+    if (! JaldiClock::is_virtual())
+    {
+        // Hybrid mode: spin through the rest of the wait in the task.
+        task.reschedule();
+        return;
     }
 
-    // Pull scheduled frames
+    // Virtual time: the wait is over now.
+    if (sleeping && still_sleeping())
+        return;
+
+    release_frames();
+
+    if (! (sleeping && still_sleeping()) && scheduled_signal)
+        task.reschedule();
+}
+
+void JaldiFakeDriverPrecise::release_frames()
+{
+    // Pull scheduled frames until we reach a timed event (which starts a
+    // sleep) or the burst limit.
     unsigned pulled_frames = 0;
-    while (pulled_frames < max_frames_per_trigger)
+    while (pulled_frames < max_frames_per_trigger && ! sleeping)
     {
         Packet* p = input(in_port_scheduled).pull();
         ++pulled_frames;
 
         if (p == NULL)
             break;
+
+        // If we were waiting out a slot or delay, it's over now.
+        if (slot_timing.pending())
+            slot_timing.finish(JaldiClock::now_us());
             
         // Got a Jaldi frame from the scheduler; decode it to decide what to do.
-        const Frame* f = (const Frame*) p->data();
+        pulled_frames += dispatch_frame<unsigned>(*this, p, (const Frame*) p->data(), p->length());
+    }
+}
+
+void JaldiFakeDriverPrecise::wait_out(uint8_t type, uint32_t duration_us)
+{
+    slot_timing.start(type, duration_us, JaldiClock::now_us());
+    sleep_for_us(duration_us);
+}
 
-        switch (f->type)
+unsigned JaldiFakeDriverPrecise::visit_data(Packet* p, const Frame*)
+{
+    unsigned pulled_frames = 0;
+
+    // Transmit a VoIP frame from upstream if one is waiting.
+    if (voip_queue_connected)
+    {
+        Packet* vp = input(in_port_upstream_voip).pull();
+
+        if (vp)
         {
-            case BULK_FRAME:
-            case VOIP_FRAME:
-            case REQUEST_FRAME:
-            {
-                // Transmit a VoIP frame from upstream if one is waiting.
-                if (voip_queue_connected)
-                {
-                    Packet* vp = input(in_port_upstream_voip).pull();
-                
-                    if (vp)
-                    {
-                        ++pulled_frames;
-                        output(out_port_to_stations).push(vp);
-                    }
-                }
-
-                // Transmit the scheduled frame.
-                output(out_port_to_stations).push(p);
-
-                break;
-            }
-
-            case CONTENTION_SLOT:
-            {
-                const ContentionSlotPayload* csp = (const ContentionSlotPayload*) f->payload;
-                // Let the master know that the round is complete.
-                RoundCompleteMessagePayload* rcmp;
-                WritablePacket* rcp = make_jaldi_frame<ROUND_COMPLETE_MESSAGE, MASTER_ID>(DRIVER_ID, rcmp);
-                output(out_port_to_master).push(rcp);
-
-                // Announce the contention slot.
-                output(out_port_to_stations).push(p);
-
-                // Wait until it's over.
-                sleep_for_us(csp->duration_us);
-
-                break;
-            }
-
-            case VOIP_SLOT:
-            {
-                const VoIPSlotPayload* vsp = (const VoIPSlotPayload*) f->payload;
-
-                // Announce the VoIP slot.
-                output(out_port_to_stations).push(p);
-
-                // Wait until it's over.
-                sleep_for_us(vsp->duration_us);
-
-                break;
-            }
-
-            case TRANSMIT_SLOT:
-            {
-                const TransmitSlotPayload* tsp = (const TransmitSlotPayload*) f->payload;
-
-                // Announce the transmit slot.
-                output(out_port_to_stations).push(p);
-
-                // Wait until it's over.
-                sleep_for_us(tsp->duration_us);
-
-                break;
-            }
-
-            case BITRATE_MESSAGE:
-            {
-                // This isn't implemented.
-                click_chatter("%s: BITRATE_MESSAGE is unsupported\n", declaration().c_str());
-                p->kill();
-                break;
-            }
-
-            case ROUND_COMPLETE_MESSAGE:
-            {
-                // This isn't meant to be broadcast.
-                p->kill();
-                break;
-            }
-
-            case DELAY_MESSAGE:
-            {
-                const DelayMessagePayload* tsp = (const DelayMessagePayload*) f->payload;
-
-                // Delays aren't meant to be broadcast, so kill this frame.
-                p->kill();
-
-                // Wait until it's over.
-                sleep_for_us(tsp->duration_us);
-
-                break;
-            }
-
-            default:
-            {
-                // Bad stuff; dump it out the optional output
-                checked_output_push(out_port_bad, p);
-                break;
-            }
+            ++pulled_frames;
+            transmit(vp);
         }
     }
 
-    // We've pulled all of the frames we're allowed to until the timer is
-    // triggered again, so reschedule and return.
-    task.fast_reschedule();
-    return true;
+    // Transmit the scheduled frame.
+    transmit(p);
+
+    return pulled_frames;
+}
+
+unsigned JaldiFakeDriverPrecise::visit(Packet* p, const Frame*, const ContentionSlotPayload& csp)
+{
+    // Let the master know that the round is complete.
+    RoundCompleteMessagePayload* rcmp;
+    WritablePacket* rcp = round_complete_template.make(rcmp);
+    output(out_port_to_master).push(rcp);
+
+    // Announce the contention slot, and wait until it's over.
+    transmit(p);
+    wait_out(CONTENTION_SLOT, csp.duration_us);
+    return 0;
+}
+
+unsigned JaldiFakeDriverPrecise::visit(Packet* p, const Frame*, const VoIPSlotPayload& vsp)
+{
+    // Announce the VoIP slot, and wait until it's over.
+    transmit(p);
+    wait_out(VOIP_SLOT, vsp.duration_us);
+    return 0;
+}
+
+unsigned JaldiFakeDriverPrecise::visit(Packet* p, const Frame*, const TransmitSlotPayload& tsp)
+{
+    // Announce the transmit slot, and wait until it's over.
+    transmit(p);
+    wait_out(TRANSMIT_SLOT, tsp.duration_us);
+    return 0;
+}
+
+unsigned JaldiFakeDriverPrecise::visit(Packet* p, const Frame*, const BitrateMessagePayload&)
+{
+    // This isn't implemented.
+    click_chatter("%s: BITRATE_MESSAGE is unsupported\n", declaration().c_str());
+    p->kill();
+    return 0;
+}
+
+unsigned JaldiFakeDriverPrecise::visit(Packet* p, const Frame*, const RoundCompleteMessagePayload&)
+{
+    // This isn't meant to be broadcast.
+    p->kill();
+    return 0;
+}
+
+unsigned JaldiFakeDriverPrecise::visit(Packet* p, const Frame*, const DelayMessagePayload& dmp)
+{
+    uint32_t duration_us = dmp.duration_us;
+
+    // Delays aren't meant to be broadcast, so kill this frame.
+    p->kill();
+
+    // Wait until it's over.
+    wait_out(DELAY_MESSAGE, duration_us);
+    return 0;
+}
+
+unsigned JaldiFakeDriverPrecise::visit_bad(Packet* p, const Frame*)
+{
+    // Bad stuff; dump it out the optional output
+    checked_output_push(out_port_bad, p);
+    return 0;
+}
+
+String JaldiFakeDriverPrecise::read_handler(Element* e, void* thunk)
+{
+    JaldiFakeDriverPrecise* d = static_cast<JaldiFakeDriverPrecise*>(e);
+
+    switch (reinterpret_cast<intptr_t>(thunk))
+    {
+        case 0:
+            return d->slot_timing.unparse();
+        case 1:
+            return d->slot_timing.unparse_histograms();
+        default:
+            return "";
+    }
+}
+
+int JaldiFakeDriverPrecise::write_handler(const String&, Element* e, void*, ErrorHandler*)
+{
+    JaldiFakeDriverPrecise* d = static_cast<JaldiFakeDriverPrecise*>(e);
+    d->slot_timing.clear();
+    return 0;
+}
+
+void JaldiFakeDriverPrecise::add_handlers()
+{
+    add_read_handler("slot_timing", read_handler, (void*) 0);
+    add_read_handler("slot_timing_histograms", read_handler, (void*) 1);
+    add_write_handler("reset_slot_timing", write_handler, (void*) 0, Handler::BUTTON);
 }
 
 CLICK_ENDDECLS
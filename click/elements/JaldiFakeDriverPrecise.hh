@@ -2,12 +2,17 @@
 #define CLICK_JALDIFAKEDRIVERPRECISE_HH
 #include <click/element.hh>
 #include <click/task.hh>
+#include <click/timer.hh>
+#include <click/notifier.hh>
+#include "JaldiClick.hh"
+#include "JaldiClock.hh"
+#include "JaldiSlotTiming.hh"
 CLICK_DECLS
 
 /*
 =c
 
-JaldiFakeDriverPrecise
+JaldiFakeDriverPrecise([I<keywords> BURST, HYBRID, SPIN])
 
 =s jaldi
 
@@ -23,7 +28,18 @@ JaldiFakeDriverPrecise is different from JaldiFakeDriver in that it uses a highe
 resolution timing method. The downside of this method is that it relies on busy
 waiting, so JaldiFakeDriverPrecise will take all available CPU time for itself.
 However, JaldiFakeDriverPrecise should do a much better job of getting correct
-timing and sending packets at high speed than JaldiFakeDriver.
+timing and sending packets at high speed than JaldiFakeDriver. It doesn't
+poll for scheduled frames while its upstream JaldiQueue is empty, but sleeps
+until the queue wakes it.
+
+To leave CPU time for other elements, JaldiFakeDriverPrecise can instead run
+in a hybrid mode: it sleeps on a Click timer until SPIN microseconds before the
+end of each wait, and only busy waits for those last SPIN microseconds. SPIN
+should be larger than the timer's typical lateness on the host, so that the
+timer wakes the driver before the deadline and precision is kept. All waits
+are measured on the JaldiClock. Under virtual time (see JaldiClock),
+JaldiFakeDriverPrecise never busy waits: each wait is a single JaldiClock event,
+which releases the following frames at exactly the requested time.
 
 Because of a recent design change, JaldiFakeDriverPrecise also has an additional
 responsibility - it dynamically inserts VoIP frames destined for the stations
@@ -33,6 +49,31 @@ distance between VoIP slots, but under normal traffic conditions these effects
 should be minimal, and this is the best way we have to simulate real dynamic
 scheduling of VoIP from upstream under the deadline constraints we have.
 
+Keyword arguments are:
+
+=over 8
+
+=item BURST
+
+Unsigned. The maximum number of frames JaldiFakeDriverPrecise will release
+each time its task runs. Every frame up to the next timed event (a slot, delay
+or contention slot) is released in the same run, in order, up to this limit;
+upstream VoIP frames interleaved ahead of scheduled frames count towards it.
+Default is 64.
+
+=item HYBRID
+
+Boolean. If true, sleep on a timer for most of each wait instead of busy
+waiting through all of it. Default is false.
+
+=item SPIN
+
+Unsigned. In hybrid mode, the number of microseconds before the end of a wait
+at which JaldiFakeDriverPrecise stops sleeping and starts busy waiting. Default
+is 200.
+
+=back
+
 JaldiFakeDriverPrecise's first input (push) receives traffic from downstream (the
 stations) and passes it along on its first output (push) unchanged. Input 1
 (pull) receives the output of a JaldiScheduler element. Input 2 (pull) receives
@@ -42,12 +83,31 @@ connected to a JaldiQueue.
 
 There are two push outputs; the first is for traffic from downstream (the
 stations) to the master, and the second is for scheduled traffic being sent to
-the stations. A third push output may be connected to receive erroneous
+the stations. Every valid frame sent to the stations has its footer stamped
+with the time it was sent (see JaldiTxStamp). A third push output may be connected to receive erroneous
 packets. 
 
+=h slot_timing read-only
+
+Returns, for each kind of timed frame (CONTENTION_SLOT, VOIP_SLOT,
+TRANSMIT_SLOT and DELAY_MESSAGE), how long JaldiFakeDriverPrecise actually waited
+between announcing it and releasing the next frame, compared to the duration
+that was requested: the number of waits, the mean requested and actual
+durations, the 50th, 90th and 99th percentile and maximum lateness, and the
+number of waits that ended early along with the earliest. All times are in
+microseconds; percentiles are accurate to within 12.5%.
+
+=h slot_timing_histograms read-only
+
+Returns the lateness histogram for each kind of timed frame.
+
+=h reset_slot_timing write-only
+
+When written, clears the slot timing statistics.
+
 =a
 
-JaldiScheduler, JaldiFakeDriver */
+JaldiScheduler, JaldiFakeDriver, JaldiClock */
 
 class JaldiQueue;
 
@@ -66,27 +126,55 @@ class JaldiFakeDriverPrecise : public Element { public:
     bool can_live_reconfigure() const   { return true; }
     void take_state(Element*, ErrorHandler*);
 
+    void add_handlers();
+
     void push(int, Packet*);
     bool run_task(Task*);
+    void run_timer(Timer*);
+
+    // Frame visitor (see dispatch_frame() in Frame.hh); each returns the
+    // number of frames it pulled besides the one it was given
+    unsigned visit_data(Packet*, const jaldimac::Frame*);
+    unsigned visit(Packet* p, const jaldimac::Frame* f, const jaldimac::RequestFramePayload&)  { return visit_data(p, f); }
+    unsigned visit(Packet*, const jaldimac::Frame*, const jaldimac::ContentionSlotPayload&);
+    unsigned visit(Packet*, const jaldimac::Frame*, const jaldimac::VoIPSlotPayload&);
+    unsigned visit(Packet*, const jaldimac::Frame*, const jaldimac::TransmitSlotPayload&);
+    unsigned visit(Packet*, const jaldimac::Frame*, const jaldimac::BitrateMessagePayload&);
+    unsigned visit(Packet*, const jaldimac::Frame*, const jaldimac::RoundCompleteMessagePayload&);
+    unsigned visit(Packet*, const jaldimac::Frame*, const jaldimac::DelayMessagePayload&);
+    unsigned visit_bad(Packet*, const jaldimac::Frame*);
 
   private:
+    static String read_handler(Element*, void*);
+    static int write_handler(const String&, Element*, void*, ErrorHandler*);
+
+    void transmit(Packet*);
+    void wait_out(uint8_t type, uint32_t duration_us);
+
     void sleep_for_us(uint32_t us);
+    bool still_sleeping();
+    void release_frames();
 
     static const int in_port_from_stations = 0;
     static const int in_port_scheduled = 1;
     static const int in_port_upstream_voip = 2;
     static const int out_port_to_master = 0;
     static const int out_port_to_stations = 1;
-    static const int out_port_bad = 1;
-
-    static const unsigned max_frames_per_trigger = 1;
+    static const int out_port_bad = 2;
 
     Task task;
+    JaldiTimer timer;       // Ends waits in hybrid mode and virtual time
+    unsigned max_frames_per_trigger;
     bool voip_queue_connected;
     JaldiQueue* scheduled_queue;
+    NotifierSignal scheduled_signal;    // Whether there may be frames to pull
     JaldiQueue* voip_queue;
+    JaldiSlotTiming slot_timing;
+    JaldiFrameTemplate<jaldimac::ROUND_COMPLETE_MESSAGE, jaldimac::RoundCompleteMessagePayload> round_complete_template;
+    bool hybrid;
+    uint32_t spin_us;
     bool sleeping;
-    timeval sleep_until;
+    uint64_t sleep_until_us;    // On the JaldiClock
 };
 
 CLICK_ENDDECLS
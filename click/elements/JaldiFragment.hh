@@ -0,0 +1,237 @@
+#ifndef JALDI_FRAGMENT_HH
+#define JALDI_FRAGMENT_HH
+
+#include <click/packet.hh>
+#include <click/string.hh>
+#include "Frame.hh"
+
+// A frame being sent in fragments (see FragmentExtension in Frame.hh), so
+// that the end of a slot can be filled exactly rather than left idle. The
+// sender starts it with the frame that doesn't fit, and takes fragments from
+// it, each as large as the time left allows, until the last.
+class JaldiPartialFrame
+{
+  public:
+    // The length of a fragment carrying no data: header, the EXT_FRAGMENT
+    // extension (padded to two words) and footer.
+    static const uint32_t overhead = sizeof(jaldimac::Frame) + 8 + sizeof(uint32_t);
+
+    // Fragments smaller than this aren't worth their overhead, so none are
+    // made except to finish a frame.
+    static const uint32_t min_data = 64;
+
+    JaldiPartialFrame() : _p(NULL), _offset(0) {}
+    ~JaldiPartialFrame()                { clear(); }
+
+    void clear()
+    {
+        if (_p)
+            _p->kill();
+
+        _p = NULL;
+        _offset = 0;
+    }
+
+    bool active() const                 { return _p != NULL; }
+
+    void start(Packet* p)
+    {
+        clear();
+        _p = p;
+    }
+
+    // The length of the fragment that would finish the frame.
+    uint32_t remaining_length() const
+    {
+        return _p ? overhead + content_length() - _offset : 0;
+    }
+
+    // The next fragment, no longer than MAX_LENGTH, or null if it can't be
+    // made that short (or memory ran out). Takes the rest of the frame if it
+    // fits, after which the partial frame is no longer active.
+    WritablePacket* next(uint32_t max_length)
+    {
+        using namespace jaldimac;
+
+        if (! _p || max_length < overhead)
+            return NULL;
+
+        const Frame* f = (const Frame*) _p->data();
+        uint32_t rest = content_length() - _offset;
+        uint32_t length = (rest < max_length - overhead ? rest : max_length - overhead);
+        bool last = (length == rest);
+
+        if (! last && length < min_data)
+            return NULL;
+
+        WritablePacket* fp = Packet::make(overhead + length);
+
+        if (! fp)
+            return NULL;
+
+        Frame* ff = (Frame*) fp->data();
+        ff->initialize();
+        ff->src_id = f->src_id;
+        ff->dest_id = f->dest_id;
+        ff->type = f->type;
+        ff->seq = f->seq;
+        ff->ext_words = 2;
+        ff->length = overhead + length;
+
+        FragmentExtension fe;
+        fe.offset = _offset;
+        fe.last = last;
+
+        FrameExtension* ext = (FrameExtension*) ff->extensions();
+        memset(ff->extensions(), EXT_PAD, ff->extension_length());
+        ext->type = EXT_FRAGMENT;
+        ext->length = sizeof(fe);
+        memcpy(ext->value, &fe, sizeof(fe));
+
+        memcpy(ff->payload(), _p->data() + _offset, length);
+        ff->set_tx_timestamp(0);        // Stamped by the driver
+
+        _offset += length;
+
+        if (last)
+            clear();
+
+        return fp;
+    }
+
+  private:
+    uint32_t content_length() const
+    {
+        return ((const jaldimac::Frame*) _p->data())->length - jaldimac::Frame::footer_size;
+    }
+
+    JaldiPartialFrame(const JaldiPartialFrame&);
+    JaldiPartialFrame& operator=(const JaldiPartialFrame&);
+
+    Packet* _p;
+    uint32_t _offset;           // Of the next fragment
+};
+
+// Puts fragmented frames back together. Each sender has at most one frame in
+// fragments at a time, and sends its fragments in order, so one frame per
+// source is kept; a fragment that doesn't carry on where the last one left
+// off (because one was lost) abandons the frame, which the sender will
+// retransmit whole if it uses block ACKs.
+class JaldiReassembler
+{
+  public:
+    // The largest frame we'll reassemble
+    static const uint32_t max_length = 0x10000;
+
+    JaldiReassembler() : _reassembled(0), _abandoned(0)
+    {
+        for (unsigned src = 0 ; src < nsources ; ++src)
+            _slots[src].p = NULL;
+    }
+
+    ~JaldiReassembler()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        for (unsigned src = 0 ; src < nsources ; ++src)
+            abandon(_slots[src]);
+
+        _reassembled = _abandoned = 0;
+    }
+
+    // Takes the fragment in P, whose frame is F. Returns the original frame
+    // once its last fragment has arrived, and null until then.
+    Packet* add(Packet* p, const jaldimac::Frame* f, const jaldimac::FragmentExtension& fe)
+    {
+        using namespace jaldimac;
+
+        Slot& s = _slots[f->src_id];
+        const uint8_t* data = f->payload();
+        uint32_t length = f->payload_length();
+
+        if (fe.offset == 0)
+        {
+            // The first fragment starts with the original header, which
+            // gives its length.
+            abandon(s);
+
+            const Frame* of = (const Frame*) data;
+
+            if (length >= sizeof(Frame) && of->length >= sizeof(Frame) + Frame::footer_size
+                && of->length <= max_length && (s.p = Packet::make(of->length)))
+            {
+                s.seq = f->seq;
+                s.offset = 0;
+            }
+        }
+
+        if (! s.p || s.seq != f->seq || s.offset != fe.offset
+            || fe.offset + length > s.p->length() - Frame::footer_size)
+        {
+            abandon(s);
+            p->kill();
+            return NULL;
+        }
+
+        memcpy(s.p->data() + s.offset, data, length);
+        s.offset += length;
+
+        bool last = fe.last;
+        uint32_t tx_us = f->tx_timestamp();
+        p->kill();
+
+        if (! last)
+            return NULL;
+
+        if (s.offset != s.p->length() - Frame::footer_size)
+        {
+            abandon(s);
+            return NULL;
+        }
+
+        // The original goes on with the last fragment's TX timestamp
+        WritablePacket* q = s.p;
+        s.p = NULL;
+        ((Frame*) q->data())->set_tx_timestamp(tx_us);
+        ++_reassembled;
+        return q;
+    }
+
+    // The number of frames reassembled, and abandoned part way through.
+    String unparse() const
+    {
+        return "reassembled abandoned\n" + String(_reassembled) + " " + String(_abandoned) + "\n";
+    }
+
+  private:
+    static const unsigned nsources = 256;
+
+    struct Slot
+    {
+        WritablePacket* p;
+        uint32_t seq;
+        uint32_t offset;        // Bytes so far
+    };
+
+    void abandon(Slot& s)
+    {
+        if (! s.p)
+            return;
+
+        s.p->kill();
+        s.p = NULL;
+        ++_abandoned;
+    }
+
+    JaldiReassembler(const JaldiReassembler&);
+    JaldiReassembler& operator=(const JaldiReassembler&);
+
+    Slot _slots[nsources];
+    uint32_t _reassembled;
+    uint32_t _abandoned;
+};
+
+#endif
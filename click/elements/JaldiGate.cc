@@ -8,18 +8,27 @@
 #include <click/glue.hh>
 #include <click/router.hh>
 #include <click/routervisitor.hh>
+#include <algorithm>
 
 #include "JaldiClick.hh"
 #include "JaldiQueue.hh"
+#include "JaldiDecap.hh"
 #include "JaldiGate.hh"
 
 using namespace jaldimac;
+using namespace std;
 
 CLICK_DECLS
 
-JaldiGate::JaldiGate() : bulk_queue(NULL), voip_overflow_queue(NULL),
+JaldiGate::JaldiGate() : in_port_voip_overflow(in_port_voip_first),
+                         bulk_queue(NULL), voip_overflow_queue(NULL),
                          outstanding_requests(false), bulk_requested_bytes(0),
-                         voip_requested_flows(0), station_id(0)
+                         voip_requested_flows(0), station_id(0), arq_enabled(true),
+                         fragment_enabled(false), lookahead(0), passed_head_seq(0),
+                         passed_count(0), decap(NULL),
+                         packed_frames(0), packed_bytes(0), voip_frame_bytes(0),
+                         voip_latency_us(VOIP_REPORT_NO_LATENCY), silence(3),
+                         voip_places_released(0), voip_reclaimed_bytes(0)
 {
 }
 
@@ -29,15 +38,31 @@ JaldiGate::~JaldiGate()
 
 int JaldiGate::configure(Vector<String>& conf, ErrorHandler* errh)
 {
+    arq_enabled = true;
+    fragment_enabled = false;
+    lookahead = 0;
+    silence = 3;
+
     // Parse configuration parameters
     if (cp_va_kparse(conf, this, errh,
              "ID", cpkP+cpkM, cpByte, &station_id,
+             "ARQ", 0, cpBool, &arq_enabled,
+             "FRAGMENT", 0, cpBool, &fragment_enabled,
+             "LOOKAHEAD", 0, cpUnsigned, &lookahead,
+             "SILENCE", 0, cpUnsigned, &silence,
              cpEnd) < 0)
         return -1;
 
-    // Check that we have the right number of input ports
-    if (ninputs() != FLOWS_PER_VOIP_SLOT + 3)
-        return errh->error("wrong number of input ports; need %<%d%>", FLOWS_PER_VOIP_SLOT + 3);
+    // Check that we have the right number of input ports; the VoIP flow
+    // inputs are all but the last, which is for overflow
+    if (ninputs() > int(in_port_voip_first + MAX_FLOWS_PER_VOIP_SLOT + 1))
+        return errh->error("too many input ports; the most is %<%d%>", int(in_port_voip_first + MAX_FLOWS_PER_VOIP_SLOT + 1));
+
+    in_port_voip_overflow = ninputs() - 1;
+
+    // Prebuild the control frames we send
+    request_frame_template.initialize(station_id, MASTER_ID);
+    delay_message_template.initialize(station_id, DRIVER_ID);
 
     // Looks good!
     return 0;
@@ -57,8 +82,11 @@ int JaldiGate::initialize(ErrorHandler* errh)
     if (! (bulk_queue = (JaldiQueue*) filter[0]->cast("JaldiQueue")))
         return errh->error("bulk queue %<%s%> on input port %<%d%> is not a valid JaldiQueue (cast failed)", filter[0]->name().c_str(), in_port_bulk);
 
-    // Find the nearest upstream VoIP queues
-    for (unsigned voip_port = 0 ; voip_port < FLOWS_PER_VOIP_SLOT ; ++voip_port)
+    // Find the nearest upstream VoIP queues; their flows start out silent
+    voip_queues.resize(in_port_voip_overflow - in_port_voip_first);
+    voip_empty_streaks.resize(voip_queues.size(), silence);
+
+    for (int voip_port = 0 ; voip_port < voip_queues.size() ; ++voip_port)
     {
         filter.clear();
 
@@ -78,6 +106,13 @@ int JaldiGate::initialize(ErrorHandler* errh)
     if (! (voip_overflow_queue = (JaldiQueue*) filter[0]->cast("JaldiQueue")))
         return errh->error("VoIP queue %<%s%> on input port %<%d%> is not a valid JaldiQueue (cast failed)", filter[0]->name().c_str(), in_port_voip_overflow);
 
+    // Find the JaldiDecap whose block ACKs we send, if there is one
+    ElementCastTracker decap_filter(router(), "JaldiDecap");
+
+    if (router()->visit_upstream(this, in_port_control, &decap_filter) >= 0 && decap_filter.size() > 0)
+        decap = (JaldiDecap*) decap_filter[0]->cast("JaldiDecap");
+    else
+        decap = NULL;
 
     // Success!
     return 0;
@@ -93,34 +128,85 @@ void JaldiGate::take_state(Element* old, ErrorHandler*)
         bulk_requested_bytes = oldJG->bulk_requested_bytes;
         voip_requested_flows = oldJG->voip_requested_flows;
         station_id = oldJG->station_id;
+        request_frame_template.initialize(station_id, MASTER_ID);
+        delay_message_template.initialize(station_id, DRIVER_ID);
     }
 }
 
 WritablePacket* JaldiGate::make_request_frame()
 {
-    // Verify that a request is needed
-    unsigned bulk_new_bytes = bulk_queue->total_length() - bulk_requested_bytes;
-    unsigned voip_new_flows = 0;
-
-    for (int voip_queue = 0 ; voip_queue < int(FLOWS_PER_VOIP_SLOT) ; ++voip_queue)
+    // Verify that a request is needed. Frames waiting for retransmission
+    // need granting just like new ones.
+    unsigned bulk_pending_bytes = this->bulk_pending_bytes();
+    unsigned bulk_new_bytes = (bulk_pending_bytes > bulk_requested_bytes ? bulk_pending_bytes - bulk_requested_bytes : 0);
+    unsigned voip_active_flows = 0;
+    uint32_t voip_report_bytes = voip_frame_bytes;
+
+    for (int voip_queue = 0 ; voip_queue < voip_queues.size() ; ++voip_queue)
     {
         if (! voip_queues[voip_queue]->empty())
-            voip_new_flows += 1;
+        {
+            voip_empty_streaks[voip_queue] = 0;
+            voip_report_bytes = max(voip_report_bytes, voip_queues[voip_queue]->head_length());
+        }
+
+        if (voip_talking(voip_queue))
+            voip_active_flows += 1;
     }
 
-    voip_new_flows -= voip_requested_flows;
+    unsigned voip_new_flows = (voip_active_flows > voip_requested_flows ? voip_active_flows - voip_requested_flows : 0);
+
+    BlockAckExtension ack;
+    bool have_ack = decap && decap->take_block_ack(MASTER_ID, ack);
 
-    if (bulk_new_bytes == 0 && voip_new_flows == 0)
+    if (bulk_new_bytes == 0 && voip_new_flows == 0 && ! have_ack)
         return NULL;        // Nothing to request!
 
     // Construct a request frame
     RequestFramePayload* rfp;
-    WritablePacket* rp = make_jaldi_frame<REQUEST_FRAME, MASTER_ID>(station_id, rfp);
+    WritablePacket* rp = request_frame_template.make(rfp);
     rfp->bulk_request_bytes = bulk_new_bytes;
     rfp->voip_request_flows = voip_new_flows;
 
+    if (have_ack)
+    {
+        uint8_t* value;
+
+        if (! (rp = jaldi_add_extension(rp, EXT_BLOCK_ACK, sizeof(ack), value)))
+            return NULL;
+
+        if (value)
+            memcpy(value, &ack, sizeof(ack));
+    }
+
+    // Tell the master how big our VoIP frames are, and how far behind its
+    // clock we hear it, so it can size our places in the VoIP slot
+    if (voip_active_flows > 0)
+    {
+        VoIPReportExtension report;
+        uint32_t latency_us;
+        uint8_t* value;
+
+        report.frame_bytes = min(voip_report_bytes, uint32_t(BULK_MTU__BYTES));
+
+        if (decap && decap->latency_bound(MASTER_ID, latency_us))
+            report.latency_us = min(latency_us, uint32_t(VOIP_REPORT_NO_LATENCY - 1));
+        else
+            report.latency_us = VOIP_REPORT_NO_LATENCY;
+
+        voip_latency_us = report.latency_us;
+
+        if (! (rp = jaldi_add_extension(rp, EXT_VOIP_REPORT, sizeof(report), value)))
+            return NULL;
+
+        if (value)
+            memcpy(value, &report, sizeof(report));
+    }
+
     // Update state
-    outstanding_requests = true;
+    if (bulk_new_bytes > 0 || voip_new_flows > 0)
+        outstanding_requests = true;
+
     bulk_requested_bytes += bulk_new_bytes;
     voip_requested_flows += voip_new_flows;
 
@@ -128,200 +214,513 @@ WritablePacket* JaldiGate::make_request_frame()
     return rp;
 }
 
+void JaldiGate::push_voip(Packet* vp)
+{
+    // Track the size of our VoIP frames for our reports: the largest lately,
+    // falling slowly towards smaller ones
+    uint32_t length = vp->length();
+
+    if (length >= voip_frame_bytes)
+        voip_frame_bytes = length;
+    else
+        voip_frame_bytes -= (voip_frame_bytes - length + 15) / 16;
+
+    output(out_port).push(vp);
+}
+
+void JaldiGate::push_delay(uint32_t duration_us)
+{
+    DelayMessagePayload* dmp;
+    WritablePacket* dp = delay_message_template.make(dmp);
+    dmp->duration_us = duration_us;
+    output(out_port).push(dp);
+}
+
+// The longest frame that can be sent in DURATION_US, by the same reckoning
+// as the TRANSMIT_SLOT loops
+static inline uint32_t slot_capacity(uint32_t duration_us)
+{
+    return duration_us > 1 ? (duration_us - 1) * BITRATE__BYTES_PER_US - 1 : 0;
+}
+
+// Pulls the next bulk frame: retransmissions first, then new frames, keeping
+// a copy of those. A frame that is SENT whole comes off our requests; one
+// that's going to be fragmented comes off a fragment at a time instead, in
+// send_fragment(), since what we still ask for includes the rest of it.
+Packet* JaldiGate::pull_bulk(bool sent)
+{
+    Packet* bp;
+
+    if (! retransmit.empty())
+        bp = retransmit.pull();
+    else if ((bp = input(in_port_bulk).pull()) && arq_enabled && ((const Frame*) bp->data())->type == BULK_FRAME)
+        retransmit.sent(bp);
+
+    if (bp && sent)
+        bulk_requested_bytes -= min(bulk_requested_bytes, bp->length());
+
+    return bp;
+}
+
+void JaldiGate::send_fragment(uint32_t& duration_us)
+{
+    if (WritablePacket* fp = partial.next(slot_capacity(duration_us)))
+    {
+        duration_us -= fp->length() / BITRATE__BYTES_PER_US + 1;
+        bulk_requested_bytes -= min(bulk_requested_bytes, fp->length());
+        output(out_port).push(fp);
+    }
+}
+
+void JaldiGate::observe_voip_slot()
+{
+    // Count how many VoIP slots in a row each flow has had nothing to send
+    for (int voip_queue = 0 ; voip_queue < voip_queues.size() ; ++voip_queue)
+    {
+        if (! voip_queues[voip_queue]->empty())
+            voip_empty_streaks[voip_queue] = 0;
+        else if (voip_empty_streaks[voip_queue] < silence)
+            ++voip_empty_streaks[voip_queue];
+    }
+}
+
+uint32_t JaldiGate::send_bulk_in_place(uint32_t duration_us)
+{
+    // Leave the guard the master put after our place, so that we don't run
+    // into the next station's
+    uint32_t guard_us = voip_guard_bytes(voip_latency_us) / BITRATE__BYTES_PER_US + 1;
+
+    if (duration_us <= guard_us)
+        return 0;
+
+    uint32_t remaining_us = duration_us - guard_us;
+    uint32_t next_frame_duration_us;
+
+    // Finish a frame that was cut off at the end of the last slot first
+    if (partial.active())
+        send_fragment(remaining_us);
+
+    // Then retransmissions, and new bulk frames, in order
+    while (! partial.active())
+    {
+        uint32_t length = (! retransmit.empty() ? retransmit.head_length()
+                           : (! bulk_queue->empty() ? bulk_queue->head_length() : 0));
+
+        if (length == 0 || (next_frame_duration_us = length / BITRATE__BYTES_PER_US + 1) >= remaining_us)
+            break;
+
+        Packet* bp = pull_bulk();
+
+        if (! bp)
+            break;
+
+        voip_reclaimed_bytes += bp->length();
+        output(out_port).push(bp);
+        remaining_us -= next_frame_duration_us;
+    }
+
+    return duration_us - guard_us - remaining_us;
+}
+
+// The position in the bulk queue of the longest frame, among the first
+// LOOKAHEAD, that fits in MAX_LENGTH bytes and can be sent without passing an
+// earlier frame of the same flow, or -1 if there's none. Flows passed over
+// are remembered as one bit per hash value, so each frame costs O(1); a
+// collision only makes the search more cautious. Frames whose flow can't be
+// told (aggregates, or anything that isn't IPv4) may be sent only from the
+// head, and nothing may pass them.
+int JaldiGate::find_best_fit(uint32_t max_length)
+{
+    uint64_t passed_flows = 0;
+    int best = -1;
+    uint32_t best_length = 0;
+
+    for (int i = 0 ; i < int(lookahead) ; ++i)
+    {
+        Packet* p = bulk_queue->packet_at(i);
+
+        if (! p)
+            break;
+
+        const Frame* f = (const Frame*) p->data();
+        uint64_t flow_bit = ~uint64_t(0);
+        uint32_t hash;
+
+        if (f->ext_words == 0 && jaldi_flow_hash(f->payload(), f->payload_length(), hash))
+            flow_bit = uint64_t(1) << (hash % 64);
+
+        if (! (passed_flows & flow_bit) && p->length() <= max_length && p->length() > best_length)
+        {
+            best = i;
+            best_length = p->length();
+        }
+
+        passed_flows |= flow_bit;
+
+        if (passed_flows == ~uint64_t(0))
+            break;
+    }
+
+    return best;
+}
+
+void JaldiGate::process_block_acks(const Frame* f)
+{
+    for (FrameExtensionIterator it(f) ; it.valid() ; it.next())
+    {
+        if (it->type != EXT_BLOCK_ACK || it->length < sizeof(BlockAckExtension))
+            continue;
+
+        BlockAckExtension ack;
+        memcpy(&ack, it->value, sizeof(ack));
+
+        if (ack.peer_id == station_id)
+            retransmit.ack(ack);
+    }
+}
+
 void JaldiGate::push(int, Packet* p)
 {
     // We've received some kind of control traffic; take action based on the
     // specific type and parameters.
-    const Frame* f = (const Frame*) p->data();
+    dispatch_frame<void>(*this, p, (const Frame*) p->data(), p->length());
+}
 
+bool JaldiGate::accept(Packet* p, const Frame* f)
+{
     if (! (f->dest_id == BROADCAST_ID || f->dest_id == station_id))
     {
         // Not for us! Dump it out the optional output port
         checked_output_push(out_port_bad, p);
-        return;
+        return false;
     }
 
-    switch (f->type)
+    // The master acknowledges our bulk frames in extensions
+    if (f->ext_words)
+        process_block_acks(f);
+
+    return true;
+}
+
+void JaldiGate::visit_data(Packet* p, const Frame* f)
+{
+    // Nothing we act on, though it may carry ACKs for us
+    if (accept(p, f))
+        checked_output_push(out_port_bad, p);
+}
+
+void JaldiGate::visit(Packet* p, const Frame* f, const ContentionSlotPayload& payload)
+{
+    if (! accept(p, f))
+        return;
+
+    WritablePacket* rp;
+
+    // Reset requested VoIP flows since they don't carry over between rounds
+    voip_requested_flows = 0;
+
+    // Send requests if we need to and we won't get a chance later
+    if (outstanding_requests)
+        outstanding_requests = false;  // We'll get another chance
+    else if ((rp = make_request_frame()) != NULL)
     {
-        case CONTENTION_SLOT:
+        // We need to send a request!
+
+        // If possible, create a delay message with a random delay
+        // within the contention slot
+        uint32_t requested_duration_us = rp->length() / BITRATE__BYTES_PER_US + 1;
+
+        if (requested_duration_us < payload.duration_us)
         {
-            WritablePacket* rp;
+            // Construct and send a delay message frame
+            DelayMessagePayload* dmp;
+            WritablePacket* dp = delay_message_template.make(dmp);
+            dmp->duration_us = rand() % (payload.duration_us - requested_duration_us + 1);
+            output(out_port).push(dp);
+        }
 
-            // Reset requested VoIP flows since they don't carry over between rounds
-            voip_requested_flows = 0;
+        // Send the request
+        output(out_port).push(rp);
+    }
 
-            // Send requests if we need to and we won't get a chance later
-            if (outstanding_requests)
-                outstanding_requests = false;  // We'll get another chance
-            else if ((rp = make_request_frame()) != NULL)
-            {
-                // We need to send a request!
-
-		// If possible, create a delay message with a random delay
-		// within the contention slot
-                const ContentionSlotPayload* payload = (const ContentionSlotPayload*) f->payload;
-                uint32_t requested_duration_us = rp->length() / BITRATE__BYTES_PER_US + 1;
-
-                if (requested_duration_us < payload->duration_us)
-                {
-                    // Construct and send a delay message frame
-                    DelayMessagePayload* dmp;
-                    WritablePacket* dp = make_jaldi_frame<DELAY_MESSAGE, DRIVER_ID>(station_id, dmp);
-                    dmp->duration_us = rand() % (payload->duration_us - requested_duration_us + 1);
-                    output(out_port).push(dp);
-                }
-
-                // Send the request
-                output(out_port).push(rp);
-            }
+    p->kill();
+}
 
-            p->kill();
+void JaldiGate::visit(Packet* p, const Frame* f, const VoIPSlotPayload& payload)
+{
+    if (! accept(p, f))
+        return;
 
-            break;
+    WritablePacket* rp;
+
+    // Send a VoIP packet if the master has given us a chance to do so
+    unsigned flows = voip_slot_flows(f);
+
+    observe_voip_slot();
+
+    bool already_requested = false;
+    int cur_voip_queue = in_port_voip_first;
+    uint32_t wait_us = 0;       // Until the next place of ours
+    for (unsigned i = 0 ; i < flows ; ++i)
+    {
+        uint8_t flow_station = payload.flows[i].station;
+        uint32_t flow_duration_us = payload.flows[i].duration_us;
+
+        if (flow_station != station_id)
+        {
+            wait_us += flow_duration_us;
+            continue;
         }
 
-        case VOIP_SLOT:
+        // Have the driver wait out the places before ours
+        if (wait_us > 0)
+            push_delay(wait_us);
+
+        uint32_t used_us = 0;
+
+        if (! already_requested && (rp = make_request_frame()) != NULL)
         {
-            WritablePacket* rp;
+            // Send a request frame
+            used_us += rp->length() / BITRATE__BYTES_PER_US + 1;
+            output(out_port).push(rp);
+            already_requested = true;
+        }
 
-            // Send a VoIP packet if the master has given us a chance to do so
+        // Send one of our VoIP packets
+        bool sent_voip = false;
 
-            const VoIPSlotPayload* payload = (const VoIPSlotPayload*) f->payload;
+        while (cur_voip_queue < in_port_voip_overflow)
+        {
+            Packet* vp = input(cur_voip_queue++).pull();
 
-            bool already_requested = false;
-            int cur_voip_queue = in_port_voip_first;
-            for (unsigned i = 0 ; i < FLOWS_PER_VOIP_SLOT ; ++i)
+            if (vp)
             {
-                if (payload->stations[i] == station_id)
-                {
-                    if (! already_requested && (rp = make_request_frame()) != NULL)
-                    {
-                        // Send a request frame
-                        output(out_port).push(rp);
-                        already_requested = true;
-                    }
-
-                    // Send one of our VoIP packets
-                    while (cur_voip_queue < in_port_voip_overflow)
-                    {
-                        Packet* vp = input(cur_voip_queue++).pull();
-
-                        if (vp)
-                        {
-                            output(out_port).push(vp);
-                            break;
-                        }
-                    }
-                }
-                else
-                {
-                    // Construct a delay message frame for the driver
-                    DelayMessagePayload* dmp;
-                    WritablePacket* dp = make_jaldi_frame<DELAY_MESSAGE, DRIVER_ID>(station_id, dmp);
-                    dmp->duration_us = VOIP_SLOT_SIZE__BYTES / BITRATE__BYTES_PER_US + 1;
-
-                    // Send it
-                    output(out_port).push(dp);
-                }
+                used_us += vp->length() / BITRATE__BYTES_PER_US + 1;
+                push_voip(vp);
+                sent_voip = true;
+                break;
             }
+        }
 
-            p->kill();
+        // If our flows have gone quiet, give the rest of the place
+        // to bulk data
+        if (! sent_voip)
+        {
+            ++voip_places_released;
 
-            break;
+            if (flow_duration_us > used_us)
+                used_us += send_bulk_in_place(flow_duration_us - used_us);
         }
 
-        case TRANSMIT_SLOT:
-        {
-            WritablePacket* rp;
-            uint32_t next_frame_duration_us;
+        // Don't run into the next place
+        wait_us = (flow_duration_us > used_us ? flow_duration_us - used_us : 0);
+    }
+
+    if (wait_us > 0)
+        push_delay(wait_us);
 
-            // If we have requests or bulk data, send them
-            
-            const TransmitSlotPayload* payload = (const TransmitSlotPayload*) f->payload;
-            uint32_t duration_us = payload->duration_us;
+    p->kill();
+}
 
-            if ((rp = make_request_frame()) != NULL)
+void JaldiGate::visit(Packet* p, const Frame* f, const TransmitSlotPayload& payload)
+{
+    if (! accept(p, f))
+        return;
+
+    WritablePacket* rp;
+    uint32_t next_frame_duration_us;
+
+    // If we have requests or bulk data, send them
+    
+    uint32_t duration_us = payload.duration_us;
+
+    if ((rp = make_request_frame()) != NULL)
+    {
+        // Send a request frame
+        output(out_port).push(rp);
+
+        // A poll from the master has room for little else
+        uint32_t request_duration_us = rp->length() / BITRATE__BYTES_PER_US + 1;
+        duration_us = (duration_us > request_duration_us ? duration_us - request_duration_us : 0);
+    }
+
+    // Send VoIP frames that we will not receive a VoIP slot for
+    if (payload.voip_granted_flows < voip_requested_flows)
+    {
+        uint8_t skip_flows = payload.voip_granted_flows;
+        unsigned cur_voip_queue = 0;
+
+        // Send one of our VoIP packets
+        while (cur_voip_queue < unsigned(voip_queues.size()))
+        {
+            // Skip over any empty voip queues
+            if (voip_queues[cur_voip_queue]->empty())
             {
-                // Send a request frame
-                output(out_port).push(rp);
-                duration_us -= rp->length() / BITRATE__BYTES_PER_US + 1;
+                ++cur_voip_queue;
+                continue;
             }
 
-            // Send VoIP frames that we will not receive a VoIP slot for
-            if (payload->voip_granted_flows < voip_requested_flows)
+            // Skip over queues that will be handled by a VoIP slot
+            if (skip_flows > 0)
             {
-                uint8_t skip_flows = payload->voip_granted_flows;
-                unsigned cur_voip_queue = 0;
-
-                // Send one of our VoIP packets
-                while (cur_voip_queue < FLOWS_PER_VOIP_SLOT)
-                {
-                    // Skip over any empty voip queues
-                    if (voip_queues[cur_voip_queue]->empty())
-                    {
-                        ++cur_voip_queue;
-                        continue;
-                    }
-
-                    // Skip over queues that will be handled by a VoIP slot
-                    if (skip_flows > 0)
-                    {
-                        ++cur_voip_queue;
-                        --skip_flows;
-                        continue;
-                    }
-
-                    // Skip over queues that we don't have time to send
-                    if ((next_frame_duration_us = voip_queues[cur_voip_queue]->head_length() / BITRATE__BYTES_PER_US + 1) < duration_us)
-                    {
-                        ++cur_voip_queue;
-                        continue;
-                    }
-
-                    // OK, it's safe to send a packet from this queue!
-                    Packet* vp = input(in_port_voip_first + cur_voip_queue++).pull();
-                    output(out_port).push(vp);
-
-                    // Update remaining duration
-                    duration_us -= next_frame_duration_us;
-                }
+                ++cur_voip_queue;
+                --skip_flows;
+                continue;
             }
 
-            // Send overflow VoIP frames
-            while (! voip_overflow_queue->empty() && (next_frame_duration_us = voip_overflow_queue->head_length() / BITRATE__BYTES_PER_US + 1) < duration_us)
+            // Skip over queues that we don't have time to send
+            if ((next_frame_duration_us = voip_queues[cur_voip_queue]->head_length() / BITRATE__BYTES_PER_US + 1) >= duration_us)
             {
-                // Pull the next frame and send it
-                Packet* vp = input(in_port_voip_overflow).pull();
-                output(out_port).push(vp);
-
-                // Update remaining duration
-                duration_us -= next_frame_duration_us;
+                ++cur_voip_queue;
+                continue;
             }
 
-            // Send bulk frames
-            while (! bulk_queue->empty() && (next_frame_duration_us = bulk_queue->head_length() / BITRATE__BYTES_PER_US + 1) < duration_us)
-            {
-                // Pull the next frame, update stats, and send it
-                Packet* bp = input(in_port_bulk).pull();
-                bulk_requested_bytes -= bp->length();
-                output(out_port).push(bp);
+            // OK, it's safe to send a packet from this queue!
+            Packet* vp = input(in_port_voip_first + cur_voip_queue++).pull();
 
-                // Update remaining duration
-                duration_us -= next_frame_duration_us;
-            }
+            if (! vp)
+                continue;
 
-            p->kill();
+            push_voip(vp);
+
+            // Update remaining duration
+            duration_us -= next_frame_duration_us;
+        }
+    }
 
+    // Send overflow VoIP frames
+    while (! voip_overflow_queue->empty() && (next_frame_duration_us = voip_overflow_queue->head_length() / BITRATE__BYTES_PER_US + 1) < duration_us)
+    {
+        // Pull the next frame and send it
+        Packet* vp = input(in_port_voip_overflow).pull();
+
+        if (! vp)
             break;
+
+        push_voip(vp);
+
+        // Update remaining duration
+        duration_us -= next_frame_duration_us;
+    }
+
+    // Finish a frame that was cut off at the end of the last slot
+    if (partial.active())
+        send_fragment(duration_us);
+
+    // Send bulk frames, retransmitting lost ones ahead of new ones
+    while (! partial.active() && bulk_waiting() && (next_frame_duration_us = next_bulk_length() / BITRATE__BYTES_PER_US + 1) < duration_us)
+    {
+        Packet* bp = pull_bulk();
+
+        if (! bp)
+            break;
+
+        output(out_port).push(bp);
+
+        // Update remaining duration
+        duration_us -= next_frame_duration_us;
+    }
+
+    // The head doesn't fit; send frames from further back that do,
+    // but don't let them hold it back indefinitely
+    int i;
+
+    // Click recycles Packets, so a new head can turn up at the same address
+    // as the one we last saw; tell them apart by sequence number.
+    if (const Packet* head = bulk_queue->packet_at(0))
+    {
+        uint32_t head_seq = ((const Frame*) head->data())->seq;
+
+        if (head_seq != passed_head_seq)
+        {
+            passed_head_seq = head_seq;
+            passed_count = 0;
         }
+    }
 
-        default:
+    while (lookahead > 0 && ! partial.active() && passed_count < lookahead
+           && (i = find_best_fit(slot_capacity(duration_us))) >= 0)
+    {
+        Packet* bp = bulk_queue->yank_at(i);
+
+        if (i > 0)
+            ++passed_count;
+
+        next_frame_duration_us = bp->length() / BITRATE__BYTES_PER_US + 1;
+        bulk_requested_bytes -= min(bulk_requested_bytes, bp->length());
+
+        if (arq_enabled && ((const Frame*) bp->data())->type == BULK_FRAME)
+            retransmit.sent(bp);
+
+        ++packed_frames;
+        packed_bytes += bp->length();
+        output(out_port).push(bp);
+
+        // Update remaining duration
+        duration_us -= next_frame_duration_us;
+    }
+
+    // Fill the rest of the slot with the start of the next frame,
+    // rather than leaving it idle
+    if (fragment_enabled && ! partial.active() && bulk_waiting()
+        && slot_capacity(duration_us) >= JaldiPartialFrame::overhead + JaldiPartialFrame::min_data)
+    {
+        if (Packet* bp = pull_bulk(false))
         {
-            // Bad stuff; dump it out the optional output
-            checked_output_push(out_port_bad, p);
-            break;
+            partial.start(bp);
+            send_fragment(duration_us);
         }
     }
+
+    p->kill();
+}
+
+void JaldiGate::visit_bad(Packet* p, const Frame*)
+{
+    // Bad stuff; dump it out the optional output
+    checked_output_push(out_port_bad, p);
+}
+
+String JaldiGate::read_handler(Element* e, void* thunk)
+{
+    JaldiGate* g = static_cast<JaldiGate*>(e);
+
+    switch (reinterpret_cast<intptr_t>(thunk))
+    {
+        case 0:
+            return String(JaldiRetransmitBuffer::unparse_header()) + "\n" + g->retransmit.unparse() + "\n";
+        case 1:
+            return "packed_frames packed_bytes\n" + String(g->packed_frames) + " " + String(g->packed_bytes) + "\n";
+        case 2:
+        {
+            uint32_t talking = 0;
+
+            for (int voip_queue = 0 ; voip_queue < g->voip_queues.size() ; ++voip_queue)
+            {
+                if (g->voip_talking(voip_queue))
+                    ++talking;
+            }
+
+            return "talking_flows frame_bytes places_released reclaimed_bytes\n" + String(talking) + " "
+                   + String(g->voip_frame_bytes) + " " + String(g->voip_places_released) + " "
+                   + String(g->voip_reclaimed_bytes) + "\n";
+        }
+        case 3:
+            return String(g->bulk_requested_bytes);
+        case 4:
+            return String(g->bulk_pending_bytes());
+        default:
+            return "";
+    }
+}
+
+void JaldiGate::add_handlers()
+{
+    add_read_handler("arq", read_handler, (void*) 0);
+    add_read_handler("packing", read_handler, (void*) 1);
+    add_read_handler("voip", read_handler, (void*) 2);
+    add_read_handler("bulk_requested", read_handler, (void*) 3);
+    add_read_handler("bulk_pending", read_handler, (void*) 4);
 }
 
 CLICK_ENDDECLS
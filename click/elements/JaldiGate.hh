@@ -2,12 +2,15 @@
 #define CLICK_JALDIGATE_HH
 #include <click/element.hh>
 #include "Frame.hh"
+#include "JaldiClick.hh"
+#include "JaldiRetransmitBuffer.hh"
+#include "JaldiFragment.hh"
 CLICK_DECLS
 
 /*
 =c
 
-JaldiGate(ID)
+JaldiGate(ID [, I<keywords> ARQ, FRAGMENT, LOOKAHEAD])
 
 =s jaldi
 
@@ -25,19 +28,114 @@ ID is the station ID of this station.
 
 JaldiGate has at least 3 inputs. Input 0 (push) is for control traffic and
 input 1 (pull) is for bulk traffic. Inputs 2 and above (pull) are for VoIP
-traffic; there should be as many VoIP inputs as there are flows that may fit in
-a VoIP slot, plus one for any excess VoIP flows that will have to be sent with
-bulk data. Everything arriving on the inputs should be encapsulated in Jaldi
-frames, and all pull inputs should be connected to JaldiQueues.
+traffic: one for each VoIP flow the station may have a place for in the
+master's VoIP slots (up to 64), and a last one for any excess VoIP flows that
+will have to be sent with bulk data. The master lists the station once in
+each VOIP_SLOT for every flow it grants, and JaldiGate sends a packet from the
+next non-empty VoIP input in each of those places, waiting out the others.
+Everything arriving on the inputs should be encapsulated in Jaldi frames, and
+all pull inputs should be connected to JaldiQueues.
+
+While it has VoIP traffic, JaldiGate attaches a VoIP report to each request:
+the largest VoIP frame it has sent lately or has waiting, and, if a JaldiDecap
+upstream of the control input measures latency, an upper bound on the latency
+of frames from the master. The master sizes the station's places in the VoIP
+slot from these.
+
+JaldiGate follows the talk spurts of each VoIP flow. A flow whose queue has
+been empty at SILENCE VoIP slots in a row is taken to be silent, and isn't
+requested a place; until then it is, even if its queue is momentarily empty
+between packets. A place in a VoIP slot that finds all our flows quiet is
+released early: the rest of it, up to the master's guard, goes to bulk
+frames, in the same round.
 
 There is one push output (though a second push output may be connected to
 receive erroneous packets). 
 
+Bulk frames are protected by selective retransmission. JaldiGate keeps a copy
+of each bulk frame it sends until the master acknowledges it, in a block ACK
+attached to a CONTENTION_SLOT. Frames the ACK reports missing are queued for
+retransmission, included in the next request, and sent ahead of new bulk
+data in the next TRANSMIT_SLOT. In the other direction, if a JaldiDecap is
+found upstream of the control input, JaldiGate attaches a block ACK for the
+bulk frames it has received from the master to each request it sends, and
+sends a request solely to carry an ACK when there's nothing to request.
+
+If fragmentation is on, a bulk frame that doesn't fit in what's left of a
+TRANSMIT_SLOT is split, and its first fragment sent to fill the slot exactly;
+the rest is sent at the start of the next TRANSMIT_SLOT, and requested like
+any other bulk data. JaldiDecap at the master puts it back together.
+
+Bulk frames are normally sent in order, stopping at the first that doesn't
+fit in what's left of the TRANSMIT_SLOT. With LOOKAHEAD set, JaldiGate then
+looks that many frames into the bulk queue for the longest one that does
+fit, sends it, and repeats until nothing more fits. A frame is never sent
+ahead of an earlier frame of the same IP flow, so each flow's packets stay
+in order, and the head is passed by at most LOOKAHEAD frames before it goes
+itself, so it can't be held back indefinitely. Frames that carry several
+packets (see JaldiAggregate), or that aren't IPv4, are never passed. Any
+fragment comes after.
+
+Keyword arguments are:
+
+=over 8
+
+=item ARQ
+
+Boolean. If false, don't keep bulk frames for retransmission. Default is true.
+
+=item FRAGMENT
+
+Boolean. If true, fill the end of each TRANSMIT_SLOT with a fragment of the
+next bulk frame. Default is false.
+
+=item LOOKAHEAD
+
+Unsigned. How many bulk frames deep to look for frames that fit in what's
+left of a TRANSMIT_SLOT once the head of the queue doesn't. 0 turns packing
+off. Default is 0.
+
+=item SILENCE
+
+Unsigned. How many VoIP slots in a row a VoIP flow must have nothing to send
+before it's taken to be silent; 0 counts only flows with packets waiting.
+Default is 3.
+
+=back
+
+=h arq read-only
+
+Returns the number of bulk frames kept for retransmission, acknowledged,
+retransmitted, and given up on (because too many newer frames were sent
+before they were acknowledged), and the number of frames and bytes waiting
+to be retransmitted.
+
+=h packing read-only
+
+Returns the number of frames, and of bytes, sent ahead of the head of the
+bulk queue because of LOOKAHEAD.
+
+=h bulk_requested read-only
+
+Returns the number of bytes of bulk data asked for and not yet sent.
+
+=h bulk_pending read-only
+
+Returns the number of bytes of bulk data waiting to be sent, including the
+rest of a frame being sent in fragments.
+
+=h voip read-only
+
+Returns the number of VoIP flows talking, the VoIP frame size last reported,
+the number of places in VoIP slots given up to bulk data, and the bytes of
+bulk data sent in them.
+
 =a
 
-JaldiGate */
+JaldiDecap, JaldiScheduler */
 
 class JaldiQueue;
+class JaldiDecap;
 
 class JaldiGate : public Element { public:
 
@@ -54,26 +152,98 @@ class JaldiGate : public Element { public:
     bool can_live_reconfigure() const   { return true; }
     void take_state(Element*, ErrorHandler*);
 
+    void add_handlers();
+
     WritablePacket* make_request_frame();
 
     void push(int, Packet*);
 
+    // Frame visitor (see dispatch_frame() in Frame.hh)
+    void visit_data(Packet*, const jaldimac::Frame*);
+    void visit(Packet*, const jaldimac::Frame*, const jaldimac::ContentionSlotPayload&);
+    void visit(Packet*, const jaldimac::Frame*, const jaldimac::VoIPSlotPayload&);
+    void visit(Packet*, const jaldimac::Frame*, const jaldimac::TransmitSlotPayload&);
+    template<typename Payload> void visit(Packet*, const jaldimac::Frame*, const Payload&);
+    void visit_bad(Packet*, const jaldimac::Frame*);
+
   private:
+    bool accept(Packet*, const jaldimac::Frame*);
+    void process_block_acks(const jaldimac::Frame* f);
+    Packet* pull_bulk(bool sent = true);
+
+    // The frame pull_bulk() would return next
+    bool bulk_waiting() const           { return ! retransmit.empty() || ! bulk_queue->empty(); }
+    uint32_t next_bulk_length() const
+    {
+        return retransmit.empty() ? bulk_queue->head_length() : retransmit.head_length();
+    }
+
+    // Bulk data waiting to be sent, all of which we should have asked for
+    unsigned bulk_pending_bytes()
+    {
+        return bulk_queue->total_length() + retransmit.queued_bytes() + partial.remaining_length();
+    }
+    void send_fragment(uint32_t& duration_us);
+    void push_voip(Packet* vp);
+    void push_delay(uint32_t duration_us);
+    void observe_voip_slot();
+    uint32_t send_bulk_in_place(uint32_t duration_us);
+
+    // A flow is talking if its queue isn't empty, or wasn't at one of the
+    // last SILENCE VoIP slots
+    bool voip_talking(int voip_queue) const
+    {
+        return voip_empty_streaks[voip_queue] < silence || ! voip_queues[voip_queue]->empty();
+    }
+    int find_best_fit(uint32_t max_length);
+
+    static String read_handler(Element*, void*);
+
     static const int in_port_control = 0;
     static const int in_port_bulk = 1;
     static const int in_port_voip_first = 2;
-    static const int in_port_voip_overflow = in_port_voip_first + jaldimac::FLOWS_PER_VOIP_SLOT;
     static const int out_port = 0;
     static const int out_port_bad = 1;
 
+    int in_port_voip_overflow;          // The last input
     JaldiQueue* bulk_queue;
-    JaldiQueue* voip_queues[jaldimac::FLOWS_PER_VOIP_SLOT];
+    Vector<JaldiQueue*> voip_queues;
     JaldiQueue* voip_overflow_queue;
     bool outstanding_requests;
     uint32_t bulk_requested_bytes;
     uint8_t voip_requested_flows;
     uint8_t station_id;
+    bool arq_enabled;
+    bool fragment_enabled;
+    uint32_t lookahead;
+    uint32_t passed_head_seq;           // Head of the bulk queue, as last seen
+    uint32_t passed_count;              // Frames sent ahead of it
+
+    JaldiDecap* decap;                  // Source of our block ACKs, if any
+    JaldiRetransmitBuffer retransmit;   // Bulk frames sent to the master
+    JaldiPartialFrame partial;          // Bulk frame cut off by a slot's end
+
+    uint32_t packed_frames;
+    uint32_t packed_bytes;
+
+    uint32_t voip_frame_bytes;          // Largest VoIP frame sent lately
+    uint16_t voip_latency_us;           // As last reported
+    uint32_t silence;
+    Vector<uint32_t> voip_empty_streaks;
+    uint32_t voip_places_released;
+    uint32_t voip_reclaimed_bytes;
+
+    // Prebuilt control frames
+    JaldiFrameTemplate<jaldimac::REQUEST_FRAME, jaldimac::RequestFramePayload> request_frame_template;
+    JaldiFrameTemplate<jaldimac::DELAY_MESSAGE, jaldimac::DelayMessagePayload> delay_message_template;
 };
 
+template<typename Payload>
+inline void JaldiGate::visit(Packet* p, const jaldimac::Frame* f, const Payload&)
+{
+    // Control frames we don't act on are passed over like data
+    visit_data(p, f);
+}
+
 CLICK_ENDDECLS
 #endif
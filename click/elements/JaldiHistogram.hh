@@ -0,0 +1,114 @@
+#ifndef JALDI_HISTOGRAM_HH
+#define JALDI_HISTOGRAM_HH
+
+#include <click/string.hh>
+
+// A log-bucketed histogram of 32-bit samples (typically durations in
+// microseconds). Each power of two is split into 8 sub-buckets, so a reported
+// percentile is never more than 12.5% above the true value, while recording
+// a sample is just a couple of shifts and an increment. The histogram is not
+// thread safe; it should be updated from a single thread.
+class JaldiHistogram
+{
+  public:
+    static const unsigned sub_bucket_bits = 3;
+    static const unsigned sub_buckets = 1 << sub_bucket_bits;
+    static const unsigned nbuckets = (32 - sub_bucket_bits + 1) * sub_buckets;
+
+    JaldiHistogram()                    { clear(); }
+
+    void clear()
+    {
+        for (unsigned i = 0 ; i < nbuckets ; ++i)
+            _buckets[i] = 0;
+
+        _count = 0;
+        _sum = 0;
+        _max = 0;
+    }
+
+    inline void add(uint32_t value)
+    {
+        ++_buckets[bucket_of(value)];
+        ++_count;
+        _sum += value;
+
+        if (value > _max)
+            _max = value;
+    }
+
+    uint32_t count() const              { return _count; }
+    uint32_t max() const                { return _max; }
+    uint32_t mean() const               { return _count ? uint32_t(_sum / _count) : 0; }
+
+    // Returns an upper bound on the PCT-th percentile sample (0 if empty).
+    uint32_t percentile(unsigned pct) const
+    {
+        if (_count == 0)
+            return 0;
+
+        uint64_t rank = (uint64_t(_count) * pct + 99) / 100;
+        uint64_t seen = 0;
+
+        if (rank == 0)
+            rank = 1;
+
+        for (unsigned i = 0 ; i < nbuckets ; ++i)
+        {
+            seen += _buckets[i];
+
+            if (seen >= rank)
+                return upper_bound_of(i) < _max ? upper_bound_of(i) : _max;
+        }
+
+        return _max;
+    }
+
+    // Returns one "LOW-HIGH COUNT" line for every non-empty bucket.
+    String unparse() const
+    {
+        String s;
+
+        for (unsigned i = 0 ; i < nbuckets ; ++i)
+        {
+            if (_buckets[i])
+                s += String(lower_bound_of(i)) + "-" + String(upper_bound_of(i))
+                     + " " + String(_buckets[i]) + "\n";
+        }
+
+        return s;
+    }
+
+  private:
+    static inline unsigned bucket_of(uint32_t value)
+    {
+        if (value < sub_buckets)
+            return value;
+
+        unsigned exponent = 31 - __builtin_clz(value);
+        unsigned mantissa = (value >> (exponent - sub_bucket_bits)) & (sub_buckets - 1);
+        return (exponent - sub_bucket_bits + 1) * sub_buckets + mantissa;
+    }
+
+    static inline uint32_t lower_bound_of(unsigned bucket)
+    {
+        if (bucket < sub_buckets)
+            return bucket;
+
+        unsigned exponent = bucket / sub_buckets + sub_bucket_bits - 1;
+        unsigned mantissa = bucket % sub_buckets;
+        return (sub_buckets + mantissa) << (exponent - sub_bucket_bits);
+    }
+
+    static inline uint32_t upper_bound_of(unsigned bucket)
+    {
+        return bucket + 1 < nbuckets ? lower_bound_of(bucket + 1) - 1 : 0xFFFFFFFFU;
+    }
+
+    uint32_t _buckets[nbuckets];
+    uint32_t _count;
+    uint64_t _sum;
+    uint32_t _max;
+};
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef JALDI_LINK_LATENCY_HH
+#define JALDI_LINK_LATENCY_HH
+
+#include <click/string.hh>
+#include "Frame.hh"
+#include "JaldiHistogram.hh"
+
+// Records the one-way latency of the frames received from each source, from
+// the TX timestamp the sender's driver wrote in each frame's footer, and the
+// jitter: the change in latency between consecutive frames from the same
+// source. Latency is only meaningful if the sender's and receiver's clocks are
+// synchronized (by NTP, for instance), but jitter is unaffected by a constant
+// offset between them. Frames which seem to arrive before they were sent,
+// because of such an offset, are counted as skewed and left out of the
+// latency histogram.
+class JaldiLinkLatency
+{
+  public:
+    JaldiLinkLatency()
+    {
+        for (unsigned src = 0 ; src < nsources ; ++src)
+            _sources[src] = NULL;
+    }
+
+    ~JaldiLinkLatency()
+    {
+        for (unsigned src = 0 ; src < nsources ; ++src)
+            delete _sources[src];
+    }
+
+    void clear()
+    {
+        for (unsigned src = 0 ; src < nsources ; ++src)
+        {
+            delete _sources[src];
+            _sources[src] = NULL;
+        }
+    }
+
+    // A frame from SRC_ID, stamped TX_US by its sender, arrived at RX_US.
+    inline void add(uint8_t src_id, uint32_t tx_us, uint32_t rx_us)
+    {
+        Source* s = _sources[src_id];
+
+        if (! s && ! (s = _sources[src_id] = new Source))
+            return;
+
+        int32_t latency_us = int32_t(rx_us - tx_us);
+
+        if (latency_us < 0)
+            ++s->skewed;
+        else
+            s->latency.add(latency_us);
+
+        if (s->have_last)
+        {
+            int32_t change_us = latency_us - s->last_latency_us;
+            uint32_t jitter_us = change_us < 0 ? uint32_t(-change_us) : uint32_t(change_us);
+            s->jitter.add(jitter_us);
+
+            // Smoothed as in RFC 3550: J += (|D| - J) / 16, kept scaled by 16.
+            s->smoothed_jitter_x16 += jitter_us - ((s->smoothed_jitter_x16 + 8) >> 4);
+        }
+
+        s->last_latency_us = latency_us;
+        s->have_last = true;
+    }
+
+    // One line per source seen: its ID, the number of frames, latency mean,
+    // percentiles and maximum, the number of skewed frames, jitter
+    // percentiles and maximum, and the RFC 3550 smoothed jitter. All times
+    // are in microseconds.
+    String unparse() const
+    {
+        String s = "src frames latency_mean latency_p50 latency_p90 latency_p99 latency_max skewed jitter_p50 jitter_p90 jitter_p99 jitter_max jitter_rfc3550\n";
+
+        for (unsigned src = 0 ; src < nsources ; ++src)
+        {
+            const Source* source = _sources[src];
+
+            if (! source)
+                continue;
+
+            s += String(src) + " " + String(source->latency.count() + source->skewed)
+                 + " " + String(source->latency.mean())
+                 + " " + String(source->latency.percentile(50))
+                 + " " + String(source->latency.percentile(90))
+                 + " " + String(source->latency.percentile(99))
+                 + " " + String(source->latency.max())
+                 + " " + String(source->skewed)
+                 + " " + String(source->jitter.percentile(50))
+                 + " " + String(source->jitter.percentile(90))
+                 + " " + String(source->jitter.percentile(99))
+                 + " " + String(source->jitter.max())
+                 + " " + String(source->smoothed_jitter_x16 >> 4) + "\n";
+        }
+
+        return s;
+    }
+
+    // Sets US to an upper bound on the 99th percentile latency of the frames
+    // from SRC_ID, and returns true, if any have been measured.
+    bool latency_bound(uint8_t src_id, uint32_t& us) const
+    {
+        const Source* s = _sources[src_id];
+
+        if (! s || s->latency.count() == 0)
+            return false;
+
+        us = s->latency.percentile(99);
+        return true;
+    }
+
+    // The latency and jitter histograms of every source seen.
+    String unparse_histograms() const
+    {
+        String s;
+
+        for (unsigned src = 0 ; src < nsources ; ++src)
+        {
+            if (const Source* source = _sources[src])
+                s += "src " + String(src) + " latency:\n" + source->latency.unparse()
+                     + "src " + String(src) + " jitter:\n" + source->jitter.unparse();
+        }
+
+        return s;
+    }
+
+  private:
+    static const unsigned nsources = 256;
+
+    struct Source
+    {
+        Source() : skewed(0), last_latency_us(0), have_last(false), smoothed_jitter_x16(0) {}
+
+        JaldiHistogram latency;
+        JaldiHistogram jitter;
+        uint32_t skewed;
+        int32_t last_latency_us;
+        bool have_last;
+        uint32_t smoothed_jitter_x16;
+    };
+
+    JaldiLinkLatency(const JaldiLinkLatency&);
+    JaldiLinkLatency& operator=(const JaldiLinkLatency&);
+
+    Source* _sources[nsources];
+};
+
+#endif
@@ -47,8 +47,8 @@ void JaldiPrint::show_raw_payload(const Frame* f)
     {
         char buffer[5000];
         char* buf = buffer;
-        unsigned length = min(f->payload_length(), (const uint32_t) 2000);
-        const uint8_t* payload = f->payload;
+        unsigned length = min(f->payload_length(), size_t(2000));
+        const uint8_t* payload = f->payload();
 
         for (unsigned i = 0 ; i < length ; ++i)
         {
@@ -73,108 +73,119 @@ Packet* JaldiPrint::action(Packet* p)
     // Print header
     click_chatter("===========================");
 
+    if (p->length() < sizeof(Frame))
+    {
+        click_chatter("Truncated frame: %u bytes", p->length());
+        click_chatter("===========================");
+        return p;
+    }
+
     click_chatter("Preamble: %c%c%c%u    Source: %u    Dest: %u",
                   f->preamble[0], f->preamble[1], f->preamble[2],
                   unsigned(f->preamble[3]), f->src_id, f->dest_id);
 
-    click_chatter("Tag: %u    Length: %u    Payload Length: %u    Sequence #: %u",
-                  unsigned(f->tag), unsigned(f->length),
+    click_chatter("Extensions (bytes): %u    Length: %u    Payload Length: %u    Sequence #: %u",
+                  unsigned(f->extension_length()), unsigned(f->length),
                   unsigned(f->payload_length()), unsigned(f->seq));
 
-    switch (f->type)
+    if (frame_is_valid(f, p->length()))
     {
-        case BULK_FRAME:
+        for (FrameExtensionIterator it(f) ; it.valid() ; it.next())
         {
-            click_chatter("Type: BULK_FRAME");
-            show_raw_payload(f);
-            break;
+            if (it->type == EXT_BLOCK_ACK && it->length >= sizeof(BlockAckExtension))
+            {
+                BlockAckExtension ack;
+                memcpy(&ack, it->value, sizeof(ack));
+                click_chatter("Extension: EXT_BLOCK_ACK    Peer: %u    Next #: %u    Bitmap: %08x%08x",
+                              unsigned(ack.peer_id), unsigned(ack.next_seq),
+                              unsigned(ack.bitmap >> 32), unsigned(ack.bitmap & 0xFFFFFFFF));
+            }
+            else if (it->type == EXT_AGGREGATE && it->length >= sizeof(AggregateExtension))
+            {
+                AggregateExtension ae;
+                memcpy(&ae, it->value, sizeof(ae));
+                click_chatter("Extension: EXT_AGGREGATE    Subframes: %u", unsigned(ae.count));
+            }
+            else
+                click_chatter("Extension: type %u    Length: %u", unsigned(it->type), unsigned(it->length));
         }
+    }
 
-        case VOIP_FRAME:
-        {
-            click_chatter("Type: VOIP_FRAME");
-            show_raw_payload(f);
-            break;
-        }
+    dispatch_frame<void>(*this, p, f, p->length());
 
-        case REQUEST_FRAME:
-        {
-            const RequestFramePayload* rfp = (const RequestFramePayload*) f->payload;
-            click_chatter("Type: REQUEST_FRAME    Bulk request (bytes): %u    VoIP request (flows): %u",
-                          rfp->bulk_request_bytes, unsigned(rfp->voip_request_flows));
+    click_chatter("===========================");
 
-            show_raw_payload(f);
-            break;
-        }
+    return p;
+}
 
-        case CONTENTION_SLOT:
-        {
-            const ContentionSlotPayload* csp = (const ContentionSlotPayload*) f->payload;
-            click_chatter("Type: CONTENTION_SLOT    Duration (us): %u",
-                          csp->duration_us);
-            
-            show_raw_payload(f);
-            break;
-        }
+void JaldiPrint::visit_data(Packet*, const Frame* f)
+{
+    click_chatter(f->type == BULK_FRAME ? "Type: BULK_FRAME" : "Type: VOIP_FRAME");
+    show_raw_payload(f);
+}
 
-        case VOIP_SLOT:
-        {
-            // FIXME: Don't hardcode the number of flows per VoIP slot
-            const VoIPSlotPayload* vsp = (const VoIPSlotPayload*) f->payload;
-            click_chatter("Type: VOIP_SLOT    Duration (us): %u    Stations: %u %u %u %u",
-                          vsp->duration_us, unsigned(vsp->stations[0]),
-                          unsigned(vsp->stations[1]), unsigned(vsp->stations[2]),
-                          unsigned(vsp->stations[3]));
-            
-            show_raw_payload(f);
-            break;
-        }
+void JaldiPrint::visit(Packet*, const Frame* f, const RequestFramePayload& rfp)
+{
+    click_chatter("Type: REQUEST_FRAME    Bulk request (bytes): %u    VoIP request (flows): %u",
+                  rfp.bulk_request_bytes, unsigned(rfp.voip_request_flows));
+    show_raw_payload(f);
+}
 
-        case TRANSMIT_SLOT:
-        {
-            const TransmitSlotPayload* tsp = (const TransmitSlotPayload*) f->payload;
-            click_chatter("Type: TRANSMIT_SLOT    Duration (us): %u    Granted VoIP flows: %u",
-                          tsp->duration_us, unsigned(tsp->voip_granted_flows));
-            
-            show_raw_payload(f);
-            break;
-        }
+void JaldiPrint::visit(Packet*, const Frame* f, const ContentionSlotPayload& csp)
+{
+    click_chatter("Type: CONTENTION_SLOT    Duration (us): %u",
+                  csp.duration_us);
+    show_raw_payload(f);
+}
 
-        case BITRATE_MESSAGE:
-        {
-            const BitrateMessagePayload* bmp = (const BitrateMessagePayload*) f->payload;
-            click_chatter("Type: BITRATE_MESSAGE    Bitrate: %u", bmp->bitrate);
-            
-            show_raw_payload(f);
-            break;
-        }
+void JaldiPrint::visit(Packet*, const Frame* f, const VoIPSlotPayload& vsp)
+{
+    char buffer[11 * MAX_FLOWS_PER_VOIP_SLOT + 1];
+    char* buf = buffer;
+    unsigned flows = min(voip_slot_flows(f), MAX_FLOWS_PER_VOIP_SLOT);
 
-        case ROUND_COMPLETE_MESSAGE:
-        {
-            click_chatter("Type: ROUND_COMPLETE_MESSAGE");
-            
-            show_raw_payload(f);
-            break;
-        }
+    for (unsigned i = 0 ; i < flows ; ++i)
+        buf += sprintf(buf, " %u/%u", unsigned(vsp.flows[i].station), unsigned(vsp.flows[i].duration_us));
 
+    *buf = '\0';
 
-        case DELAY_MESSAGE:
-        {
-            const DelayMessagePayload* dmp = (const DelayMessagePayload*) f->payload;
-            click_chatter("Type: DELAY_MESSAGE    Duration (us): %u",
-                          dmp->duration_us);
-            
-            show_raw_payload(f);
-            break;
-        }
+    click_chatter("Type: VOIP_SLOT    Duration (us): %u    Flows: %u    Station/duration (us):%s",
+                  vsp.duration_us, voip_slot_flows(f), buffer);
+    show_raw_payload(f);
+}
 
-        default:
-            click_chatter("Type: <<<UNKNOWN TYPE>>>\n"); break;
-    }
+void JaldiPrint::visit(Packet*, const Frame* f, const TransmitSlotPayload& tsp)
+{
+    click_chatter("Type: TRANSMIT_SLOT    Duration (us): %u    Granted VoIP flows: %u",
+                  tsp.duration_us, unsigned(tsp.voip_granted_flows));
+    show_raw_payload(f);
+}
 
-    click_chatter("===========================");
+void JaldiPrint::visit(Packet*, const Frame* f, const BitrateMessagePayload& bmp)
+{
+    click_chatter("Type: BITRATE_MESSAGE    Bitrate: %u", bmp.bitrate);
+    show_raw_payload(f);
+}
 
-    return p;
+void JaldiPrint::visit(Packet*, const Frame* f, const RoundCompleteMessagePayload&)
+{
+    click_chatter("Type: ROUND_COMPLETE_MESSAGE");
+    show_raw_payload(f);
+}
+
+void JaldiPrint::visit(Packet*, const Frame* f, const DelayMessagePayload& dmp)
+{
+    click_chatter("Type: DELAY_MESSAGE    Duration (us): %u",
+                  dmp.duration_us);
+    show_raw_payload(f);
+}
+
+void JaldiPrint::visit_bad(Packet* p, const Frame* f)
+{
+    if (min_frame_length(f->type) == 0)
+        click_chatter("Type: <<<UNKNOWN TYPE>>>");
+    else
+        click_chatter("Type: %u <<<BAD LENGTH: %u bytes present>>>", unsigned(f->type), p->length());
 }
 
 void JaldiPrint::push(int, Packet* p)
@@ -43,6 +43,17 @@ class JaldiPrint : public Element { public:
     void push(int, Packet*);
     Packet* pull(int);
 
+    // Frame visitor (see dispatch_frame() in Frame.hh)
+    void visit_data(Packet*, const jaldimac::Frame*);
+    void visit(Packet*, const jaldimac::Frame*, const jaldimac::RequestFramePayload&);
+    void visit(Packet*, const jaldimac::Frame*, const jaldimac::ContentionSlotPayload&);
+    void visit(Packet*, const jaldimac::Frame*, const jaldimac::VoIPSlotPayload&);
+    void visit(Packet*, const jaldimac::Frame*, const jaldimac::TransmitSlotPayload&);
+    void visit(Packet*, const jaldimac::Frame*, const jaldimac::BitrateMessagePayload&);
+    void visit(Packet*, const jaldimac::Frame*, const jaldimac::RoundCompleteMessagePayload&);
+    void visit(Packet*, const jaldimac::Frame*, const jaldimac::DelayMessagePayload&);
+    void visit_bad(Packet*, const jaldimac::Frame*);
+
   private:
     static const int in_port = 0;
     static const int out_port = 0;
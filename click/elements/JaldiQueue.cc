@@ -23,7 +23,7 @@
 CLICK_DECLS
 
 JaldiQueue::JaldiQueue()
-    : _q(0)
+    : _q(0), _mpsc(false), _seq(0), _latency(true)
 {
 }
 
@@ -39,6 +39,8 @@ JaldiQueue::cast(const char *n)
     else if (strcmp(n, "JaldiQueue") == 0
              || strcmp(n, "Queue") == 0)
         return (Element *)this;
+    else if (strcmp(n, Notifier::EMPTY_NOTIFIER) == 0)
+        return static_cast<Notifier *>(&_empty_note);
     else
         return 0;
 }
@@ -47,11 +49,20 @@ int
 JaldiQueue::configure(Vector<String> &conf, ErrorHandler *errh)
 {
     int new_capacity = 1000;
+    bool new_mpsc = false;
+    bool new_latency = true;
     if (cp_va_kparse(conf, this, errh,
                      "CAPACITY", cpkP, cpUnsigned, &new_capacity,
+                     "MPSC", 0, cpBool, &new_mpsc,
+                     "LATENCY", 0, cpBool, &new_latency,
                      cpEnd) < 0)
         return -1;
     _capacity = new_capacity;
+    _mpsc = new_mpsc;
+    _latency = new_latency;
+    // Pullers look for the notifier as they initialize, maybe before we do;
+    // initializing it again on a live reconfigure does nothing.
+    _empty_note.initialize(Notifier::EMPTY_NOTIFIER, router());
     return 0;
 }
 
@@ -62,8 +73,14 @@ JaldiQueue::initialize(ErrorHandler *errh)
     _q = (Packet **) CLICK_LALLOC(sizeof(Packet *) * (_capacity + 1));
     if (_q == 0)
         return errh->error("out of memory");
+    memset((void *) _q, 0, sizeof(Packet *) * (_capacity + 1));
+    _seq = (uint32_t *) CLICK_LALLOC(sizeof(uint32_t) * (_capacity + 1));
+    if (_seq == 0)
+        return errh->error("out of memory");
+    mpsc_reset();
     _drops = 0;
     _highwater_length = 0;
+    _sojourn.clear();
     return 0;
 }
 
@@ -72,17 +89,29 @@ JaldiQueue::live_reconfigure(Vector<String> &conf, ErrorHandler *errh)
 {
     // change the maximum queue length at runtime
     int old_capacity = _capacity;
+    // pick up any packets pushed in MPSC mode before it may be turned off
+    mpsc_publish();
     // NB: do not call children!
     if (JaldiQueue::configure(conf, errh) < 0)
         return -1;
-    if (_capacity == old_capacity || !_q)
+    if (!_q)
+        return 0;
+    if (_capacity == old_capacity) {
+        mpsc_reset();
         return 0;
+    }
     int new_capacity = _capacity;
     _capacity = old_capacity;
 
     Packet **new_q = (Packet **) CLICK_LALLOC(sizeof(Packet *) * (new_capacity + 1));
     if (new_q == 0)
         return errh->error("out of memory");
+    memset(new_q, 0, sizeof(Packet *) * (new_capacity + 1));
+    uint32_t *new_seq = (uint32_t *) CLICK_LALLOC(sizeof(uint32_t) * (new_capacity + 1));
+    if (new_seq == 0) {
+        CLICK_LFREE(new_q, sizeof(Packet *) * (new_capacity + 1));
+        return errh->error("out of memory");
+    }
 
     int i, j;
     for (i = _head, j = 0; i != _tail && j != new_capacity; i = next_i(i))
@@ -91,10 +120,13 @@ JaldiQueue::live_reconfigure(Vector<String> &conf, ErrorHandler *errh)
         _q[i]->kill();
 
     CLICK_LFREE(_q, sizeof(Packet *) * (_capacity + 1));
+    CLICK_LFREE((uint32_t *) _seq, sizeof(uint32_t) * (_capacity + 1));
     _q = new_q;
+    _seq = new_seq;
     _head = 0;
     _tail = j;
     _capacity = new_capacity;
+    mpsc_reset();
     return 0;
 }
 
@@ -118,7 +150,10 @@ JaldiQueue::take_state(Element *e, ErrorHandler *errh)
         j = q->next_i(j);
     }
     _tail = i;
+    mpsc_reset();
     _highwater_length = size();
+    if (_tail != _head)
+        _empty_note.wake();
 
     if (j != q->_tail)
         errh->warning("some packets lost (old length %d, new capacity %d)",
@@ -129,6 +164,7 @@ JaldiQueue::take_state(Element *e, ErrorHandler *errh)
     }
     q->set_head(0);
     q->set_tail(0);
+    q->mpsc_reset();
 }
 
 void
@@ -137,22 +173,63 @@ JaldiQueue::cleanup(CleanupStage)
     for (int i = _head; i != _tail; i = next_i(i))
         _q[i]->kill();
     CLICK_LFREE(_q, sizeof(Packet *) * (_capacity + 1));
+    CLICK_LFREE((uint32_t *) _seq, sizeof(uint32_t) * (_capacity + 1));
     _q = 0;
+    _seq = 0;
+}
+
+// Number the slots afresh, for a queue holding the packets in
+// [_head, _tail): each slot from _head onwards takes its index as its
+// position, the ones before it the next lap's, and each slot's sequence
+// number says whether it's stored or free for its position. Not safe with
+// pushers running.
+void
+JaldiQueue::mpsc_reset()
+{
+    uint32_t n = _capacity + 1;
+    _mpsc_wrap = (0xFFFFFFFFU / n) * n;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t pos = (int) i >= _head ? i : i + n;
+        bool stored = (_head <= _tail ? (int) i >= _head && (int) i < _tail
+                       : (int) i >= _head || (int) i < _tail);
+        _seq[i] = stored ? pos + 1 : pos;
+    }
+    _head_pos = _head;
+    _tail_pos = _tail >= _head ? _tail : _tail + n;
+    _xtail = _tail_pos;
 }
 
 void
 JaldiQueue::push(int, Packet *p)
 {
+    if (_mpsc) {
+        uint32_t pos;
+        if (mpsc_reserve(pos))
+            mpsc_store(pos, p);
+        else {
+            if (_drops == 0 && _capacity > 0)
+                click_chatter("%{element}: overflow", this);
+            _drops++;
+            checked_output_push(1, p);
+        }
+        return;
+    }
+
     // If you change this code, also change NotifierQueue::push()
     // and FullNoteQueue::push().
     int h = _head, t = _tail, nt = next_i(t);
 
     // should this stuff be in JaldiQueue::enq?
     if (nt != h) {
+        if (_latency)
+            set_jaldi_enqueue_time_anno(p, jaldi_now_us());
         _q[t] = p;
         packet_memory_barrier(_q[t], _tail);
         _tail = nt;
 
+        if (!_empty_note.active())
+            _empty_note.wake();
+
         int s = size(h, nt);
         if (s > _highwater_length)
             _highwater_length = s;
@@ -169,7 +246,17 @@ JaldiQueue::push(int, Packet *p)
 Packet *
 JaldiQueue::pull(int)
 {
-    return deq();
+    Packet *p = deq();
+    if (p && _latency)
+        _sojourn.add(jaldi_sojourn_us(p, jaldi_now_us()));
+    else if (!p) {
+        _empty_note.sleep();
+        // A pusher on another thread may have stored a packet, and found
+        // us awake, just before we went to sleep; check again.
+        if (!empty())
+            _empty_note.wake();
+    }
+    return p;
 }
 
 #if 0
@@ -204,13 +291,28 @@ JaldiQueue::read_handler(Element *e, void *thunk)
     int which = reinterpret_cast<intptr_t>(thunk);
     switch (which) {
       case 0:
-        return String(q->size());
+        // Not size(), which would publish MPSC pushes from outside the puller
+        return String(q->Storage::size());
       case 1:
         return String(q->highwater_length());
       case 2:
         return String(q->capacity());
       case 3:
         return String(q->_drops);
+      case 4:
+        return String(q->_mpsc);
+      case 5:
+        return String(q->_sojourn.percentile(50));
+      case 6:
+        return String(q->_sojourn.percentile(90));
+      case 7:
+        return String(q->_sojourn.percentile(99));
+      case 8:
+        return String(q->_sojourn.max());
+      case 9:
+        return String(q->_sojourn.count());
+      case 10:
+        return q->_sojourn.unparse();
       default:
         return "";
     }
@@ -231,11 +333,14 @@ JaldiQueue::write_handler(const String &, Element *e, void *thunk, ErrorHandler
     switch (which) {
       case 0:
         q->_drops = 0;
-        q->_highwater_length = q->size();
+        q->_highwater_length = q->Storage::size();
         return 0;
       case 1:
         q->reset();
         return 0;
+      case 2:
+        q->_sojourn.clear();
+        return 0;
       default:
         return errh->error("internal error");
     }
@@ -248,9 +353,17 @@ JaldiQueue::add_handlers()
     add_read_handler("highwater_length", read_handler, (void *)1);
     add_read_handler("capacity", read_handler, (void *)2, Handler::CALM);
     add_read_handler("drops", read_handler, (void *)3);
+    add_read_handler("mpsc", read_handler, (void *)4, Handler::CALM);
+    add_read_handler("sojourn_p50", read_handler, (void *)5);
+    add_read_handler("sojourn_p90", read_handler, (void *)6);
+    add_read_handler("sojourn_p99", read_handler, (void *)7);
+    add_read_handler("sojourn_max", read_handler, (void *)8);
+    add_read_handler("sojourn_count", read_handler, (void *)9);
+    add_read_handler("sojourn_histogram", read_handler, (void *)10);
     add_write_handler("capacity", reconfigure_keyword_handler, "0 CAPACITY");
     add_write_handler("reset_counts", write_handler, (void *)0, Handler::BUTTON | Handler::NONEXCLUSIVE);
     add_write_handler("reset", write_handler, (void *)1, Handler::BUTTON);
+    add_write_handler("reset_sojourn", write_handler, (void *)2, Handler::BUTTON | Handler::NONEXCLUSIVE);
 }
 
 CLICK_ENDDECLS
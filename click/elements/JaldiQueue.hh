@@ -2,13 +2,17 @@
 #define CLICK_JALDIQUEUE_HH
 #include <click/element.hh>
 #include <click/standard/storage.hh>
+#include <click/atomic.hh>
+#include <click/notifier.hh>
+#include "JaldiClick.hh"
+#include "JaldiHistogram.hh"
 CLICK_DECLS
 
 /*
 =c
 
 JaldiQueue
-JaldiQueue(CAPACITY)
+JaldiQueue(CAPACITY [, I<keywords> MPSC, LATENCY])
 
 =s jaldi
 
@@ -20,24 +24,54 @@ Stores incoming packets in a first-in-first-out queue.
 Drops incoming packets if the queue already holds CAPACITY packets.
 The default for CAPACITY is 1000.
 
-B<Multithreaded Click note:> JaldiQueue is designed to be used in an
-environment with at most one concurrent pusher and at most one concurrent
+Keyword arguments are:
+
+=over 8
+
+=item MPSC
+
+Boolean. If true, the queue accepts multiple concurrent pushers (see below).
+Default is false.
+
+=item LATENCY
+
+Boolean. If true, the queue records the time each packet spends in it (its
+sojourn time) and keeps a histogram of sojourn times for the C<sojourn_*>
+handlers. Packets taken out of the middle of the queue (by yank_at(), yank1()
+or yank(); JaldiGate uses yank_at() to pack slots) count as well as those pulled.
+This costs a clock read on every push and pull and uses one 32-bit user
+annotation. Default is true.
+
+=back
+
+B<Multithreaded Click note:> By default, JaldiQueue is designed to be used in
+an environment with at most one concurrent pusher and at most one concurrent
 puller.  Thus, at most one thread pushes to the JaldiQueue at a time and at
 most one thread pulls from the JaldiQueue at a time.  Different threads can
-push to and pull from the JaldiQueue concurrently, however.  See
-ThreadSafeQueue for a queue that can support multiple concurrent pushers and
-pullers.
+push to and pull from the JaldiQueue concurrently, however.
+
+If MPSC is true, any number of threads may push to the JaldiQueue at once,
+while there must still be at most one concurrent puller.  Pushers claim a
+slot with an atomic compare-and-swap on a position counter and never wait on
+each other.  Each slot carries a sequence number recording the position it
+was last stored or freed for, as in Vyukov's bounded queue, so a pusher that
+was held up can't mistake one lap of the ring for another.  A packet becomes
+visible to the puller once it and every packet claimed before it have been
+stored.  Everything the other Jaldi elements rely on (total_length,
+head_length, the yank family, empty) runs on the puller's side and only sees
+fully stored packets, so JaldiScheduler, JaldiGate and the fake drivers can
+sit behind an MPSC JaldiQueue unchanged.  lifo_enq() is not supported in this
+mode.
 
 JaldiQueue is a variation of SimpleQueue from the Click distribution that
 includes internal changes required for other Jaldi elements, such as JaldiGate,
-to work. From the level of the Click configuration language, there is no
-difference between JaldiQueue and SimpleQueue.
+to work. Like NotifierQueue, it tells downstream pullers when it becomes empty
+or nonempty, so that they can sleep until there's something to pull.
 
 =n
 
-The Queue and NotifierQueue elements act like JaldiQueue, but additionally
-notify interested parties when they change state (from nonempty to empty or
-vice versa, and/or from nonfull to full or vice versa).
+The Queue element acts like JaldiQueue, but additionally notifies interested
+parties when it changes from nonfull to full or vice versa.
 
 =h length read-only
 
@@ -51,11 +85,46 @@ Returns the maximum number of packets that have ever been in the queue at once.
 
 Returns or sets the queue's capacity.
 
+=h mpsc read-only
+
+Returns true if the queue accepts multiple concurrent pushers.
+
 =h drops read-only
 
 Returns the number of packets dropped by the queue so far.  Dropped packets
 are emitted on output 1 if output 1 exists.
 
+=h sojourn_p50 read-only
+
+Returns the median time, in microseconds, that pulled packets spent in the
+queue. Like the other percentiles, this is an upper bound accurate to within
+12.5%.
+
+=h sojourn_p90 read-only
+
+Returns the 90th percentile sojourn time in microseconds.
+
+=h sojourn_p99 read-only
+
+Returns the 99th percentile sojourn time in microseconds.
+
+=h sojourn_max read-only
+
+Returns the longest sojourn time seen, in microseconds.
+
+=h sojourn_count read-only
+
+Returns the number of sojourn times recorded.
+
+=h sojourn_histogram read-only
+
+Returns the sojourn time histogram, one "LOW-HIGH COUNT" line per non-empty
+bucket.
+
+=h reset_sojourn write-only
+
+When written, clears the sojourn time histogram.
+
 =h reset_counts write-only
 
 When written, resets the C<drops> and C<highwater_length> counters.
@@ -74,11 +143,23 @@ class JaldiQueue : public Element, public Storage { public:
     int drops() const               { return _drops; }
     int highwater_length() const        { return _highwater_length; }
 
+    bool mpsc() const                   { return _mpsc; }
+    const JaldiHistogram& sojourn() const   { return _sojourn; }
+
     inline bool enq(Packet*);
+    inline bool mpsc_enq(Packet*);
     inline void lifo_enq(Packet*);
     inline Packet* deq();
     inline unsigned total_length();
     inline unsigned head_length();
+    inline Packet* packet_at(int i);
+    inline Packet* yank_at(int i);
+
+    // In MPSC mode, packets that have been pushed only show up at the tail
+    // once the puller looks for them; see mpsc_publish().
+    using Storage::size;
+    int size() const                    { mpsc_publish(); return Storage::size(); }
+    bool empty() const                  { mpsc_publish(); return Storage::empty(); }
 
     // to be used with care
     Packet* packet(int i) const         { return _q[i]; }
@@ -110,6 +191,33 @@ class JaldiQueue : public Element, public Storage { public:
     volatile int _drops;
     int _highwater_length;
 
+    // MPSC mode: positions count pushes, modulo _mpsc_wrap (a multiple of
+    // the ring size, so a position always maps to the same slot). A pusher
+    // claims position POS by advancing _xtail from it, once the slot's
+    // sequence number says the slot is free for POS, then stores its packet
+    // and sets the sequence number to POS + 1. The puller moves _tail over
+    // the stored slots in order, and frees a slot for the next lap by setting
+    // its sequence number to POS plus the ring size.
+    bool _mpsc;
+    atomic_uint32_t _xtail;             // Next position to claim
+    volatile uint32_t *_seq;
+    volatile uint32_t _head_pos;        // Position of _head
+    mutable uint32_t _tail_pos;         // Position of _tail
+    uint32_t _mpsc_wrap;
+
+    bool _latency;
+    JaldiHistogram _sojourn;
+
+    ActiveNotifier _empty_note;
+
+    inline uint32_t mpsc_pos_add(uint32_t pos, uint32_t n) const;
+    inline uint32_t mpsc_pos_diff(uint32_t a, uint32_t b) const;
+    inline bool mpsc_reserve(uint32_t &pos);
+    inline void mpsc_store(uint32_t pos, Packet *p);
+    inline void mpsc_publish() const;
+    inline void mpsc_release(int to);
+    void mpsc_reset();
+
     friend class MixedQueue;
     friend class TokenQueue;
     friend class InOrderQueue;
@@ -125,11 +233,17 @@ inline bool
 JaldiQueue::enq(Packet *p)
 {
     assert(p);
+    if (_mpsc)
+    return mpsc_enq(p);
     int h = _head, t = _tail, nt = next_i(t);
     if (nt != h) {
+    if (_latency)
+        set_jaldi_enqueue_time_anno(p, jaldi_now_us());
     _q[t] = p;
     packet_memory_barrier(_q[t], _tail);
     _tail = nt;
+    if (!_empty_note.active())
+        _empty_note.wake();
     int s = size(h, nt);
     if (s > _highwater_length)
         _highwater_length = s;
@@ -141,12 +255,114 @@ JaldiQueue::enq(Packet *p)
     }
 }
 
+inline uint32_t
+JaldiQueue::mpsc_pos_add(uint32_t pos, uint32_t n) const
+{
+    return n >= _mpsc_wrap - pos ? n - (_mpsc_wrap - pos) : pos + n;
+}
+
+inline uint32_t
+JaldiQueue::mpsc_pos_diff(uint32_t a, uint32_t b) const
+{
+    return a >= b ? a - b : a + (_mpsc_wrap - b);
+}
+
+// Move _tail over every slot that has been stored, in order. Only the puller
+// does this, so nobody has to wait for a slower pusher that claimed an
+// earlier slot, and _tail never covers a slot that's still being stored.
+inline void
+JaldiQueue::mpsc_publish() const
+{
+    if (!_mpsc)
+    return;
+    int t = _tail;
+    uint32_t pos = _tail_pos, npos;
+    while (_seq[t] == (npos = mpsc_pos_add(pos, 1))) {
+    pos = npos;
+    t = next_i(t);
+    }
+    _tail_pos = pos;
+    const_cast<JaldiQueue *>(this)->_tail = t;
+}
+
+// Claim the next position for a new packet. Returns false if the queue is
+// full.
+inline bool
+JaldiQueue::mpsc_reserve(uint32_t &pos)
+{
+    while (true) {
+    // Read the head first, so that it's never ahead of the position.
+    uint32_t h = _head_pos;
+    pos = _xtail.value();
+    if (mpsc_pos_diff(pos, h) >= (uint32_t) _capacity) {
+        // Full when we read the head, unless someone has claimed since.
+        if (_xtail.value() == pos)
+        return false;
+        continue;
+    }
+    // A sequence number other than POS means another pusher got there
+    // first and our position is stale.
+    if (_seq[pos % (_capacity + 1)] == pos
+        && _xtail.compare_and_swap(pos, mpsc_pos_add(pos, 1)))
+        return true;
+    }
+}
+
+// Store a packet at a position returned by mpsc_reserve().
+inline void
+JaldiQueue::mpsc_store(uint32_t pos, Packet *p)
+{
+    if (_latency)
+    set_jaldi_enqueue_time_anno(p, jaldi_now_us());
+    int t = pos % (_capacity + 1);
+    _q[t] = p;
+    packet_memory_barrier(_q[t], _seq[t]);
+    _seq[t] = mpsc_pos_add(pos, 1);
+    if (!_empty_note.active())
+    _empty_note.wake();
+
+    // Racy, but only ever used for reporting.
+    int s = size(_head, next_i(t));
+    if (s > _highwater_length)
+    _highwater_length = s;
+}
+
+inline bool
+JaldiQueue::mpsc_enq(Packet *p)
+{
+    assert(p);
+    uint32_t pos;
+    if (mpsc_reserve(pos)) {
+    mpsc_store(pos, p);
+    return true;
+    } else {
+    p->kill();
+    _drops++;
+    return false;
+    }
+}
+
+// Free the slots in [_head, to) for the pushers' next lap, after the puller
+// has taken them. The caller then moves _head to TO.
+inline void
+JaldiQueue::mpsc_release(int to)
+{
+    uint32_t pos = _head_pos;
+    for (int i = _head; i != to; i = next_i(i)) {
+    _q[i] = 0;
+    _seq[i] = mpsc_pos_add(pos, _capacity + 1);
+    pos = mpsc_pos_add(pos, 1);
+    }
+    packet_memory_barrier(_seq[to], _head_pos);
+    _head_pos = pos;
+}
+
 inline void
 JaldiQueue::lifo_enq(Packet *p)
 {
     // XXX NB: significantly more dangerous in a multithreaded environment
     // than plain (FIFO) enq().
-    assert(p);
+    assert(p && !_mpsc);
     int h = _head, t = _tail, ph = prev_i(h);
     if (ph == t) {
     t = prev_i(t);
@@ -156,14 +372,19 @@ JaldiQueue::lifo_enq(Packet *p)
     _q[ph] = p;
     packet_memory_barrier(_q[ph], _head);
     _head = ph;
+    if (!_empty_note.active())
+    _empty_note.wake();
 }
 
 inline Packet *
 JaldiQueue::deq()
 {
+    mpsc_publish();
     int h = _head, t = _tail;
     if (h != t) {
     Packet *p = _q[h];
+    if (_mpsc)
+        mpsc_release(next_i(h));
     packet_memory_barrier(_q[h], _head);
     _head = next_i(h);
     assert(p);
@@ -178,6 +399,7 @@ JaldiQueue::total_length()
 {
     unsigned size = 0;
 
+    mpsc_publish();
     for (int trav = _head; trav != _tail; trav = next_i(trav))
         size += _q[trav]->length();
 
@@ -192,6 +414,47 @@ JaldiQueue::head_length()
     return _q[_head]->length();
 }
 
+// Return the packet I places behind the head of the queue, or null if the
+// queue isn't that long. The packet stays in the queue.
+inline Packet *
+JaldiQueue::packet_at(int i)
+{
+    if (i < 0 || i >= size())
+    return 0;
+    int trav = _head + i;
+    if (trav > _capacity)
+    trav -= _capacity + 1;
+    return _q[trav];
+}
+
+// Remove and return the packet I places behind the head of the queue, or
+// null if the queue isn't that long, as yank1() would if its filter had
+// picked it. The I packets in front of it move back one place, so this costs
+// O(I) rather than O(length). The caller must deallocate the packet.
+inline Packet *
+JaldiQueue::yank_at(int i)
+{
+    if (i < 0 || i >= size())
+    return 0;
+    int trav = _head + i;
+    if (trav > _capacity)
+    trav -= _capacity + 1;
+    Packet *p = _q[trav];
+    int prev = prev_i(trav);
+    while (trav != _head) {
+    _q[trav] = _q[prev];
+    trav = prev;
+    prev = prev_i(prev);
+    }
+    if (_mpsc)
+    mpsc_release(next_i(_head));
+    packet_memory_barrier(_q[_head], _head);
+    _head = next_i(_head);
+    if (_latency)
+    _sojourn.add(jaldi_sojourn_us(p, jaldi_now_us()));
+    return p;
+}
+
 template <typename Filter>
 Packet *
 JaldiQueue::yank1(Filter filter)
@@ -199,6 +462,7 @@ JaldiQueue::yank1(Filter filter)
        'filter(Packet *)'. The returned packet must be deallocated by the
        caller. */
 {
+    mpsc_publish();
     for (int trav = _head; trav != _tail; trav = next_i(trav))
     if (filter(_q[trav])) {
         Packet *p = _q[trav];
@@ -208,7 +472,11 @@ JaldiQueue::yank1(Filter filter)
         trav = prev;
         prev = prev_i(prev);
         }
+        if (_mpsc)
+        mpsc_release(next_i(_head));
         _head = next_i(_head);
+        if (_latency)
+        _sojourn.add(jaldi_sojourn_us(p, jaldi_now_us()));
         return p;
     }
     return 0;
@@ -221,6 +489,7 @@ JaldiQueue::yank1_peek(Filter filter)
        'filter(Packet *)'. The returned packet must *NOT* be deallocated by the
        caller. */
 {
+    mpsc_publish();
     for (int trav = _head; trav != _tail; trav = next_i(trav))
     if (filter(_q[trav])) {
         Packet *p = _q[trav];
@@ -238,18 +507,25 @@ JaldiQueue::yank(Filter filter, Vector<Packet *> &yank_vec)
        that matched 'filter()'. Caller should deallocate any packets returned
        in 'yank_vec'. Returns the number of packets yanked. */
 {
-    int write_ptr = _tail;
+    mpsc_publish();
+    int t = _tail;
+    int write_ptr = t;
     int nyanked = 0;
-    for (int trav = _tail; trav != _head; ) {
+    uint32_t now_us = (_latency ? jaldi_now_us() : 0);
+    for (int trav = t; trav != _head; ) {
     trav = prev_i(trav);
     if (filter(_q[trav])) {
         yank_vec.push_back(_q[trav]);
         nyanked++;
+        if (_latency)
+        _sojourn.add(jaldi_sojourn_us(_q[trav], now_us));
     } else {
         write_ptr = prev_i(write_ptr);
         _q[write_ptr] = _q[trav];
     }
     }
+    if (_mpsc)
+    mpsc_release(write_ptr);
     _head = write_ptr;
     return nyanked;
 }
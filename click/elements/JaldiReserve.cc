@@ -0,0 +1,87 @@
+/*
+ * JaldiReserve.{cc,hh} -- makes room for a Jaldi header and footer
+ */
+
+#include <click/config.h>
+#include <click/confparse.hh>
+#include <click/error.hh>
+#include <click/glue.hh>
+
+#include "Frame.hh"
+#include "JaldiClick.hh"
+#include "JaldiReserve.hh"
+
+using namespace jaldimac;
+
+CLICK_DECLS
+
+JaldiReserve::JaldiReserve() : headroom(0), tailroom(0), copies(0)
+{
+}
+
+JaldiReserve::~JaldiReserve()
+{
+}
+
+int JaldiReserve::configure(Vector<String>& conf, ErrorHandler* errh)
+{
+    headroom = Frame::header_size;
+    tailroom = Frame::footer_size;
+
+    // Parse configuration parameters
+    if (cp_va_kparse(conf, this, errh,
+             "HEADROOM", 0, cpUnsigned, &headroom,
+             "TAILROOM", 0, cpUnsigned, &tailroom,
+             cpEnd) < 0)
+        return -1;
+
+    return 0;
+}
+
+Packet* JaldiReserve::action(Packet* p)
+{
+    bool copied;
+    WritablePacket* wp = jaldi_reserve(p, headroom, tailroom, copied);
+
+    if (copied)
+        ++copies;
+
+    return wp;
+}
+
+void JaldiReserve::push(int, Packet* p)
+{
+    if (Packet* q = action(p))
+        output(out_port).push(q);
+}
+
+Packet* JaldiReserve::pull(int)
+{
+    if (Packet *p = input(in_port).pull())
+        return action(p);
+    else
+        return NULL;
+}
+
+String JaldiReserve::read_handler(Element* e, void*)
+{
+    JaldiReserve* jr = static_cast<JaldiReserve*>(e);
+    return String(jr->copies);
+}
+
+int JaldiReserve::write_handler(const String&, Element* e, void*, ErrorHandler*)
+{
+    JaldiReserve* jr = static_cast<JaldiReserve*>(e);
+    jr->copies = 0;
+    return 0;
+}
+
+void JaldiReserve::add_handlers()
+{
+    add_read_handler("copies", read_handler, (void*) 0);
+    add_write_handler("reset_counts", write_handler, (void*) 0);
+}
+
+CLICK_ENDDECLS
+ELEMENT_REQUIRES(Frame)
+EXPORT_ELEMENT(JaldiReserve)
@@ -0,0 +1,90 @@
+#ifndef CLICK_JALDIRESERVE_HH
+#define CLICK_JALDIRESERVE_HH
+#include <click/element.hh>
+CLICK_DECLS
+
+/*
+=c
+
+JaldiReserve([I<keywords> HEADROOM, TAILROOM])
+
+=s jaldi
+
+makes room for a Jaldi header and footer
+
+=d
+
+Makes sure that each packet passing through has room for a Jaldi header in
+front of it and a footer behind it, and isn't shared, so that JaldiEncap (or
+JaldiClassifier) can encapsulate it in place. Packets that already have the
+room pass through untouched; others are copied, once, into a buffer with the
+room (and the default headroom on top, for any headers added after the Jaldi
+header), keeping their annotations.
+
+JaldiReserve belongs right after the source of the packets, such as a
+KernelTun or the ath9k Strip/Decap chain, where a packet that needs copying
+is copied while it's fresh and before anything else has cloned it. The copy
+doesn't keep the header annotations, so it should come before CheckIPHeader
+and the like.
+
+Keyword arguments are:
+
+=over 8
+
+=item HEADROOM
+
+Unsigned. The headroom to make sure of, in bytes. Default is the size of the
+Jaldi header.
+
+=item TAILROOM
+
+Unsigned. The tailroom to make sure of, in bytes. Default is the size of the
+Jaldi footer.
+
+=back
+
+This element has one agnostic input and one agnostic output.
+
+=h copies read-only
+
+Returns the number of packets which had to be copied.
+
+=h reset_counts write-only
+
+When written, resets the C<copies> counter.
+
+=a
+
+JaldiEncap, JaldiClassifier */
+
+class JaldiReserve : public Element { public:
+
+    JaldiReserve();
+    ~JaldiReserve();
+
+    const char* class_name() const  { return "JaldiReserve"; }
+    const char* port_count() const  { return PORTS_1_1; }
+    const char* processing() const  { return AGNOSTIC; }
+    const char* flow_code() const   { return COMPLETE_FLOW; }
+
+    int configure(Vector<String>&, ErrorHandler*);
+    void add_handlers();
+
+    Packet* action(Packet* p);
+    void push(int, Packet*);
+    Packet* pull(int);
+
+  private:
+    static const int in_port = 0;
+    static const int out_port = 0;
+
+    uint32_t headroom;
+    uint32_t tailroom;
+    uint32_t copies;
+
+    static String read_handler(Element*, void*);
+    static int write_handler(const String&, Element*, void*, ErrorHandler*);
+};
+
+CLICK_ENDDECLS
+#endif
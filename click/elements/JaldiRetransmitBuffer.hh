@@ -0,0 +1,243 @@
+#ifndef JALDI_RETRANSMIT_BUFFER_HH
+#define JALDI_RETRANSMIT_BUFFER_HH
+
+#include <click/packet.hh>
+#include <click/string.hh>
+#include "Frame.hh"
+
+// Holds on to the BULK_FRAMEs sent to one peer until a block ACK (see
+// BlockAckExtension in Frame.hh) says whether they arrived, and queues the
+// ones that didn't for retransmission, oldest first. Frames are kept in a
+// ring indexed by sequence number, so recording a frame, acknowledging it or
+// queueing it costs O(1); a frame still held when its slot comes round again
+// is given up on and counted as expired.
+//
+// ACKs are built when the receiver's next control frame is prepared, which
+// may be well before that frame goes out, so an ACK can easily predate a
+// retransmission. A frame is therefore only taken to be lost once the
+// receiver has heard a frame first sent after it (the ACK's next_seq has
+// passed the frame's mark), never just because its bit is clear.
+class JaldiRetransmitBuffer
+{
+  public:
+    static const unsigned capacity = 256;
+
+    JaldiRetransmitBuffer() : _low(0), _next_seq(0), _started(false),
+                              _head(none), _tail(none), _queued(0), _queued_bytes(0),
+                              _buffered(0), _acked(0), _retransmitted(0), _expired(0)
+    {
+        for (unsigned i = 0 ; i < capacity ; ++i)
+            _entries[i].p = NULL;
+    }
+
+    ~JaldiRetransmitBuffer()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        for (unsigned i = 0 ; i < capacity ; ++i)
+        {
+            if (_entries[i].p)
+                _entries[i].p->kill();
+
+            _entries[i].p = NULL;
+        }
+
+        _started = false;
+        _head = _tail = none;
+        _queued = _queued_bytes = 0;
+        _buffered = _acked = _retransmitted = _expired = 0;
+    }
+
+    // The BULK_FRAME in P is being sent for the first time; keep a copy.
+    inline void sent(Packet* p)
+    {
+        uint32_t seq = ((const jaldimac::Frame*) p->data())->seq;
+        Entry& e = _entries[seq % capacity];
+
+        if (e.p)
+        {
+            ++_expired;
+            release(e);
+        }
+
+        if (! _started || int32_t(seq + 1 - _next_seq) > 0)
+            _next_seq = seq + 1;
+
+        if (! _started)
+        {
+            _low = seq;
+            _started = true;
+        }
+
+        if (! (e.p = p->clone()))
+            return;
+
+        // A frame sent after frames numbered above it (see JaldiGate's
+        // LOOKAHEAD) is only late once something is sent after it.
+        e.seq = seq;
+        e.mark = _next_seq;
+        e.queued = false;
+        ++_buffered;
+    }
+
+    // A block ACK arrived from the peer.
+    void ack(const jaldimac::BlockAckExtension& ack)
+    {
+        uint32_t next_seq = ack.next_seq;
+        uint32_t window_start = next_seq - window_size;
+
+        // ACKs older than the last one tell us nothing new.
+        if (! _started || int32_t(next_seq - _low) < 0)
+            return;
+
+        // Frames which slipped out of the window unacknowledged are lost.
+        if (int32_t(window_start - _low) > int32_t(capacity))
+            _low = window_start - capacity;
+
+        for ( ; int32_t(window_start - _low) > 0 ; ++_low)
+            lost(_low, next_seq);
+
+        for (unsigned i = 0 ; i < window_size ; ++i)
+        {
+            uint32_t seq = next_seq - 1 - i;
+
+            if (ack.bitmap & (uint64_t(1) << i))
+                acked(seq);
+            else
+                lost(seq, next_seq);
+        }
+
+        _low = next_seq;
+    }
+
+    // The retransmission queue. pull() returns a copy of the oldest lost
+    // frame, which stays in the buffer in case it's lost again.
+    bool empty() const              { return _head == none; }
+    uint32_t head_length() const    { return _entries[_head].p->length(); }
+    uint32_t queued_bytes() const   { return _queued_bytes; }
+
+    Packet* pull()
+    {
+        if (_head == none)
+            return NULL;
+
+        Entry& e = _entries[_head];
+        unlink(e);
+        e.mark = _next_seq;
+        ++_retransmitted;
+        return e.p->clone();
+    }
+
+    // The frames buffered, acknowledged, retransmitted and expired so far,
+    // and the frames and bytes now waiting to be retransmitted.
+    String unparse() const
+    {
+        return String(_buffered) + " " + String(_acked) + " " + String(_retransmitted)
+               + " " + String(_expired) + " " + String(_queued) + " " + String(_queued_bytes);
+    }
+
+    static const char* unparse_header()
+    {
+        return "buffered acked retransmitted expired queued queued_bytes";
+    }
+
+  private:
+    static const unsigned window_size = 64;     // Bits in a block ACK
+    static const uint16_t none = 0xFFFF;
+
+    struct Entry
+    {
+        Packet* p;
+        uint32_t seq;
+        uint32_t mark;          // First sequence number sent after this copy
+        bool queued;
+        uint16_t prev;          // In the retransmission queue
+        uint16_t next;
+    };
+
+    Entry* find(uint32_t seq)
+    {
+        Entry& e = _entries[seq % capacity];
+        return (e.p && e.seq == seq) ? &e : NULL;
+    }
+
+    void acked(uint32_t seq)
+    {
+        if (Entry* e = find(seq))
+        {
+            ++_acked;
+            release(*e);
+        }
+    }
+
+    void lost(uint32_t seq, uint32_t next_seq)
+    {
+        Entry* e = find(seq);
+
+        if (! e || e->queued || int32_t(next_seq - 1 - e->mark) < 0)
+            return;
+
+        // Append to the retransmission queue
+        uint16_t i = e - _entries;
+        e->queued = true;
+        e->prev = _tail;
+        e->next = none;
+
+        if (_tail == none)
+            _head = i;
+        else
+            _entries[_tail].next = i;
+
+        _tail = i;
+        ++_queued;
+        _queued_bytes += e->p->length();
+    }
+
+    void unlink(Entry& e)
+    {
+        if (! e.queued)
+            return;
+
+        if (e.prev == none)
+            _head = e.next;
+        else
+            _entries[e.prev].next = e.next;
+
+        if (e.next == none)
+            _tail = e.prev;
+        else
+            _entries[e.next].prev = e.prev;
+
+        e.queued = false;
+        --_queued;
+        _queued_bytes -= e.p->length();
+    }
+
+    void release(Entry& e)
+    {
+        unlink(e);
+        e.p->kill();
+        e.p = NULL;
+    }
+
+    JaldiRetransmitBuffer(const JaldiRetransmitBuffer&);
+    JaldiRetransmitBuffer& operator=(const JaldiRetransmitBuffer&);
+
+    Entry _entries[capacity];
+    uint32_t _low;              // Lowest number the next ACK may declare lost
+    uint32_t _next_seq;         // One past the highest number sent
+    bool _started;
+    uint16_t _head;
+    uint16_t _tail;
+    uint32_t _queued;
+    uint32_t _queued_bytes;
+    uint32_t _buffered;
+    uint32_t _acked;
+    uint32_t _retransmitted;
+    uint32_t _expired;
+};
+
+#endif
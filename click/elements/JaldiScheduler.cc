@@ -12,6 +12,7 @@
 
 #include "JaldiClick.hh"
 #include "JaldiQueue.hh"
+#include "JaldiDecap.hh"
 #include "Frame.hh"
 #include "JaldiScheduler.hh"
 
@@ -20,9 +21,25 @@ using namespace std;
 
 CLICK_DECLS
 
-JaldiScheduler::JaldiScheduler() : granted_voip(false),
+JaldiScheduler::JaldiScheduler() : station_count(0),
+                                   granted_voip(false),
+                                   voip_granted_flows(0),
+                                   voip_slot_bytes(0),
+                                   max_voip_flows(MAX_FLOWS_PER_VOIP_SLOT),
+                                   voip_share(50),
+                                   voip_hold_us(2000000),
+                                   next_admit_station(0),
+                                   poll_enabled(false),
+                                   poll_window_us(1000000),
                                    rate_limit_distance_us(DEFAULT_CONTENTION_SLOT_ONLY_DISTANCE__US),
-                                   timer(this)
+                                   timer(this),
+                                   arq_enabled(true),
+                                   decap(NULL),
+                                   fragment_enabled(false),
+                                   voip_slot_template(MASTER_ID, BROADCAST_ID),
+                                   transmit_slot_template(MASTER_ID, BROADCAST_ID),
+                                   delay_message_template(MASTER_ID, DRIVER_ID),
+                                   contention_slot_template(MASTER_ID, BROADCAST_ID)
 {
 }
 
@@ -33,21 +50,42 @@ JaldiScheduler::~JaldiScheduler()
 int JaldiScheduler::configure(Vector<String>& conf, ErrorHandler* errh)
 {
     bool rld_supplied = false;
+    arq_enabled = true;
+    fragment_enabled = false;
+    max_voip_flows = MAX_FLOWS_PER_VOIP_SLOT;
+    voip_share = 50;
+    voip_hold_us = 2000000;
+    poll_enabled = false;
+    poll_window_us = 1000000;
              
     // Parse configuration parameters
     if (cp_va_kparse(conf, this, errh,
              "CSONLYRATELIMIT", cpkP+cpkC, &rld_supplied, cpUnsigned, &rate_limit_distance_us,
+             "ARQ", 0, cpBool, &arq_enabled,
+             "FRAGMENT", 0, cpBool, &fragment_enabled,
+             "VOIPFLOWS", 0, cpUnsigned, &max_voip_flows,
+             "VOIPSHARE", 0, cpUnsigned, &voip_share,
+             "VOIPHOLD", 0, cpUnsigned, &voip_hold_us,
+             "POLL", 0, cpBool, &poll_enabled,
+             "POLLWINDOW", 0, cpUnsigned, &poll_window_us,
              cpEnd) < 0)
         return -1;
 
+    if (voip_share > 100)
+        return errh->error("VOIPSHARE must be a percentage");
+
+    if (max_voip_flows > MAX_FLOWS_PER_VOIP_SLOT)
+        return errh->error("VOIPFLOWS must be at most %u", MAX_FLOWS_PER_VOIP_SLOT);
+
     if (! rld_supplied)
         rate_limit_distance_us = DEFAULT_CONTENTION_SLOT_ONLY_DISTANCE__US;
 
     // We should have 1 input port for every station and 2 control inputs
-    if (ninputs() != STATION_COUNT + 2)
-        return errh->error("wrong number of input ports connected; need two control ports and a bulk port for each station");
-    else
-        return 0;
+    if (ninputs() < 3 || ninputs() > int(MAX_STATION_COUNT) + 2)
+        return errh->error("wrong number of input ports connected; need two control ports and a bulk port for each station, of which there may be up to %u", MAX_STATION_COUNT);
+
+    station_count = ninputs() - 2;
+    return 0;
 }
 
 int JaldiScheduler::initialize(ErrorHandler* errh)
@@ -55,7 +93,7 @@ int JaldiScheduler::initialize(ErrorHandler* errh)
     // Find the nearest upstream queues
     ElementCastTracker filter(router(), "JaldiQueue");
 
-    for (unsigned station = 0 ; station < STATION_COUNT ; ++station)
+    for (unsigned station = 0 ; station < station_count ; ++station)
     {
         // Get bulk queue
         filter.clear();
@@ -67,14 +105,20 @@ int JaldiScheduler::initialize(ErrorHandler* errh)
             return errh->error("bulk queue %<%s%> found on input port %<%d%> is not a valid JaldiQueue (cast failed)", filter[0]->name().c_str(), in_port_bulk_first + station);
     }
 
+    // Find the JaldiDecap whose block ACKs we send, if there is one
+    ElementCastTracker decap_filter(router(), "JaldiDecap");
+
+    if (router()->visit_upstream(this, in_port_control, &decap_filter) >= 0 && decap_filter.size() > 0)
+        decap = (JaldiDecap*) decap_filter[0]->cast("JaldiDecap");
+    else
+        decap = NULL;
+
     // Initialize requests and grants
     granted_voip = false;
-    voip_granted.duration_us = 0;
-    
-    for (unsigned flow = 0 ; flow < FLOWS_PER_VOIP_SLOT ; ++flow)
-        voip_granted.stations[flow] = BROADCAST_ID;
+    voip_granted_flows = 0;
+    voip_slot_bytes = 0;
 
-    for (unsigned station = 0 ; station < STATION_COUNT ; ++station)
+    for (unsigned station = 0 ; station < station_count ; ++station)
     {
         bulk_requested_bytes[station] = 0;
         voip_requested_flows[station] = 0;
@@ -82,14 +126,25 @@ int JaldiScheduler::initialize(ErrorHandler* errh)
         voip_granted_by_station[station] = 0;
         bulk_granted_bytes[station] = 0;
         bulk_granted_upstream_bytes[station] = 0;
+        voip_frame_bytes[station] = VOIP_MTU__BYTES;
+        voip_guard_bytes[station] = VOIP_SLOT_GUARD_SIZE__BYTES;
+        voip_admitted_flows[station] = 0;
+        voip_admitted_used_us[station] = 0;
+        voip_demoted_flows[station] = 0;
+        voip_refused_flows[station] = 0;
+        active_until_us[station] = 0;
+        poll_station[station] = false;
+        polls_sent[station] = 0;
     }
 
+    next_admit_station = 0;
+
     // Initialize rate limit.
-    gettimeofday(&rate_limit_until, NULL);
+    rate_limit_until_us = JaldiClock::now_us();
 
     // Initialize timer.
     timer.initialize(this);
-    timer.schedule_now();
+    timer.schedule_after_us(0);
 
     // Success!
     return 0;
@@ -102,12 +157,17 @@ void JaldiScheduler::take_state(Element* old, ErrorHandler*)
     if (oldJS)
     {
         granted_voip = oldJS->granted_voip;
-        voip_granted.duration_us = oldJS->voip_granted.duration_us;
+        voip_granted_flows = min(oldJS->voip_granted_flows, max_voip_flows);
+        voip_slot_bytes = 0;
 
-        for (unsigned flow = 0 ; flow < FLOWS_PER_VOIP_SLOT ; ++flow)
-            voip_granted.stations[flow] = oldJS->voip_granted.stations[flow];
+        for (unsigned flow = 0 ; flow < voip_granted_flows ; ++flow)
+        {
+            voip_granted[flow] = oldJS->voip_granted[flow];
+            voip_slot_bytes += voip_granted[flow].duration_us * BITRATE__BYTES_PER_US;
+        }
 
-        for (unsigned station = 0 ; station < STATION_COUNT ; ++station)
+        // Stations added since start out idle; those removed are forgotten
+        for (unsigned station = 0 ; station < min(station_count, oldJS->station_count) ; ++station)
         {
             bulk_requested_bytes[station] = oldJS->bulk_requested_bytes[station];
             voip_requested_flows[station] = oldJS->voip_requested_flows[station];
@@ -115,9 +175,19 @@ void JaldiScheduler::take_state(Element* old, ErrorHandler*)
             voip_granted_by_station[station] = oldJS->voip_granted_by_station[station];
             bulk_granted_bytes[station] = oldJS->bulk_granted_bytes[station];
             bulk_granted_upstream_bytes[station] = oldJS->bulk_granted_upstream_bytes[station];
+            voip_frame_bytes[station] = oldJS->voip_frame_bytes[station];
+            voip_guard_bytes[station] = oldJS->voip_guard_bytes[station];
+            voip_admitted_flows[station] = oldJS->voip_admitted_flows[station];
+            voip_admitted_used_us[station] = oldJS->voip_admitted_used_us[station];
+            voip_demoted_flows[station] = oldJS->voip_demoted_flows[station];
+            voip_refused_flows[station] = oldJS->voip_refused_flows[station];
+            active_until_us[station] = oldJS->active_until_us[station];
+            polls_sent[station] = oldJS->polls_sent[station];
         }
 
-        rate_limit_until = oldJS->rate_limit_until;
+        next_admit_station = oldJS->next_admit_station % station_count;
+
+        rate_limit_until_us = oldJS->rate_limit_until_us;
     }
 }
 
@@ -131,59 +201,61 @@ void JaldiScheduler::push(int, Packet* p)
 {
     // We've received some kind of control traffic; take action based on the
     // specific type and parameters.
-    const Frame* f = (const Frame*) p->data();
+    dispatch_frame<void>(*this, p, (const Frame*) p->data(), p->length());
+}
+
+void JaldiScheduler::visit(Packet* p, const Frame* f, const RequestFramePayload& rfp)
+{
+    uint8_t station_idx = f->src_id - FIRST_STATION_ID;
 
-    if (! (f->dest_id == BROADCAST_ID || f->dest_id == MASTER_ID))
+    if (! for_us(f) || f->src_id < FIRST_STATION_ID || station_idx >= station_count)
     {
-        // Not for us! Dump it out the optional output port
+        // Not for us, or from an invalid station! Dump it out the optional
+        // output port
         checked_output_push(out_port_bad, p);
         return;
     }
 
-    switch (f->type)
+    // The station acknowledges our bulk frames, and reports on its VoIP
+    // traffic, in extensions
+    if (f->ext_words)
     {
-        case REQUEST_FRAME:
-        {
-            uint8_t station_idx = f->src_id - FIRST_STATION_ID;
-
-            if (f->src_id < FIRST_STATION_ID || station_idx >= STATION_COUNT)
-            {
-                // Invalid station! dump it out the optional output port
-                checked_output_push(out_port_bad, p);
-                return;
-            }
-
-            // Update requests
-            const RequestFramePayload* rfp = (const RequestFramePayload*) f->payload;
+        process_block_acks(station_idx, f);
+        process_voip_report(station_idx, f);
+    }
 
-            bulk_requested_bytes[station_idx] += rfp->bulk_request_bytes;
-            voip_requested_flows[station_idx] += rfp->voip_request_flows;
+    // Update requests
+    bulk_requested_bytes[station_idx] += rfp.bulk_request_bytes;
+    voip_requested_flows[station_idx] += rfp.voip_request_flows;
 
-            p->kill();
+    // A station asking for capacity is polled for a while after
+    if (rfp.bulk_request_bytes > 0 || rfp.voip_request_flows > 0)
+        active_until_us[station_idx] = JaldiClock::now_us() + poll_window_us;
 
-            break;
-        }
+    p->kill();
+}
 
-        case ROUND_COMPLETE_MESSAGE:
-        {
-            // All requests have been received, and all upstream traffic eligible
-            // for distribution this round is in the queues. It's time to compute
-            // the layout for the next round.
+void JaldiScheduler::visit(Packet* p, const Frame* f, const RoundCompleteMessagePayload&)
+{
+    if (! for_us(f))
+    {
+        checked_output_push(out_port_bad, p);
+        return;
+    }
 
-            p->kill();
+    // All requests have been received, and all upstream traffic eligible
+    // for distribution this round is in the queues. It's time to compute
+    // the layout for the next round.
 
-            received_round_complete_message();
+    p->kill();
 
-            break;
-        }
+    received_round_complete_message();
+}
 
-        default:
-        {
-            // Bad stuff; dump it out the optional output
-            checked_output_push(out_port_bad, p);
-            break;
-        }
-    }
+void JaldiScheduler::visit_bad(Packet* p, const Frame*)
+{
+    // Bad stuff, or nothing we act on; dump it out the optional output
+    checked_output_push(out_port_bad, p);
 }
 
 void JaldiScheduler::received_round_complete_message()
@@ -194,37 +266,26 @@ void JaldiScheduler::received_round_complete_message()
     // Rate limit contention-slot-only rounds.
     if (! have_data_or_requests())
     {
-        timeval now;
-        gettimeofday(&now, NULL);
+        uint64_t now_us = JaldiClock::now_us();
 
-        if (now.tv_sec < rate_limit_until.tv_sec || (now.tv_sec == rate_limit_until.tv_sec && now.tv_usec < rate_limit_until.tv_usec))
+        if (now_us < rate_limit_until_us)
         {
             // Don't create round; just reschedule timer.
-            timer.reschedule_after_msec(1);
+            timer.schedule_after_us(1000);
             return;
         }
         else
         {
             // OK to create round, but first, determine time at which
             // it's ok to send the _next_ contention-slot-only round.
-            gettimeofday(&rate_limit_until, NULL);
-
-            // Advance.
-            rate_limit_until.tv_usec += rate_limit_distance_us;
-
-            // Normalize.
-            while (rate_limit_until.tv_usec > 1000000)
-            {
-                ++rate_limit_until.tv_sec;
-                rate_limit_until.tv_usec -= 1000000;
-            }
+            rate_limit_until_us = now_us + rate_limit_distance_us;
 
             // Go ahead and create round...
         }
     }
 
     /*
-    for (unsigned station = 0 ; station < STATION_COUNT ; ++station)
+    for (unsigned station = 0 ; station < station_count ; ++station)
     {
         click_chatter("Station: %u BRB: %u VRF: %u BUB: %u",
         station, bulk_requested_bytes[station],
@@ -238,7 +299,7 @@ void JaldiScheduler::received_round_complete_message()
     compute_fair_allocation();
 
     /*
-    for (unsigned station = 0 ; station < STATION_COUNT ; ++station)
+    for (unsigned station = 0 ; station < station_count ; ++station)
     {
         click_chatter("Station: %u VG: %u BGB: %u BGUB: %u",
         station, unsigned(voip_granted_by_station[station]),
@@ -247,12 +308,12 @@ void JaldiScheduler::received_round_complete_message()
     }
 
     click_chatter("Granted_voip: %s", granted_voip ? "true" : "false");
-    click_chatter("voip_granted.duration_us: %u", voip_granted.duration_us);
+    click_chatter("voip_granted_flows: %u", voip_granted_flows);
 
-    for (unsigned flow = 0 ; flow < FLOWS_PER_VOIP_SLOT ; ++flow)
+    for (unsigned flow = 0 ; flow < voip_granted_flows ; ++flow)
     {
-        click_chatter("Flow %u: station %u", flow,
-        unsigned(voip_granted.stations[flow]));
+        click_chatter("Flow %u: station %u duration %u", flow,
+        unsigned(voip_granted[flow].station), unsigned(voip_granted[flow].duration_us));
     }
     */
 
@@ -260,13 +321,13 @@ void JaldiScheduler::received_round_complete_message()
     generate_layout();
 
     // Reset VoIP requests; they must be re-requested every round.
-    for (unsigned station = 0 ; station < STATION_COUNT ; ++station)
+    for (unsigned station = 0 ; station < station_count ; ++station)
         voip_requested_flows[station] = 0;
 }
 
 bool JaldiScheduler::have_data_or_requests()
 {
-    for (unsigned station = 0 ; station < STATION_COUNT ; ++station)
+    for (unsigned station = 0 ; station < station_count ; ++station)
     {
         if (bulk_requested_bytes[station] > 0 || voip_requested_flows[station] > 0 || bulk_upstream_bytes[station] > 0)
             return true;
@@ -277,10 +338,218 @@ bool JaldiScheduler::have_data_or_requests()
 
 void JaldiScheduler::count_upstream()
 {
-    // Look in each queue and record their total size in bytes.
-    // FIXME: This will need to be changed once we add bulk ACKs.
-    for (unsigned station = 0 ; station < STATION_COUNT ; ++station)
-        bulk_upstream_bytes[station] = bulk_queues[station]->total_length();
+    // Look in each queue and record their total size in bytes, along with
+    // the frames waiting to be retransmitted.
+    for (unsigned station = 0 ; station < station_count ; ++station)
+        bulk_upstream_bytes[station] = bulk_queues[station]->total_length()
+                                       + retransmit[station].queued_bytes()
+                                       + partial[station].remaining_length();
+}
+
+void JaldiScheduler::process_block_acks(unsigned station, const Frame* f)
+{
+    for (FrameExtensionIterator it(f) ; it.valid() ; it.next())
+    {
+        if (it->type != EXT_BLOCK_ACK || it->length < sizeof(BlockAckExtension))
+            continue;
+
+        BlockAckExtension ack;
+        memcpy(&ack, it->value, sizeof(ack));
+
+        if (ack.peer_id == MASTER_ID)
+            retransmit[station].ack(ack);
+    }
+}
+
+void JaldiScheduler::process_voip_report(unsigned station, const Frame* f)
+{
+    const FrameExtension* ext = find_extension(f, EXT_VOIP_REPORT);
+
+    if (! ext || ext->length < sizeof(VoIPReportExtension))
+        return;
+
+    VoIPReportExtension report;
+    memcpy(&report, ext->value, sizeof(report));
+
+    voip_frame_bytes[station] = min(uint32_t(report.frame_bytes), uint32_t(VOIP_MTU__BYTES + Frame::empty_frame_size));
+
+    voip_guard_bytes[station] = jaldimac::voip_guard_bytes(report.latency_us);
+}
+
+// The longest request a station sends: a REQUEST_FRAME with a block ACK and
+// a VoIP report.
+static inline uint32_t max_request_bytes()
+{
+    return REQUEST_FRAME_SIZE__BYTES
+           + (extension_size(sizeof(BlockAckExtension)) + extension_size(sizeof(VoIPReportExtension)) + 3) / 4 * 4;
+}
+
+// The bytes a place in the VoIP slot takes for a flow from STATION; the
+// station's FIRST place in a slot also has room for its request, with a block
+// ACK and a VoIP report.
+uint32_t JaldiScheduler::voip_flow_bytes(unsigned station, bool first) const
+{
+    uint32_t bytes = voip_frame_bytes[station] + voip_guard_bytes[station];
+
+    if (first)
+        bytes += max_request_bytes();
+
+    return bytes;
+}
+
+// A poll slot has room for one request, and the same guard as the station's
+// places in the VoIP slot.
+uint32_t JaldiScheduler::poll_bytes(unsigned station) const
+{
+    return max_request_bytes() + voip_guard_bytes[station];
+}
+
+// The bytes a VoIP slot takes for the flows admitted.
+uint32_t JaldiScheduler::voip_committed_bytes() const
+{
+    uint32_t bytes = 0;
+
+    for (unsigned station = 0 ; station < station_count ; ++station)
+    {
+        if (voip_admitted_flows[station] > 0)
+            bytes += voip_flow_bytes(station, true) + (voip_admitted_flows[station] - 1) * voip_flow_bytes(station, false);
+    }
+
+    return bytes;
+}
+
+void JaldiScheduler::admit_voip_flows()
+{
+    uint64_t now_us = JaldiClock::now_us();
+
+    // Stations keep the flows they were admitted while they ask for them,
+    // and through silences of up to VOIPHOLD, so that a call isn't turned
+    // away between talk spurts; then they give back the ones they don't ask
+    // for.
+    for (unsigned station = 0 ; station < station_count ; ++station)
+    {
+        if (voip_requested_flows[station] >= voip_admitted_flows[station])
+            voip_admitted_used_us[station] = now_us;
+        else if (now_us - voip_admitted_used_us[station] > voip_hold_us)
+        {
+            voip_admitted_flows[station] = voip_requested_flows[station];
+            voip_admitted_used_us[station] = now_us;
+        }
+    }
+
+    // Admit new flows, one per station at a time, for as long as the VoIP
+    // slot they commit us to stays within VOIPSHARE of the time between
+    // slots. Who goes first rotates from round to round.
+    uint32_t budget_bytes = voip_budget_bytes();
+    uint32_t committed_bytes = voip_committed_bytes();
+    bool admitted;
+
+    do
+    {
+        admitted = false;
+
+        for (unsigned i = 0 ; i < station_count ; ++i)
+        {
+            unsigned station = (next_admit_station + i) % station_count;
+
+            if (voip_requested_flows[station] <= voip_admitted_flows[station])
+                continue;
+
+            uint32_t flow_bytes = voip_flow_bytes(station, voip_admitted_flows[station] == 0);
+
+            if (committed_bytes + flow_bytes > budget_bytes)
+                continue;
+
+            ++voip_admitted_flows[station];
+            committed_bytes += flow_bytes;
+            admitted = true;
+        }
+    } while (admitted);
+
+    next_admit_station = (next_admit_station + 1) % station_count;
+
+    // The rest are demoted to bulk: they get no place in the VoIP slot, so
+    // the station sends them in its TRANSMIT_SLOT.
+    for (unsigned station = 0 ; station < station_count ; ++station)
+    {
+        voip_demoted_flows[station] = (voip_requested_flows[station] > voip_admitted_flows[station]
+                                       ? voip_requested_flows[station] - voip_admitted_flows[station] : 0);
+        voip_refused_flows[station] += voip_demoted_flows[station];
+    }
+}
+
+WritablePacket* JaldiScheduler::add_block_acks(WritablePacket* p)
+{
+    if (! decap)
+        return p;
+
+    for (unsigned station = 0 ; station < station_count && p ; ++station)
+    {
+        BlockAckExtension ack;
+        uint8_t* value;
+
+        if (! decap->take_block_ack(FIRST_STATION_ID + station, ack))
+            continue;
+
+        if ((p = jaldi_add_extension(p, EXT_BLOCK_ACK, sizeof(ack), value)) && value)
+            memcpy(value, &ack, sizeof(ack));
+    }
+
+    return p;
+}
+
+// Upstream frames for a station: the rest of a frame cut off by a deadline,
+// then retransmissions, then new frames from its queue, of which we keep a
+// copy until they're acknowledged.
+
+bool JaldiScheduler::upstream_empty(unsigned station) const
+{
+    return ! partial[station].active() && retransmit[station].empty() && bulk_queues[station]->empty();
+}
+
+uint32_t JaldiScheduler::upstream_head_length(unsigned station) const
+{
+    if (partial[station].active())
+        return partial[station].remaining_length();
+    else if (! retransmit[station].empty())
+        return retransmit[station].head_length();
+    else
+        return bulk_queues[station]->head_length();
+}
+
+Packet* JaldiScheduler::pull_upstream(unsigned station)
+{
+    if (partial[station].active())
+        return partial[station].next(partial[station].remaining_length());
+
+    if (! retransmit[station].empty())
+        return retransmit[station].pull();
+
+    Packet* p = input(in_port_bulk_first + station).pull();
+
+    if (p && arq_enabled && ((const Frame*) p->data())->type == BULK_FRAME)
+        retransmit[station].sent(p);
+
+    return p;
+}
+
+Packet* JaldiScheduler::pull_fragment(unsigned station, uint32_t max_bytes)
+{
+    // Start on the next frame if there isn't one in progress
+    if (! partial[station].active())
+    {
+        if (max_bytes < JaldiPartialFrame::overhead + JaldiPartialFrame::min_data)
+            return NULL;
+
+        Packet* p = pull_upstream(station);
+
+        if (! p)
+            return NULL;
+
+        partial[station].start(p);
+    }
+
+    return partial[station].next(max_bytes);
 }
 
 bool JaldiScheduler::try_to_allocate_voip_request(unsigned flow, unsigned& next_request_station)
@@ -288,27 +557,31 @@ bool JaldiScheduler::try_to_allocate_voip_request(unsigned flow, unsigned& next_
     unsigned request_station = next_request_station;
     do
     {
-        if (voip_requested_flows[request_station] > 0)
+        if (voip_requested_flows[request_station] > 0
+            && voip_granted_by_station[request_station] < voip_admitted_flows[request_station])
         {
+            uint32_t flow_bytes = voip_flow_bytes(request_station, voip_granted_by_station[request_station] == 0);
+
+            // Stop once the slot is full, should the station's reports have
+            // grown its flows since they were admitted
+            if (voip_slot_bytes + flow_bytes > voip_budget_bytes())
+                return false;
+
             voip_requested_flows[request_station] -= 1;
-            voip_granted.stations[flow] = FIRST_STATION_ID + request_station;
+            voip_granted[flow].station = FIRST_STATION_ID + request_station;
+            voip_granted[flow].duration_us = flow_bytes / BITRATE__BYTES_PER_US + 1;
+            voip_slot_bytes += flow_bytes;
             voip_granted_by_station[request_station] += 1;
-            next_request_station = (request_station + 1) % STATION_COUNT;
+            next_request_station = (request_station + 1) % station_count;
             return true;
         }
         else
-            request_station = (request_station + 1) % STATION_COUNT;
+            request_station = (request_station + 1) % station_count;
     } while (request_station != next_request_station);
 
     return false;
 }
 
-void JaldiScheduler::allocate_voip_to_no_one(unsigned flow)
-{
-    for (unsigned flow_ = flow; flow_ < FLOWS_PER_VOIP_SLOT ; ++flow_)
-        voip_granted.stations[flow_] = BROADCAST_ID;
-}
-
 void JaldiScheduler::compute_fair_allocation()
 {
     // We now have all upstream and downstream requests; now we need to
@@ -317,29 +590,29 @@ void JaldiScheduler::compute_fair_allocation()
     // round size) and is in some sense "fair".
 
     // Initialization.
-    for (unsigned station = 0 ; station < STATION_COUNT ; ++station)
+    for (unsigned station = 0 ; station < station_count ; ++station)
         voip_granted_by_station[station] = 0;
 
     // First, we take care of VoIP. We only need to schedule upstream VoIP
     // streams here; downstream VoIP streams will be handled dynamically.
+    // Only admitted flows get places.
+    admit_voip_flows();
+
+    // The VoIP slot is made just wide enough for the flows granted.
     unsigned next_request_station = 0;
-    granted_voip = false;
-    for (unsigned flow = 0 ; flow < FLOWS_PER_VOIP_SLOT ; ++flow)
-    {
-        if (try_to_allocate_voip_request(flow, next_request_station))
-            granted_voip = true;
-        else
-        {
-            allocate_voip_to_no_one(flow);
-            break;
-        }
-    }
+    voip_granted_flows = 0;
+    voip_slot_bytes = 0;
+    while (voip_granted_flows < max_voip_flows
+           && try_to_allocate_voip_request(voip_granted_flows, next_request_station))
+        ++voip_granted_flows;
+
+    granted_voip = voip_granted_flows > 0;
 
     // Now, handle bulk using max-min fairness.
 
     // Grant every request / upstream flow the minimum chunk size.
     uint32_t round_size = 0;
-    for (unsigned station = 0 ; station < STATION_COUNT ; ++station)
+    for (unsigned station = 0 ; station < station_count ; ++station)
     {
         if (bulk_requested_bytes[station] > 0)
         {
@@ -362,6 +635,19 @@ void JaldiScheduler::compute_fair_allocation()
         }
     }
 
+    // Poll the stations which have asked for capacity lately but won't have
+    // a TRANSMIT_SLOT or a place in the VoIP slot to ask in, so that they
+    // needn't contend for the contention slot.
+    uint64_t now_us = JaldiClock::now_us();
+    for (unsigned station = 0 ; station < station_count ; ++station)
+    {
+        poll_station[station] = poll_enabled && now_us < active_until_us[station]
+                                && bulk_granted_bytes[station] == 0 && voip_granted_by_station[station] == 0;
+
+        if (poll_station[station])
+            round_size += poll_bytes(station);
+    }
+
     // Now keep granting requests until we're out of them or we fill up the round.
     uint32_t next_voip_slot_bytes = MAX_ROUND_SIZE__BYTES;
 
@@ -370,17 +656,17 @@ void JaldiScheduler::compute_fair_allocation()
     // round size every time we would reach a VoIP slot in the schedule.
     if (granted_voip)
     {
-        round_size += VOIP_SLOT_SIZE__BYTES;
+        round_size += voip_slot_bytes;
         next_voip_slot_bytes = INTER_VOIP_SLOT_DISTANCE__BYTES;
     }
 
-    unsigned active_stations_and_directions = 2 * STATION_COUNT;
+    unsigned active_stations_and_directions = 2 * station_count;
     while (round_size < MAX_ROUND_SIZE__BYTES && active_stations_and_directions > 0)
     {
         // If we need a VoIP slot here, account for it in the round size.
         if (round_size >= next_voip_slot_bytes)
         {
-            round_size += VOIP_SLOT_SIZE__BYTES;
+            round_size += voip_slot_bytes;
             next_voip_slot_bytes += INTER_VOIP_SLOT_DISTANCE__BYTES;
 
             if (round_size >= MAX_ROUND_SIZE__BYTES)
@@ -397,7 +683,7 @@ void JaldiScheduler::compute_fair_allocation()
 
         // Grant what we can at this point to each station.
         active_stations_and_directions = 0;
-        for (unsigned station = 0 ; station < STATION_COUNT ; ++station)
+        for (unsigned station = 0 ; station < station_count ; ++station)
         {
             if (bulk_requested_bytes[station] > 0)
             {
@@ -458,15 +744,23 @@ void JaldiScheduler::generate_layout()
         // Are we at a deadline?
         if (round_pos_bytes >= next_deadline_bytes)
         {
-            // Emit a VoIP slot.
+            // Emit a VoIP slot, listing the place of each flow.
             VoIPSlotPayload* vsp;
-            WritablePacket* vp = make_jaldi_frame<VOIP_SLOT, BROADCAST_ID>(MASTER_ID, vsp);
-            memcpy(vsp, &voip_granted, sizeof(VoIPSlotPayload));
-            output(out_port).push(vp);
+
+            if (WritablePacket* vp = voip_slot_template.make(vsp, voip_granted_flows * sizeof(VoIPSlotFlow)))
+            {
+                vsp->duration_us = 0;
+
+                for (unsigned flow = 0 ; flow < voip_granted_flows ; ++flow)
+                    vsp->duration_us += voip_granted[flow].duration_us;
+
+                memcpy(vsp->flows, voip_granted, voip_granted_flows * sizeof(VoIPSlotFlow));
+                output(out_port).push(vp);
+            }
 
             // Update state.
             next_deadline_bytes += INTER_VOIP_SLOT_DISTANCE__BYTES;
-            round_pos_bytes += VOIP_SLOT_SIZE__BYTES;
+            round_pos_bytes += voip_slot_bytes;
             last_was_request = true;
 
             goto top;
@@ -475,13 +769,13 @@ void JaldiScheduler::generate_layout()
         uint32_t to_deadline_bytes = next_deadline_bytes - round_pos_bytes;
 
         // Are there any requests that can be fulfilled before the next deadline?
-        for (unsigned station = 0 ; station < STATION_COUNT ; ++station)
+        for (unsigned station = 0 ; station < station_count ; ++station)
         {
             if ((! last_was_request) && to_deadline_bytes >= MIN_CHUNK_SIZE__BYTES && bulk_granted_bytes[station] <= to_deadline_bytes && bulk_granted_bytes[station] > 0)
             {
                 // Emit a TRANSMIT_SLOT.
                 TransmitSlotPayload* tsp;
-                WritablePacket* tp = make_jaldi_frame_dyn_dest<TRANSMIT_SLOT>(MASTER_ID, FIRST_STATION_ID + station, tsp);
+                WritablePacket* tp = transmit_slot_template.make(FIRST_STATION_ID + station, tsp);
                 tsp->duration_us = max(MIN_CHUNK_SIZE__BYTES, bulk_granted_bytes[station]) / BITRATE__BYTES_PER_US + 1;
                 tsp->voip_granted_flows = voip_granted_by_station[station];
                 output(out_port).push(tp);
@@ -496,13 +790,13 @@ void JaldiScheduler::generate_layout()
         }
 
         // Are there any upstream transfers that can be fulfilled before the deadline?
-        for (unsigned station = 0 ; station < STATION_COUNT ; ++station)
+        for (unsigned station = 0 ; station < station_count ; ++station)
         {
             if (bulk_granted_upstream_bytes[station] <= to_deadline_bytes && bulk_granted_upstream_bytes[station] > 0)
             {
                 do
                 {
-                    if (bulk_queues[station]->empty())
+                    if (upstream_empty(station))
                     {
                         // If the queue's empty, we're done. (Bug?)
                         bulk_granted_upstream_bytes[station] = 0;
@@ -510,11 +804,11 @@ void JaldiScheduler::generate_layout()
                     }
 
                     uint32_t len_bytes = 0;
-                    if ((len_bytes = bulk_queues[station]->head_length()) <= bulk_granted_upstream_bytes[station])
+                    if ((len_bytes = upstream_head_length(station)) <= bulk_granted_upstream_bytes[station])
                     {
                         // Send.
-                        Packet* p = input(in_port_bulk_first + station).pull();
-                        output(out_port).push(p);
+                        if (Packet* p = pull_upstream(station))
+                            output(out_port).push(p);
 
                         // Update state.
                         round_pos_bytes += len_bytes;
@@ -522,6 +816,17 @@ void JaldiScheduler::generate_layout()
                     }
                     else
                     {
+                        // Fill the rest of the grant with a fragment of
+                        // the frame, if we can.
+                        if (fragment_enabled)
+                        {
+                            if (Packet* p = pull_fragment(station, bulk_granted_upstream_bytes[station]))
+                            {
+                                round_pos_bytes += p->length();
+                                output(out_port).push(p);
+                            }
+                        }
+
                         bulk_granted_upstream_bytes[station] = 0;
                         break;
                     }
@@ -534,13 +839,13 @@ void JaldiScheduler::generate_layout()
         }
 
         // Are there any requests that can be partially fulfilled?
-        for (unsigned station = 0 ; station < STATION_COUNT ; ++station)
+        for (unsigned station = 0 ; station < station_count ; ++station)
         {
             if ((! last_was_request) && to_deadline_bytes >= MIN_CHUNK_SIZE__BYTES && bulk_granted_bytes[station] > to_deadline_bytes)
             {
                 // Emit a TRANSMIT_SLOT.
                 TransmitSlotPayload* tsp;
-                WritablePacket* tp = make_jaldi_frame_dyn_dest<TRANSMIT_SLOT>(MASTER_ID, FIRST_STATION_ID + station, tsp);
+                WritablePacket* tp = transmit_slot_template.make(FIRST_STATION_ID + station, tsp);
                 tsp->duration_us = to_deadline_bytes / BITRATE__BYTES_PER_US + 1;
                 tsp->voip_granted_flows = voip_granted_by_station[station];
                 output(out_port).push(tp);
@@ -555,13 +860,15 @@ void JaldiScheduler::generate_layout()
         }
 
         // Are there any upstream transfers that can be partially fulfilled?
-        for (unsigned station = 0 ; station < STATION_COUNT ; ++station)
+        for (unsigned station = 0 ; station < station_count ; ++station)
         {
             if (bulk_granted_upstream_bytes[station] > to_deadline_bytes)
             {
+                bool sent = false;
+
                 do
                 {
-                    if (bulk_queues[station]->empty())
+                    if (upstream_empty(station))
                     {
                         // If the queue's empty, we're done. (Bug?)
                         bulk_granted_upstream_bytes[station] = 0;
@@ -569,20 +876,41 @@ void JaldiScheduler::generate_layout()
                     }
 
                     uint32_t len_bytes = 0;
-                    if ((len_bytes = bulk_queues[station]->head_length()) <= (next_deadline_bytes - round_pos_bytes))
+                    if ((len_bytes = upstream_head_length(station)) <= (next_deadline_bytes - round_pos_bytes))
                     {
                         // Send.
-                        Packet* p = input(in_port_bulk_first + station).pull();
-                        output(out_port).push(p);
+                        if (Packet* p = pull_upstream(station))
+                            output(out_port).push(p);
 
                         // Update state.
                         round_pos_bytes += len_bytes;
                         bulk_granted_upstream_bytes[station] -= len_bytes;
+                        sent = true;
                     }
                     else
+                    {
+                        // Fill up to the deadline with a fragment of the
+                        // frame, if we can.
+                        uint32_t space_bytes = min(bulk_granted_upstream_bytes[station], next_deadline_bytes - round_pos_bytes);
+                        Packet* p;
+
+                        if (fragment_enabled && (p = pull_fragment(station, space_bytes)))
+                        {
+                            round_pos_bytes += p->length();
+                            bulk_granted_upstream_bytes[station] -= min(bulk_granted_upstream_bytes[station], p->length());
+                            output(out_port).push(p);
+                            sent = true;
+                        }
+
                         break;
+                    }
                 } while (true);
 
+                // If nothing fit, coming back here would loop forever;
+                // let the delay below take us to the deadline instead.
+                if (! sent)
+                    continue;
+
                 last_was_request = false;
 
                 goto top;
@@ -593,7 +921,7 @@ void JaldiScheduler::generate_layout()
         // We're either done, or there's nothing that can fit before the
         // next deadline, and we just need to insert a delay.
         done = true;
-        for (unsigned station = 0 ; station < STATION_COUNT ; ++station)
+        for (unsigned station = 0 ; station < station_count ; ++station)
         {
             if (bulk_granted_bytes[station] > 0 || bulk_granted_upstream_bytes[station] > 0)
             {
@@ -606,7 +934,7 @@ void JaldiScheduler::generate_layout()
         {
             // Insert an appropriate delay.
             DelayMessagePayload* dmp;
-            WritablePacket* dp = make_jaldi_frame<DELAY_MESSAGE, DRIVER_ID>(MASTER_ID, dmp);
+            WritablePacket* dp = delay_message_template.make(dmp);
             dmp->duration_us = to_deadline_bytes / BITRATE__BYTES_PER_US + 1;
             output(out_port).push(dp);
 
@@ -618,12 +946,93 @@ void JaldiScheduler::generate_layout()
         }
     }
 
+    // Poll the stations that need it, with TRANSMIT_SLOTs only long enough
+    // for a request.
+    for (unsigned station = 0 ; station < station_count ; ++station)
+    {
+        if (! poll_station[station])
+            continue;
+
+        TransmitSlotPayload* tsp;
+        WritablePacket* tp = transmit_slot_template.make(FIRST_STATION_ID + station, tsp);
+        tsp->duration_us = poll_bytes(station) / BITRATE__BYTES_PER_US + 1;
+        tsp->voip_granted_flows = 0;
+        output(out_port).push(tp);
+
+        poll_station[station] = false;
+        ++polls_sent[station];
+    }
+
     // We've generated the entire layout. Now we complete the round by
-    // emitting a contention slot, and we're done!
+    // emitting a contention slot, which carries our block ACKs, and we're
+    // done!
     ContentionSlotPayload* csp;
-    WritablePacket* cp = make_jaldi_frame<CONTENTION_SLOT, BROADCAST_ID>(MASTER_ID, csp);
+    WritablePacket* cp = contention_slot_template.make(csp);
     csp->duration_us = CONTENTION_SLOT_DURATION__US;
-    output(out_port).push(cp);
+
+    if ((cp = add_block_acks(cp)))
+        output(out_port).push(cp);
+}
+
+String JaldiScheduler::read_handler(Element* e, void* thunk)
+{
+    JaldiScheduler* js = static_cast<JaldiScheduler*>(e);
+
+    switch (reinterpret_cast<intptr_t>(thunk))
+    {
+        case 0:
+        {
+            String s = String("station ") + JaldiRetransmitBuffer::unparse_header() + "\n";
+
+            for (unsigned station = 0 ; station < js->station_count ; ++station)
+                s += String(FIRST_STATION_ID + station) + " " + js->retransmit[station].unparse() + "\n";
+
+            return s;
+        }
+        case 1:
+        {
+            String s = String(js->voip_granted_flows) + " " + String(js->max_voip_flows) + " "
+                       + String(js->voip_slot_bytes / BITRATE__BYTES_PER_US) + "\nstation frame_bytes guard_bytes\n";
+
+            for (unsigned station = 0 ; station < js->station_count ; ++station)
+                s += String(FIRST_STATION_ID + station) + " " + String(js->voip_frame_bytes[station])
+                     + " " + String(js->voip_guard_bytes[station]) + "\n";
+
+            return s;
+        }
+        case 2:
+        {
+            String s = String(js->voip_committed_bytes()) + " " + String(js->voip_budget_bytes())
+                       + "\nstation admitted demoted refused\n";
+
+            for (unsigned station = 0 ; station < js->station_count ; ++station)
+                s += String(FIRST_STATION_ID + station) + " " + String(js->voip_admitted_flows[station])
+                     + " " + String(js->voip_demoted_flows[station]) + " " + String(js->voip_refused_flows[station]) + "\n";
+
+            return s;
+        }
+        case 3:
+        {
+            String s = "station active polls\n";
+            uint64_t now_us = JaldiClock::now_us();
+
+            for (unsigned station = 0 ; station < js->station_count ; ++station)
+                s += String(FIRST_STATION_ID + station) + " " + String(now_us < js->active_until_us[station] ? 1 : 0)
+                     + " " + String(js->polls_sent[station]) + "\n";
+
+            return s;
+        }
+        default:
+            return "";
+    }
+}
+
+void JaldiScheduler::add_handlers()
+{
+    add_read_handler("arq", read_handler, (void*) 0);
+    add_read_handler("voip", read_handler, (void*) 1);
+    add_read_handler("admission", read_handler, (void*) 2);
+    add_read_handler("polls", read_handler, (void*) 3);
 }
 
 CLICK_ENDDECLS
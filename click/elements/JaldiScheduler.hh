@@ -2,12 +2,16 @@
 #define CLICK_JALDISCHEDULER_HH
 #include <click/element.hh>
 #include "Frame.hh"
+#include "JaldiClick.hh"
+#include "JaldiClock.hh"
+#include "JaldiFragment.hh"
+#include "JaldiRetransmitBuffer.hh"
 CLICK_DECLS
 
 /*
 =c
 
-JaldiScheduler(CSONLYRATELIMIT)
+JaldiScheduler(CSONLYRATELIMIT [, I<keywords> ARQ, FRAGMENT, VOIPFLOWS, VOIPSHARE, VOIPHOLD, POLL, POLLWINDOW])
 
 =s jaldi
 
@@ -20,9 +24,9 @@ sequence of Jaldi frames that direct the driver, which actually implements the
 requested behavior) from incoming packets from the Internet and incoming
 requests from stations.
 
-In a complete JaldiMAC implementation, JaldiScheduler would have a STATIONS
-parameter indicating the number of stations it must serve, and it would
-calculate port numbers dynamically from that. For now, STATIONS is hardcoded.
+JaldiScheduler serves one station for each bulk input connected, up to 64
+stations (STATIONS below). The station on input 2 has the first station ID (2),
+the station on input 3 the next, and so on.
 
 Input 0 (push) is for control Jaldi frames, coming from either stations (e.g.
 REQUEST_FRAME) or from the driver. (e.g. ROUND_COMPLETE_MESSAGE) Input 1 (push)
@@ -40,13 +44,119 @@ frames.
 The CSONLYRATELIMIT parameter, if specified, indicates the minimum time between
 contention-slot-only rounds in microseconds. (i.e., rounds which contain
 neither data from upstream nor requests from the stations) If this parameter is
-not specified, a reasonable default is chosen.
+not specified, a reasonable default is chosen. The limit is measured on the
+JaldiClock, so it also holds in virtual time.
+
+Bulk frames to the stations are protected by selective retransmission, as
+described for JaldiGate. JaldiScheduler keeps a copy of each bulk frame it
+sends until the station acknowledges it, in a block ACK attached to a
+REQUEST_FRAME. Frames reported missing are counted with the station's
+upstream bytes when grants are computed, and sent ahead of new data. If a
+JaldiDecap is found upstream of input 0, each CONTENTION_SLOT carries a block
+ACK for every station which has sent bulk frames since its last one.
+
+Upstream VoIP flows are given places in a VoIP slot, which recurs every 40 ms
+through the round, round-robin among the stations that request them. The
+number of places is picked each round from the flows requested, up to
+VOIPFLOWS, and the VOIP_SLOT frame lists a station and a length for each, so
+the slot only takes the time the flows granted need. Each place is long enough for the largest
+VoIP frame the station has reported sending, plus a request in its first
+place, plus a guard of twice the latency the station reported for frames
+from the master and the time to switch the radio between receiving and
+transmitting. Stations which haven't reported get room for a frame of the
+VoIP MTU and a guard of two bulk frames.
+
+Only flows which have been admitted get places. A station's new flow is
+admitted if the VoIP slot for all the flows admitted, this one included,
+would take no more than VOIPSHARE of the time between VoIP slots; otherwise
+it is demoted to bulk, and asks again the next round. New flows are admitted
+round-robin among the stations. A station keeps the flows it was admitted
+while it asks for them, and through silences of up to VOIPHOLD, after which
+it gives back those it no longer asks for. Flows that don't get a place are
+sent in their station's TRANSMIT_SLOT.
+
+Stations normally ask for capacity in their TRANSMIT_SLOT or VoIP slot
+places, or else by contending for the CONTENTION_SLOT at the end of the round.
+If polling is on, a station which has asked for capacity in the last
+POLLWINDOW, but has no TRANSMIT_SLOT or VoIP place this round, is instead
+polled: it gets a TRANSMIT_SLOT just long enough for one request, after the
+rest of the layout. The contention slot is then left to stations waking up
+from idle, and stations under load get to ask at a known time every round.
+
+If fragmentation is on, a bulk frame for a station that doesn't fit before
+the next deadline (or in what's left of the station's grant) is split, and
+its first fragment sent to fill the time exactly; the rest goes out ahead of
+the station's other frames. JaldiDecap at the station puts it back together.
+
+Keyword arguments are:
+
+=over 8
+
+=item ARQ
+
+Boolean. If false, don't keep bulk frames for retransmission. Default is true.
+
+=item FRAGMENT
+
+Boolean. If true, fill the time before each deadline with a fragment of the
+next bulk frame. Default is false.
+
+=item VOIPFLOWS
+
+Unsigned. The most flows to give places in a VoIP slot. Default is 64, the
+most there can be.
+
+=item VOIPSHARE
+
+Unsigned. The most of the time between VoIP slots, as a percentage, that the
+VoIP slot may take up for the flows admitted. Default is 50.
+
+=item VOIPHOLD
+
+Unsigned. How long, in microseconds, a station keeps admitted flows it
+doesn't ask for. Default is 2000000.
+
+=item POLL
+
+Boolean. If true, poll recently active stations. Default is false.
+
+=item POLLWINDOW
+
+Unsigned. How long, in microseconds, a station counts as recently active
+after asking for capacity. Default is 1000000.
+
+=back
+
+=h arq read-only
+
+Returns one line per station: its ID, and the retransmission statistics
+described for JaldiGate's arq handler.
+
+=h voip read-only
+
+Returns the number of flows in the VoIP slots of the last round, the most
+there may be, and the length of the slots in microseconds, then one line per
+station: its ID, and the frame size and guard, in bytes, its places are sized
+for.
+
+=h admission read-only
+
+Returns the bytes of VoIP slot committed to the flows admitted, and the most
+VOIPSHARE allows, then one line per station: its ID, the number of flows
+admitted, the number demoted to bulk in the last round, and the total number
+of flows demoted, counted once a round.
+
+=h polls read-only
+
+Returns one line per station: its ID, whether it's recently active (1) or not
+(0), and the number of times it has been polled.
 
 =a
 
-JaldiGate */
+JaldiGate, JaldiDecap, JaldiClock */
 
 class JaldiQueue;
+class JaldiDecap;
 
 class JaldiScheduler : public Element { public:
 
@@ -63,15 +173,43 @@ class JaldiScheduler : public Element { public:
     bool can_live_reconfigure() const   { return true; }
     void take_state(Element*, ErrorHandler*);
 
+    void add_handlers();
+
     void run_timer(Timer*);
     void push(int, Packet*);
 
+    // Frame visitor (see dispatch_frame() in Frame.hh)
+    void visit_data(Packet* p, const jaldimac::Frame* f)    { visit_bad(p, f); }
+    void visit(Packet*, const jaldimac::Frame*, const jaldimac::RequestFramePayload&);
+    void visit(Packet*, const jaldimac::Frame*, const jaldimac::RoundCompleteMessagePayload&);
+    template<typename Payload> void visit(Packet* p, const jaldimac::Frame* f, const Payload&) { visit_bad(p, f); }
+    void visit_bad(Packet*, const jaldimac::Frame*);
+
   private:
+    bool for_us(const jaldimac::Frame* f) const
+    {
+        return f->dest_id == jaldimac::BROADCAST_ID || f->dest_id == jaldimac::MASTER_ID;
+    }
+
+    void process_block_acks(unsigned station, const jaldimac::Frame* f);
+    void process_voip_report(unsigned station, const jaldimac::Frame* f);
+    uint32_t voip_flow_bytes(unsigned station, bool first) const;
+    uint32_t voip_committed_bytes() const;
+    uint32_t voip_budget_bytes() const  { return jaldimac::INTER_VOIP_SLOT_DISTANCE__BYTES / 100 * voip_share; }
+    void admit_voip_flows();
+    uint32_t poll_bytes(unsigned station) const;
+    bool upstream_empty(unsigned station) const;
+    uint32_t upstream_head_length(unsigned station) const;
+    Packet* pull_upstream(unsigned station);
+    Packet* pull_fragment(unsigned station, uint32_t max_bytes);
+    WritablePacket* add_block_acks(WritablePacket* p);
+
+    static String read_handler(Element*, void*);
+
     void received_round_complete_message();
     bool have_data_or_requests();
     void count_upstream();
     bool try_to_allocate_voip_request(unsigned, unsigned&);
-    void allocate_voip_to_no_one(unsigned);
     void compute_fair_allocation();
     void generate_layout();
 
@@ -81,21 +219,56 @@ class JaldiScheduler : public Element { public:
     static const int out_port = 0;
     static const int out_port_bad = 1;
 
-    JaldiQueue* bulk_queues[jaldimac::STATION_COUNT];
+    unsigned station_count;             // One per bulk input
+    JaldiQueue* bulk_queues[jaldimac::MAX_STATION_COUNT];
 
-    uint32_t bulk_requested_bytes[jaldimac::STATION_COUNT];
-    uint8_t voip_requested_flows[jaldimac::STATION_COUNT];
-    uint32_t bulk_upstream_bytes[jaldimac::STATION_COUNT];
+    uint32_t bulk_requested_bytes[jaldimac::MAX_STATION_COUNT];
+    uint8_t voip_requested_flows[jaldimac::MAX_STATION_COUNT];
+    uint32_t bulk_upstream_bytes[jaldimac::MAX_STATION_COUNT];
 
     bool granted_voip;
-    uint8_t voip_granted_by_station[jaldimac::STATION_COUNT];
-    jaldimac::VoIPSlotPayload voip_granted;
-    uint32_t bulk_granted_bytes[jaldimac::STATION_COUNT];
-    uint32_t bulk_granted_upstream_bytes[jaldimac::STATION_COUNT];
+    uint8_t voip_granted_by_station[jaldimac::MAX_STATION_COUNT];
+    uint32_t voip_granted_flows;        // Width of this round's VoIP slots
+    jaldimac::VoIPSlotFlow voip_granted[jaldimac::MAX_FLOWS_PER_VOIP_SLOT];
+    uint32_t voip_slot_bytes;
+    uint32_t max_voip_flows;
+    uint32_t voip_frame_bytes[jaldimac::MAX_STATION_COUNT];     // From VoIP reports
+    uint32_t voip_guard_bytes[jaldimac::MAX_STATION_COUNT];
+
+    // VoIP admission control
+    uint32_t voip_share;
+    uint32_t voip_hold_us;
+    unsigned next_admit_station;
+    uint32_t voip_admitted_flows[jaldimac::MAX_STATION_COUNT];
+    uint64_t voip_admitted_used_us[jaldimac::MAX_STATION_COUNT];   // Last asked for, on the JaldiClock
+    uint32_t voip_demoted_flows[jaldimac::MAX_STATION_COUNT];
+    uint32_t voip_refused_flows[jaldimac::MAX_STATION_COUNT];
+
+    // Polling
+    bool poll_enabled;
+    uint32_t poll_window_us;
+    uint64_t active_until_us[jaldimac::MAX_STATION_COUNT];      // On the JaldiClock
+    bool poll_station[jaldimac::MAX_STATION_COUNT];             // This round
+    uint32_t polls_sent[jaldimac::MAX_STATION_COUNT];
+    uint32_t bulk_granted_bytes[jaldimac::MAX_STATION_COUNT];
+    uint32_t bulk_granted_upstream_bytes[jaldimac::MAX_STATION_COUNT];
 
     uint32_t rate_limit_distance_us;
-    timeval rate_limit_until;
-    Timer timer;
+    uint64_t rate_limit_until_us;   // On the JaldiClock
+    JaldiTimer timer;
+
+    bool arq_enabled;
+    JaldiDecap* decap;                  // Source of our block ACKs, if any
+    JaldiRetransmitBuffer retransmit[jaldimac::MAX_STATION_COUNT];
+
+    bool fragment_enabled;
+    JaldiPartialFrame partial[jaldimac::MAX_STATION_COUNT];    // Being sent in fragments
+
+    // Prebuilt control frames
+    JaldiFrameTemplate<jaldimac::VOIP_SLOT, jaldimac::VoIPSlotPayload> voip_slot_template;
+    JaldiFrameTemplate<jaldimac::TRANSMIT_SLOT, jaldimac::TransmitSlotPayload> transmit_slot_template;
+    JaldiFrameTemplate<jaldimac::DELAY_MESSAGE, jaldimac::DelayMessagePayload> delay_message_template;
+    JaldiFrameTemplate<jaldimac::CONTENTION_SLOT, jaldimac::ContentionSlotPayload> contention_slot_template;
 };
 
 CLICK_ENDDECLS
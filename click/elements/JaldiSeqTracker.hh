@@ -0,0 +1,233 @@
+#ifndef JALDI_SEQ_TRACKER_HH
+#define JALDI_SEQ_TRACKER_HH
+
+#include <click/string.hh>
+#include "Frame.hh"
+
+// Follows the sequence numbers of the data frames received from each source,
+// one sequence per (source, type), and counts the frames lost, duplicated and
+// reordered along the way. Every frame costs O(1): the tracker keeps the next
+// sequence number it expects and a bitmap of which of the window_size numbers
+// before it have arrived, so a frame that arrives late can be told apart from
+// a duplicate by testing one bit. Frames skipped over are counted as lost
+// until they turn up; frames that turn up more than window_size numbers late,
+// or from before the tracker picked the sequence up, can't be checked, and are
+// counted as late instead (and stay lost). A jump of more than max_gap in
+// either direction is taken to mean that the sender restarted, and the
+// sequence is picked up again from the new number.
+class JaldiSeqTracker
+{
+  public:
+    static const unsigned window_size = 64;
+    static const uint32_t max_gap = 1 << 16;
+
+    JaldiSeqTracker()
+    {
+        for (unsigned src = 0 ; src < nsources ; ++src)
+            _sources[src] = NULL;
+    }
+
+    ~JaldiSeqTracker()
+    {
+        for (unsigned src = 0 ; src < nsources ; ++src)
+            delete _sources[src];
+    }
+
+    void clear()
+    {
+        for (unsigned src = 0 ; src < nsources ; ++src)
+        {
+            delete _sources[src];
+            _sources[src] = NULL;
+        }
+    }
+
+    // Only data frames are numbered; the control frames built by the
+    // schedulers and drivers all carry sequence number 0.
+    static bool tracks(uint8_t type)
+    {
+        return type == jaldimac::BULK_FRAME || type == jaldimac::VOIP_FRAME;
+    }
+
+    // A frame of the given data type and sequence number arrived from SRC_ID.
+    // Returns false if it's a duplicate of one already received.
+    inline bool add(uint8_t src_id, uint8_t type, uint32_t seq)
+    {
+        Source* s = _sources[src_id];
+
+        if (! s && ! (s = _sources[src_id] = new Source))
+            return true;
+
+        Stream& st = s->streams[type == jaldimac::VOIP_FRAME];
+        int32_t ahead = int32_t(seq - st.expected);
+        st.unacked = true;
+
+        if (! st.started || ahead > int32_t(max_gap) || ahead < -int32_t(max_gap))
+        {
+            if (st.started)
+                ++st.resyncs;
+
+            st.started = true;
+            st.expected = seq + 1;
+            st.window = 1;
+            st.history = 1;
+            ++st.received;
+        }
+        else if (ahead >= 0)
+        {
+            // Bit i of the window stands for expected - 1 - i.
+            st.lost += ahead;
+            st.window = (uint32_t(ahead) + 1 < window_size ? (st.window << (ahead + 1)) | 1 : 1);
+            st.history = (st.history + ahead + 1 < window_size ? st.history + ahead + 1 : window_size);
+            st.expected = seq + 1;
+            ++st.received;
+        }
+        else
+        {
+            uint32_t behind = uint32_t(-ahead) - 1;
+            uint64_t bit = uint64_t(1) << behind;
+
+            // Numbers from before the sequence was (re)started weren't
+            // counted as lost, so they can't be checked either.
+            if (behind >= st.history)
+                ++st.late;
+            else if (st.window & bit)
+            {
+                ++st.duplicates;
+                return false;
+            }
+            else
+            {
+                st.window |= bit;
+                --st.lost;
+                ++st.reordered;
+                ++st.received;
+            }
+        }
+
+        return true;
+    }
+
+    // Fills in a block ACK for the BULK_FRAMEs received from SRC_ID, if any
+    // have arrived since the last one was taken. Numbers from before the
+    // sequence was picked up are reported as received, since there's no
+    // telling.
+    bool take_block_ack(uint8_t src_id, jaldimac::BlockAckExtension& ack)
+    {
+        Source* s = _sources[src_id];
+
+        if (! s || ! s->streams[0].unacked)
+            return false;
+
+        Stream& st = s->streams[0];
+        st.unacked = false;
+
+        ack.peer_id = src_id;
+        ack.next_seq = st.expected;
+        ack.bitmap = st.window;
+
+        if (st.history < window_size)
+            ack.bitmap |= ~((uint64_t(1) << st.history) - 1);
+
+        return true;
+    }
+
+    // One line per sequence seen: the source ID, the frame type, and the
+    // number of frames received, lost, duplicated, reordered and late, and
+    // of resynchronizations.
+    String unparse() const
+    {
+        String s = "src type received lost duplicates reordered late resyncs\n";
+
+        for (unsigned src = 0 ; src < nsources ; ++src)
+        {
+            const Source* source = _sources[src];
+
+            if (! source)
+                continue;
+
+            for (unsigned i = 0 ; i < nstreams ; ++i)
+            {
+                const Stream& st = source->streams[i];
+
+                if (! st.started)
+                    continue;
+
+                s += String(src) + (i ? " VOIP_FRAME " : " BULK_FRAME ")
+                     + String(st.received) + " " + String(st.lost)
+                     + " " + String(st.duplicates) + " " + String(st.reordered)
+                     + " " + String(st.late) + " " + String(st.resyncs) + "\n";
+            }
+        }
+
+        return s;
+    }
+
+    // One line per source seen: its ID, the number of frames received and
+    // lost over all its sequences, and the loss rate, lost / (received +
+    // lost), as a percentage.
+    String unparse_loss() const
+    {
+        String s = "src received lost loss_percent\n";
+
+        for (unsigned src = 0 ; src < nsources ; ++src)
+        {
+            const Source* source = _sources[src];
+
+            if (! source)
+                continue;
+
+            uint64_t received = 0;
+            uint64_t lost = 0;
+
+            for (unsigned i = 0 ; i < nstreams ; ++i)
+            {
+                received += source->streams[i].received;
+                lost += source->streams[i].lost;
+            }
+
+            // In hundredths of a percent, without floating point
+            uint32_t rate = (received + lost ? uint32_t(lost * 10000 / (received + lost)) : 0);
+            uint32_t fraction = rate % 100;
+
+            s += String(src) + " " + String(received) + " " + String(lost)
+                 + " " + String(rate / 100) + (fraction < 10 ? ".0" : ".") + String(fraction) + "\n";
+        }
+
+        return s;
+    }
+
+  private:
+    static const unsigned nsources = 256;
+    static const unsigned nstreams = 2;         // BULK_FRAME, VOIP_FRAME
+
+    struct Stream
+    {
+        Stream() : started(false), unacked(false), expected(0), window(0), history(0),
+                   received(0), lost(0), duplicates(0), reordered(0), late(0), resyncs(0) {}
+
+        bool started;
+        bool unacked;               // Received frames since the last block ACK
+        uint32_t expected;          // Next sequence number
+        uint64_t window;            // Which of the previous numbers arrived
+        uint32_t history;           // How many of them the window covers
+        uint64_t received;
+        uint64_t lost;
+        uint64_t duplicates;
+        uint64_t reordered;
+        uint64_t late;
+        uint32_t resyncs;
+    };
+
+    struct Source
+    {
+        Stream streams[nstreams];
+    };
+
+    JaldiSeqTracker(const JaldiSeqTracker&);
+    JaldiSeqTracker& operator=(const JaldiSeqTracker&);
+
+    Source* _sources[nsources];
+};
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef JALDI_SLOT_TIMING_HH
+#define JALDI_SLOT_TIMING_HH
+
+#include <click/string.hh>
+#include "Frame.hh"
+#include "JaldiHistogram.hh"
+
+// Records how long the fake drivers actually wait for each kind of timed
+// frame (CONTENTION_SLOT, VOIP_SLOT, TRANSMIT_SLOT and DELAY_MESSAGE) compared
+// to the duration that was asked for. A wait starts when the driver announces
+// the slot (or consumes the delay) and ends when it releases the next frame.
+class JaldiSlotTiming
+{
+  public:
+    JaldiSlotTiming() : _pending(false), _pending_type(0),
+                        _pending_requested_us(0), _pending_start_us(0)
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        for (unsigned type = 0 ; type < ntypes ; ++type)
+        {
+            _stats[type].lateness.clear();
+            _stats[type].requested_us = 0;
+            _stats[type].actual_us = 0;
+            _stats[type].early = 0;
+            _stats[type].max_early_us = 0;
+        }
+
+        _pending = false;
+    }
+
+    bool pending() const                { return _pending; }
+
+    // A wait of REQUESTED_US for a frame of type TYPE starts at NOW_US.
+    inline void start(uint8_t type, uint32_t requested_us, uint64_t now_us)
+    {
+        _pending = type < ntypes;
+        _pending_type = type;
+        _pending_requested_us = requested_us;
+        _pending_start_us = now_us;
+    }
+
+    // The driver is releasing the next frame at NOW_US.
+    inline void finish(uint64_t now_us)
+    {
+        if (! _pending)
+            return;
+
+        Stats& stats = _stats[_pending_type];
+        uint64_t actual_us = now_us - _pending_start_us;
+
+        stats.requested_us += _pending_requested_us;
+        stats.actual_us += actual_us;
+
+        if (actual_us >= _pending_requested_us)
+            stats.lateness.add(clamp(actual_us - _pending_requested_us));
+        else
+        {
+            uint32_t early_us = clamp(_pending_requested_us - actual_us);
+            ++stats.early;
+
+            if (early_us > stats.max_early_us)
+                stats.max_early_us = early_us;
+        }
+
+        _pending = false;
+    }
+
+    // One line per kind of wait: name, count, mean requested and actual
+    // durations, lateness percentiles and maximum, and the number of waits
+    // (and the longest) that ended early. All times are in microseconds.
+    String unparse() const
+    {
+        String s = "type count requested_mean actual_mean late_p50 late_p90 late_p99 late_max early early_max\n";
+
+        for (unsigned type = 0 ; type < ntypes ; ++type)
+        {
+            const char* name = type_name(type);
+
+            if (! name)
+                continue;
+
+            const Stats& stats = _stats[type];
+            uint32_t count = stats.lateness.count() + stats.early;
+
+            s += String(name) + " " + String(count)
+                 + " " + String(count ? uint32_t(stats.requested_us / count) : 0)
+                 + " " + String(count ? uint32_t(stats.actual_us / count) : 0)
+                 + " " + String(stats.lateness.percentile(50))
+                 + " " + String(stats.lateness.percentile(90))
+                 + " " + String(stats.lateness.percentile(99))
+                 + " " + String(stats.lateness.max())
+                 + " " + String(stats.early)
+                 + " " + String(stats.max_early_us) + "\n";
+        }
+
+        return s;
+    }
+
+    // The lateness histogram for every kind of wait, each introduced by its
+    // name.
+    String unparse_histograms() const
+    {
+        String s;
+
+        for (unsigned type = 0 ; type < ntypes ; ++type)
+        {
+            if (const char* name = type_name(type))
+                s += String(name) + ":\n" + _stats[type].lateness.unparse();
+        }
+
+        return s;
+    }
+
+  private:
+    static const unsigned ntypes = jaldimac::DELAY_MESSAGE + 1;
+
+    struct Stats
+    {
+        JaldiHistogram lateness;    // actual - requested, for waits that weren't early
+        uint64_t requested_us;
+        uint64_t actual_us;
+        uint32_t early;
+        uint32_t max_early_us;
+    };
+
+    static const char* type_name(unsigned type)
+    {
+        switch (type)
+        {
+            case jaldimac::CONTENTION_SLOT: return "CONTENTION_SLOT";
+            case jaldimac::VOIP_SLOT:       return "VOIP_SLOT";
+            case jaldimac::TRANSMIT_SLOT:   return "TRANSMIT_SLOT";
+            case jaldimac::DELAY_MESSAGE:   return "DELAY_MESSAGE";
+            default:                        return NULL;
+        }
+    }
+
+    static inline uint32_t clamp(uint64_t us)
+    {
+        return us > 0xFFFFFFFFULL ? 0xFFFFFFFFU : uint32_t(us);
+    }
+
+    Stats _stats[ntypes];
+    bool _pending;
+    uint8_t _pending_type;
+    uint32_t _pending_requested_us;
+    uint64_t _pending_start_us;
+};
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ * JaldiTxStamp.{cc,hh} -- stamps Jaldi frames with their transmit time
+ */
+
+#include <click/config.h>
+#include <click/glue.hh>
+
+#include "JaldiClick.hh"
+#include "JaldiTxStamp.hh"
+
+CLICK_DECLS
+
+JaldiTxStamp::JaldiTxStamp()
+{
+}
+
+JaldiTxStamp::~JaldiTxStamp()
+{
+}
+
+Packet* JaldiTxStamp::action(Packet* p)
+{
+    return jaldi_stamp_tx(p);
+}
+
+void JaldiTxStamp::push(int, Packet* p)
+{
+    if (Packet* q = action(p))
+        output(out_port).push(q);
+}
+
+Packet* JaldiTxStamp::pull(int)
+{
+    if (Packet *p = input(in_port).pull())
+        return action(p);
+    else
+        return NULL;
+}
+
+CLICK_ENDDECLS
+ELEMENT_REQUIRES(Frame)
+EXPORT_ELEMENT(JaldiTxStamp)
@@ -0,0 +1,55 @@
+#ifndef CLICK_JALDITXSTAMP_HH
+#define CLICK_JALDITXSTAMP_HH
+#include <click/element.hh>
+CLICK_DECLS
+
+/*
+=c
+
+JaldiTxStamp
+
+=s jaldi
+
+stamps Jaldi frames with their transmit time
+
+=d
+
+Writes the current time into the footer of each Jaldi frame that passes
+through, so that the receiving JaldiDecap can measure the frame's latency. It
+should be placed as close to the radio as possible, after any queues; the
+fake drivers already stamp everything they send, so JaldiTxStamp is for paths
+without one, such as a station's upstream path between the gate's queue and
+the device.
+
+The time is the time of day in microseconds, modulo 2^32 (or virtual time;
+see JaldiClock). Frames which are not valid Jaldi frames are passed through
+unchanged. A frame whose data is shared with another packet (such as the copy
+JaldiGate keeps for retransmission) is copied before it's stamped.
+
+This element has one agnostic input and one agnostic output.
+
+=a
+
+JaldiDecap, JaldiFakeDriver, JaldiFakeDriverPrecise */
+
+class JaldiTxStamp : public Element { public:
+
+    JaldiTxStamp();
+    ~JaldiTxStamp();
+
+    const char* class_name() const  { return "JaldiTxStamp"; }
+    const char* port_count() const  { return "1/1"; }
+    const char* processing() const  { return AGNOSTIC; }
+    const char* flow_code() const   { return COMPLETE_FLOW; }
+
+    Packet* action(Packet* p);
+    void push(int, Packet*);
+    Packet* pull(int);
+
+  private:
+    static const int in_port = 0;
+    static const int out_port = 0;
+};
+
+CLICK_ENDDECLS
+#endif
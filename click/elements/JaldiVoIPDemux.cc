@@ -10,14 +10,21 @@
 #include <clicknet/udp.h>
 
 #include "Frame.hh"
+#include "JaldiClock.hh"
 #include "JaldiVoIPDemux.hh"
 
 using namespace jaldimac;
 
 CLICK_DECLS
 
-JaldiVoIPDemux::JaldiVoIPDemux() : timeout_s(3)
+JaldiVoIPDemux::JaldiVoIPDemux() : out_port_voip_overflow(DEFAULT_VOIP_QUEUES),
+                                   out_port_bad(DEFAULT_VOIP_QUEUES + 1),
+                                   timeout_s(3), nqueues(DEFAULT_VOIP_QUEUES), share(1),
+                                   nflows(0), overflow_flows(0), now_s(0), timer(this),
+                                   overflow_packets(0), bad_packets(0), table_full(0)
 {
+    for (unsigned i = 0 ; i < table_size ; ++i)
+        table[i].used = false;
 }
 
 JaldiVoIPDemux::~JaldiVoIPDemux()
@@ -26,67 +33,235 @@ JaldiVoIPDemux::~JaldiVoIPDemux()
 
 int JaldiVoIPDemux::configure(Vector<String>& conf, ErrorHandler* errh)
 {
+    nqueues = DEFAULT_VOIP_QUEUES;
+    share = 1;
+
     // Parse configuration parameters
     if (cp_va_kparse(conf, this, errh,
              "TIMEOUT", cpkP+cpkM, cpUnsigned, &timeout_s,
+             "QUEUES", 0, cpUnsigned, &nqueues,
+             "SHARE", 0, cpUnsigned, &share,
              cpEnd) < 0)
         return -1;
 
+    if (nqueues < 1 || nqueues > 0x7FFF)
+        return errh->error("QUEUES must be between 1 and 32767");
+
+    if (share < 1)
+        return errh->error("SHARE must be at least 1");
+
     // Check that we have the right number of output ports
-    if (noutputs() < int(FLOWS_PER_VOIP_SLOT + 1) || noutputs() > int(FLOWS_PER_VOIP_SLOT + 2))
-        return errh->error("wrong number of output ports; need either %<%d%> or %<%d%>", FLOWS_PER_VOIP_SLOT + 1, FLOWS_PER_VOIP_SLOT + 2);
+    if (noutputs() < int(nqueues + 1) || noutputs() > int(nqueues + 2))
+        return errh->error("wrong number of output ports; need either %<%d%> or %<%d%>", nqueues + 1, nqueues + 2);
+
+    out_port_voip_overflow = nqueues;
+    out_port_bad = nqueues + 1;
+
+    // Start afresh; flows are learned again from their next packets
+    clear();
 
     // Looks good!
     return 0;
 }
 
-void JaldiVoIPDemux::push(int, Packet* p)
+int JaldiVoIPDemux::initialize(ErrorHandler*)
+{
+    now_s = uint32_t(JaldiClock::now_us() / 1000000);
+    timer.initialize(this);
+    timer.schedule_after_us(1000000);
+    return 0;
+}
+
+void JaldiVoIPDemux::clear()
+{
+    for (unsigned i = 0 ; i < table_size ; ++i)
+        table[i].used = false;
+
+    nflows = 0;
+    queue_flows.clear();
+    queue_flows.resize(nqueues, 0);
+    overflow_flows = 0;
+}
+
+JaldiVoIPDemux::Flow* JaldiVoIPDemux::lookup(uint32_t addr, uint16_t port)
+{
+    for (unsigned i = flow_hash(addr, port) ; table[i].used ; i = (i + 1) % table_size)
+    {
+        if (table[i].addr == addr && table[i].port == port)
+            return &table[i];
+    }
+
+    return NULL;
+}
+
+JaldiVoIPDemux::Flow* JaldiVoIPDemux::insert(uint32_t addr, uint16_t port)
 {
-    time_t current_time = time(NULL);
+    if (nflows == max_flows)
+        return NULL;
+
+    unsigned i = flow_hash(addr, port);
+
+    while (table[i].used)
+        i = (i + 1) % table_size;
+
+    Flow& f = table[i];
+    f.used = true;
+    f.addr = addr;
+    f.port = port;
+    f.queue = assign_queue();
+
+    if (f.queue < 0)
+        ++overflow_flows;
+
+    ++nflows;
+    return &f;
+}
+
+// Empties slot I, moving later entries of the same probe sequence back into
+// the hole so that lookups never need to skip over deleted entries.
+void JaldiVoIPDemux::remove(unsigned i)
+{
+    table[i].used = false;
+    --nflows;
+
+    for (unsigned j = (i + 1) % table_size ; table[j].used ; j = (j + 1) % table_size)
+    {
+        unsigned home = flow_hash(table[j].addr, table[j].port);
+
+        // Entries whose probe sequence doesn't pass through the hole stay put
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+
+        table[i] = table[j];
+        table[j].used = false;
+        i = j;
+    }
+}
+
+// The output with the fewest flows, if it has room for another, or -1.
+int JaldiVoIPDemux::assign_queue()
+{
+    unsigned best = 0;
+
+    for (unsigned q = 1 ; q < nqueues ; ++q)
+    {
+        if (queue_flows[q] < queue_flows[best])
+            best = q;
+    }
 
+    if (queue_flows[best] >= share)
+        return -1;
+
+    ++queue_flows[best];
+    return best;
+}
+
+void JaldiVoIPDemux::expire()
+{
+    // Forget flows which have timed out. Removing a flow may move another
+    // into its slot, so look at the same slot again.
+    for (unsigned i = 0 ; i < table_size ; )
+    {
+        Flow& f = table[i];
+
+        if (! f.used || now_s - f.last_seen_s <= timeout_s)
+        {
+            ++i;
+            continue;
+        }
+
+        if (f.queue < 0)
+            --overflow_flows;
+        else
+            --queue_flows[f.queue];
+
+        remove(i);
+    }
+
+    // Move overflowing flows into any room that's been freed
+    for (unsigned i = 0 ; i < table_size && overflow_flows > 0 ; ++i)
+    {
+        Flow& f = table[i];
+
+        if (! f.used || f.queue >= 0)
+            continue;
+
+        if ((f.queue = assign_queue()) < 0)
+            break;
+
+        --overflow_flows;
+    }
+}
+
+void JaldiVoIPDemux::run_timer(Timer*)
+{
+    now_s = uint32_t(JaldiClock::now_us() / 1000000);
+    expire();
+    timer.schedule_after_us(1000000);
+}
+
+void JaldiVoIPDemux::push(int, Packet* p)
+{
     // Get destination IP and port of this packet
-    if (! p->has_network_header())
+    if (! p->has_network_header() || p->ip_header()->ip_p != IP_PROTO_UDP)
     {
+        ++bad_packets;
         checked_output_push(out_port_bad, p);
         return;
     }
 
-    const in_addr dest_ip = p->ip_header()->ip_dst;
+    uint32_t dest_ip = p->ip_header()->ip_dst.s_addr;
+    uint16_t dest_port = p->udp_header()->uh_dport;
+
+    // Find the flow, or start a new one
+    Flow* f = lookup(dest_ip, dest_port);
 
-    if (! p->ip_header()->ip_p == IP_PROTO_UDP)
+    if (! f && ! (f = insert(dest_ip, dest_port)))
     {
-        checked_output_push(out_port_bad, p);
+        ++table_full;
+        ++overflow_packets;
+        output(out_port_voip_overflow).push(p);
         return;
     }
 
-    uint16_t dest_port = p->udp_header()->uh_dport;
+    f->last_seen_s = now_s;
 
-    // Check for an output port already assigned to this 2-tuple
-    for (unsigned i = 0 ; i < FLOWS_PER_VOIP_SLOT ; ++i)
+    if (f->queue < 0)
     {
-        if (output_ip[i] == dest_ip && output_port[i] == dest_port)
-        {
-            output_last_seen[i] = current_time;
-            output(i).push(p);
-            return;
-        }
+        ++overflow_packets;
+        output(out_port_voip_overflow).push(p);
     }
+    else
+        output(f->queue).push(p);
+}
+
+String JaldiVoIPDemux::read_handler(Element* e, void* thunk)
+{
+    JaldiVoIPDemux* d = static_cast<JaldiVoIPDemux*>(e);
 
-    // Try to find an expired output port to reclaim
-    for (unsigned i = 0 ; i < FLOWS_PER_VOIP_SLOT ; ++i)
+    switch (reinterpret_cast<intptr_t>(thunk))
     {
-        if (difftime(current_time, output_last_seen[i]) > timeout_s)
+        case 0:
         {
-            output_ip[i] = dest_ip;
-            output_port[i] = dest_port;
-            output_last_seen[i] = current_time;
-            output(i).push(p);
-            return;
+            String s;
+
+            for (unsigned q = 0 ; q < d->nqueues ; ++q)
+                s += String(d->queue_flows[q]) + " ";
+
+            return s + String(d->overflow_flows) + "\n";
         }
+        case 1:
+            return "overflow_packets bad_packets table_full\n" + String(d->overflow_packets)
+                   + " " + String(d->bad_packets) + " " + String(d->table_full) + "\n";
+        default:
+            return "";
     }
+}
 
-    // All output ports are claimed! We have to send it out the overflow port
-    output(out_port_voip_overflow);
+void JaldiVoIPDemux::add_handlers()
+{
+    add_read_handler("flows", read_handler, (void*) 0);
+    add_read_handler("stats", read_handler, (void*) 1);
 }
 
 CLICK_ENDDECLS
@@ -2,12 +2,13 @@
 #define CLICK_JALDIVOIPDEMUX_HH
 #include <click/element.hh>
 #include "Frame.hh"
+#include "JaldiClock.hh"
 CLICK_DECLS
 
 /*
 =c
 
-JaldiVoIPDemux(TIMEOUT)
+JaldiVoIPDemux(TIMEOUT [, I<keywords> QUEUES, SHARE])
 
 =s jaldi
 
@@ -17,51 +18,123 @@ demultiplexes VoIP flows
 
 JaldiVoIPDemux demultiplexes a stream of incoming VoIP packets into individual
 flows. It identifies flows using a combination of destination IP address and
-port. It only tracks a limited number of flows at a time; additional flows are
-all directed to an "overflow" output. Since flows may start and stop at any
-time, JaldiVoIPDemux will forget about flows it has not received a packet for
-in TIMEOUT seconds, freeing the corresponding output to be used by another
-flow.
+port, and keeps each flow on one of QUEUES outputs, giving each new flow the
+output with the fewest flows. Once every output has SHARE flows, further
+flows are all directed to an "overflow" output (to be sent with bulk data),
+and moved back to a flow output when one frees up. Since flows may start and
+stop at any time, JaldiVoIPDemux will forget about flows it has not received
+a packet for in TIMEOUT seconds, freeing their place on an output for
+another flow.
+
+Flows are kept in a hash table of up to 768 flows, so finding a packet's flow
+costs the same however many there are; packets of flows beyond that go to
+the overflow output. The time is read, and flows that have timed out are
+forgotten, once a second rather than on every packet.
 
 The first and only input, which is push, receives IP packets which are presumed
-to have been classified as VoIP by an upstream classifier.
+to have been classified as VoIP by an upstream classifier. Packets which
+aren't UDP, or lack the IP header annotation, go to the optional bad output.
 
-The outputs are all push. The number of outputs is equal to the number of flows
-that can fit into a VoIP slot, plus an extra overflow output and an optional
-additoinal port for bad packets. Though it is not required, it makes sense that
-each output would be connected to a short, drop-front queue. (Since stale VoIP
-packets are essentially useless.)
+The outputs are all push. The number of outputs is QUEUES, plus an extra
+overflow output and an optional additional port for bad packets. Though it is
+not required, it makes sense that each output would be connected to a short,
+drop-front queue. (Since stale VoIP packets are essentially useless.)
+
+Keyword arguments are:
+
+=over 8
+
+=item QUEUES
+
+Unsigned. The number of flow outputs, which should match the number of VoIP
+flow inputs of the JaldiGate they feed. Default is 4.
+
+=item SHARE
+
+Unsigned. The most flows to put on one output. Default is 1.
+
+=back
+
+=h flows read-only
+
+Returns the number of flows on each output, with the overflow output last.
+
+=h stats read-only
+
+Returns the number of packets sent to the overflow output, the number sent to
+the bad output, and the number of packets of flows which didn't fit in the
+table.
 
 =a
 
 JaldiEncap, JaldiDecap, JaldiGate */
 
-struct in_addr;
-
 class JaldiVoIPDemux : public Element { public:
 
     JaldiVoIPDemux();
     ~JaldiVoIPDemux();
 
     const char* class_name() const  { return "JaldiVoIPDemux"; }
-    const char* port_count() const  { return "1/1-"; }
+    const char* port_count() const  { return "1/2-"; }
     const char* processing() const  { return PUSH; }
     const char* flow_code() const   { return COMPLETE_FLOW; }
 
     int configure(Vector<String>&, ErrorHandler*);
+    int initialize(ErrorHandler*);
     bool can_live_reconfigure() const   { return true; }
+    void add_handlers();
 
     void push(int, Packet*);
+    void run_timer(Timer*);
 
     private:
+      struct Flow
+      {
+          uint32_t addr;          // Destination, in network byte order
+          uint16_t port;          // Likewise
+          bool used;
+          int16_t queue;          // Output, or -1 for overflow
+          uint32_t last_seen_s;
+      };
+
+      static unsigned flow_hash(uint32_t addr, uint16_t port)
+      {
+          return ((addr ^ (uint32_t(port) << 16)) * 0x9E3779B1u) >> 22;     // The top 10 bits
+      }
+
+      Flow* lookup(uint32_t addr, uint16_t port);
+      Flow* insert(uint32_t addr, uint16_t port);
+      void remove(unsigned i);
+      int assign_queue();
+      void clear();
+      void expire();
+
+      static String read_handler(Element*, void*);
+
       static const int in_port = 0;
-      static const int out_port_voip_overflow = jaldimac::FLOWS_PER_VOIP_SLOT;
-      static const int out_port_bad = jaldimac::FLOWS_PER_VOIP_SLOT + 1;
+
+      // Open addressing, with linear probing; kept at most three quarters full
+      static const unsigned table_size = 1024;
+      static const unsigned max_flows = table_size * 3 / 4;
+
+      int out_port_voip_overflow;
+      int out_port_bad;
 
       uint32_t timeout_s;
-      in_addr output_ip[jaldimac::FLOWS_PER_VOIP_SLOT];
-      uint16_t output_port[jaldimac::FLOWS_PER_VOIP_SLOT];
-      time_t output_last_seen[jaldimac::FLOWS_PER_VOIP_SLOT];
+      uint32_t nqueues;
+      uint32_t share;
+
+      Flow table[table_size];
+      unsigned nflows;
+      Vector<uint32_t> queue_flows;       // Flows on each output
+      uint32_t overflow_flows;
+
+      uint32_t now_s;                     // On the JaldiClock, as of the last tick
+      JaldiTimer timer;
+
+      uint32_t overflow_packets;
+      uint32_t bad_packets;
+      uint32_t table_full;
 };
 
 CLICK_ENDDECLS
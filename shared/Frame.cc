@@ -10,7 +10,7 @@ const size_t Frame::header_size = 4 * sizeof(uint8_t) /* preamble */
 				+ sizeof(uint8_t) /* src_id */
                                 + sizeof(uint8_t) /* dest_id */
 				+ sizeof(uint8_t) /* type */
-                                + sizeof(uint8_t) /* tag */
+                                + sizeof(uint8_t) /* ext_words */
 				+ sizeof(uint32_t) /* length */
                                 + sizeof(uint32_t) /* seq */;
 
@@ -25,10 +25,10 @@ struct Frame
     uint8_t src_id;
     uint8_t dest_id;
     uint8_t type;
-    uint8_t tag;            // Currently unused
+    uint8_t ext_words;      // Size of the extension block, in 32-bit words
     uint32_t length;
     uint32_t seq;
-    uint8_t payload[0];     // Actual size determined by length
+    uint8_t body[0];        // Extension block, then payload, then footer
 
     // Static constants
     static const size_t header_size;
@@ -37,14 +37,21 @@ struct Frame
 
     // Member functions
     inline void initialize();
-    inline size_t payload_length() const { return length - empty_frame_size; }
+    inline size_t extension_length() const { return size_t(ext_words) * 4; }
+    inline const uint8_t* extensions() const { return body; }
+    inline uint8_t* extensions() { return body; }
+    inline const uint8_t* payload() const { return body + extension_length(); }
+    inline uint8_t* payload() { return body + extension_length(); }
+    inline size_t payload_length() const { return length - empty_frame_size - extension_length(); }
+    inline uint32_t tx_timestamp() const;
+    inline void set_tx_timestamp(uint32_t us);
 
 } __attribute__((__packed__));
 
 // Important constants:
-const uint8_t CURRENT_VERSION = 1;
+const uint8_t CURRENT_VERSION = 2;       // 2 added the extension block
 const uint8_t PREAMBLE[4] = {'J', 'L', 'D', CURRENT_VERSION};
-const unsigned FLOWS_PER_VOIP_SLOT = 4;
+const unsigned MAX_FLOWS_PER_VOIP_SLOT = 64;     // Stations listed in one VOIP_SLOT
 
 inline void Frame::initialize()
 {
@@ -55,15 +62,155 @@ inline void Frame::initialize()
     src_id = 0;
     dest_id = 0;
     type = BULK_FRAME;
-    tag = 0;
+    ext_words = 0;
     length = empty_frame_size;
     seq = 0;
 }
 
+// The footer holds the time at which the frame was transmitted, in
+// microseconds modulo 2^32 on the sender's clock, or 0 if the sender didn't
+// stamp it. It may not be aligned.
+inline uint32_t Frame::tx_timestamp() const
+{
+    uint32_t us;
+    std::memcpy(&us, (const uint8_t*) this + length - footer_size, sizeof(us));
+    return us;
+}
+
+inline void Frame::set_tx_timestamp(uint32_t us)
+{
+    std::memcpy((uint8_t*) this + length - footer_size, &us, sizeof(us));
+}
+
+// Between the header and the payload is an extension block of ext_words
+// 32-bit words, holding optional fields which would otherwise each need a new
+// frame type. The block is a sequence of TLVs: a type byte, a length byte
+// giving the size of the value, and the value itself. A type of EXT_PAD marks
+// the rest of the block as padding. Receivers skip TLVs whose type they don't
+// know, so new extensions can be added without changing the frame version.
+// Version 1 frames had an unused byte in place of ext_words, which was always
+// 0, so they are version 2 frames without extensions.
+
+enum FrameExtensionType
+{
+    EXT_PAD = 0,
+    EXT_BLOCK_ACK,          // BlockAckExtension
+    EXT_AGGREGATE,          // AggregateExtension
+    EXT_FRAGMENT,           // FragmentExtension
+    EXT_VOIP_REPORT         // VoIPReportExtension
+};
+
+struct FrameExtension
+{
+    uint8_t type;
+    uint8_t length;         // Of value
+    uint8_t value[0];
+} __attribute__((__packed__));
+
+// Walks the extension block of a frame in place.
+//
+//     for (FrameExtensionIterator it(f) ; it.valid() ; it.next())
+//         if (it->type == ...) ...
+//
+// Iteration stops at padding, or at a TLV which would run past the end of the
+// block.
+class FrameExtensionIterator { public:
+
+    FrameExtensionIterator(const Frame* f) : _pos(f->extensions()),
+                                             _end(f->extensions() + f->extension_length()) {}
+
+    bool valid() const
+    {
+        return _pos + sizeof(FrameExtension) <= _end
+            && current()->type != EXT_PAD
+            && _pos + sizeof(FrameExtension) + current()->length <= _end;
+    }
+
+    void next()                                 { _pos += sizeof(FrameExtension) + current()->length; }
+    const FrameExtension* current() const       { return (const FrameExtension*) _pos; }
+    const FrameExtension* operator->() const    { return current(); }
+
+  private:
+    const uint8_t* _pos;
+    const uint8_t* _end;
+};
+
+// Returns the first extension of the given type, or NULL if there is none.
+inline const FrameExtension* find_extension(const Frame* f, uint8_t type)
+{
+    for (FrameExtensionIterator it(f) ; it.valid() ; it.next())
+    {
+        if (it->type == type)
+            return it.current();
+    }
+
+    return NULL;
+}
+
+// A block ACK for the BULK_FRAMEs that peer_id sent to the sender of the
+// frame carrying it: bit i of the bitmap is set if frame next_seq - 1 - i
+// arrived. Frames numbered below next_seq - 64 that no earlier ACK covered are
+// taken to be lost.
+// Stations send one to the master with each REQUEST_FRAME; the master sends
+// one for each station that sent it bulk data with each CONTENTION_SLOT.
+struct BlockAckExtension
+{
+    uint8_t peer_id;
+    uint32_t next_seq;      // One past the highest sequence number received
+    uint64_t bitmap;
+} __attribute__((__packed__));
+
+// Marks a BULK_FRAME whose payload is several packets, each preceded by its
+// length as an AggregateSubframe header, rather than one (see JaldiAggregate).
+// The packets were numbered seq, seq + 1, ..., seq + count - 1 before they
+// were aggregated, so the frame stands for all of those sequence numbers.
+struct AggregateExtension
+{
+    uint16_t count;
+} __attribute__((__packed__));
+
+struct AggregateSubframe
+{
+    uint16_t length;        // Of data
+    uint8_t data[0];
+} __attribute__((__packed__));
+
+// Marks a piece of a frame which was too long for the end of a slot, and was
+// split so that it could be finished in the next. The payload is bytes
+// offset to offset + payload_length() - 1 of the original frame, counting from
+// the start of its header and leaving out its footer. The fragments keep the
+// original's source, destination, type and sequence number, and are sent in
+// order; the receiver puts the original back together once it has the last.
+struct FragmentExtension
+{
+    uint32_t offset;
+    uint8_t last;           // Nonzero on the final fragment
+} __attribute__((__packed__));
+
+// Sent by a station with each REQUEST_FRAME while it has VoIP flows, so that
+// the master can size each flow's place in a VoIP slot from what the station
+// actually sends: the longest VoIP frame it has sent lately (or has waiting),
+// and the one-way latency of frames from the master, which bounds how late
+// the station may start in its place. The master uses its defaults for a
+// latency of VOIP_REPORT_NO_LATENCY, which the station sends if it hasn't
+// measured one.
+struct VoIPReportExtension
+{
+    uint16_t frame_bytes;
+    uint16_t latency_us;
+} __attribute__((__packed__));
+
+// The number of bytes an extension with a value of the given length takes up
+// in the block, before padding.
+inline size_t extension_size(size_t value_length)
+{
+    return sizeof(FrameExtension) + value_length;
+}
+
 // Cast the payload to one of the following structs as appropriate for the
 // frame type.  After the payload comes an additional 32 bit TX timestamp which
-// is added by the driver; it is only used for debugging purposes and should
-// not affect the semantics of the protocol.
+// is added by the driver (see tx_timestamp() above); it is only used for
+// measurement purposes and should not affect the semantics of the protocol.
 // BULK_FRAME and VOIP_FRAME do not have a struct below as their payload consists
 // of an encapsulated IP packet.
 
@@ -78,10 +225,21 @@ struct ContentionSlotPayload
     uint32_t duration_us;
 } __attribute__((__packed__));
 
+// The master picks the number of flows in each VoIP slot from demand, so the
+// list of flows runs to the end of the payload; see voip_slot_flows(). Each
+// gives the station whose place it is, and the length of the place, which
+// the master works out from the station's VoIP reports. Places follow each
+// other without gaps. A slot for no flows is valid.
+struct VoIPSlotFlow
+{
+    uint8_t station;
+    uint16_t duration_us;
+} __attribute__((__packed__));
+
 struct VoIPSlotPayload
 {
     uint32_t duration_us;
-    uint8_t stations[FLOWS_PER_VOIP_SLOT];
+    VoIPSlotFlow flows[0];
 } __attribute__((__packed__));
 
 struct TransmitSlotPayload
@@ -104,6 +262,122 @@ struct DelayMessagePayload
     uint32_t duration_us;
 } __attribute__((__packed__));
 
+// Compile-time mapping from a frame type to its payload struct. BULK_FRAME
+// and VOIP_FRAME have no entry, since their payload is an encapsulated IP
+// packet.
+template<uint8_t Type> struct FramePayload;
+template<> struct FramePayload<REQUEST_FRAME>           { typedef RequestFramePayload type; };
+template<> struct FramePayload<CONTENTION_SLOT>         { typedef ContentionSlotPayload type; };
+template<> struct FramePayload<VOIP_SLOT>               { typedef VoIPSlotPayload type; };
+template<> struct FramePayload<TRANSMIT_SLOT>           { typedef TransmitSlotPayload type; };
+template<> struct FramePayload<BITRATE_MESSAGE>         { typedef BitrateMessagePayload type; };
+template<> struct FramePayload<ROUND_COMPLETE_MESSAGE>  { typedef RoundCompleteMessagePayload type; };
+template<> struct FramePayload<DELAY_MESSAGE>           { typedef DelayMessagePayload type; };
+
+// The length of a complete frame (header, payload and footer) carrying a
+// Payload, as a compile-time constant.
+template<typename Payload> struct FrameSize
+{
+    static const uint32_t value = sizeof(Frame) + sizeof(Payload) + sizeof(uint32_t);
+};
+
+// The payload of a frame, as the struct for its type. Only valid once the
+// frame has been checked with frame_is_valid().
+template<uint8_t Type>
+inline const typename FramePayload<Type>::type& payload_of(const Frame* f)
+{
+    return *(const typename FramePayload<Type>::type*) f->payload();
+}
+
+template<uint8_t Type>
+inline typename FramePayload<Type>::type& payload_of(Frame* f)
+{
+    return *(typename FramePayload<Type>::type*) f->payload();
+}
+
+// The number of flows listed in a VOIP_SLOT frame. Only valid once the frame
+// has been checked with frame_is_valid().
+inline unsigned voip_slot_flows(const Frame* f)
+{
+    return (f->payload_length() - sizeof(VoIPSlotPayload)) / sizeof(VoIPSlotFlow);
+}
+
+// The smallest valid length of a frame of the given type, or 0 if the type is
+// unknown.
+inline uint32_t min_frame_length(uint8_t type)
+{
+    static const uint32_t lengths[] = {
+        sizeof(Frame) + sizeof(uint32_t),                           // BULK_FRAME
+        sizeof(Frame) + sizeof(uint32_t),                           // VOIP_FRAME
+        FrameSize<FramePayload<REQUEST_FRAME>::type>::value,
+        FrameSize<FramePayload<CONTENTION_SLOT>::type>::value,
+        FrameSize<FramePayload<VOIP_SLOT>::type>::value,
+        FrameSize<FramePayload<TRANSMIT_SLOT>::type>::value,
+        FrameSize<FramePayload<BITRATE_MESSAGE>::type>::value,
+        FrameSize<FramePayload<ROUND_COMPLETE_MESSAGE>::type>::value,
+        FrameSize<FramePayload<DELAY_MESSAGE>::type>::value
+    };
+
+    return type < sizeof(lengths) / sizeof(lengths[0]) ? lengths[type] : 0;
+}
+
+// Returns true if the frame at F, of which AVAILABLE bytes are present, is
+// of a version we understand, has a known type, a length that fits in those
+// bytes, and room for its extension block and payload. This is the only
+// length check an element needs before using payload_of() or walking the
+// extensions.
+inline bool frame_is_valid(const Frame* f, size_t available)
+{
+    if (available < sizeof(Frame) + sizeof(uint32_t))
+        return false;
+
+    if (f->preamble[3] == 0 || f->preamble[3] > CURRENT_VERSION)
+        return false;
+
+    uint32_t min_length = min_frame_length(f->type);
+    return min_length != 0 && f->length >= min_length + f->extension_length()
+        && f->length <= available;
+}
+
+// Checks the frame at F once and calls the member of VISITOR for its type,
+// passing CONTEXT (typically the Packet) through unchanged:
+//
+//     Result visit_data(Context, const Frame*);     BULK_FRAME and VOIP_FRAME
+//     Result visit(Context, const Frame*, const RequestFramePayload&);
+//     ...and so on, one overload per payload struct (which may be a template)
+//     Result visit_bad(Context, const Frame*);      invalid or unknown frames
+//
+// The frame types are dense, so the switch compiles to a jump table.
+template<typename Result, typename Visitor, typename Context>
+inline Result dispatch_frame(Visitor& v, Context c, const Frame* f, size_t available)
+{
+    if (! frame_is_valid(f, available))
+        return v.visit_bad(c, f);
+
+    switch (f->type)
+    {
+        case BULK_FRAME:
+        case VOIP_FRAME:
+            return v.visit_data(c, f);
+        case REQUEST_FRAME:
+            return v.visit(c, f, payload_of<REQUEST_FRAME>(f));
+        case CONTENTION_SLOT:
+            return v.visit(c, f, payload_of<CONTENTION_SLOT>(f));
+        case VOIP_SLOT:
+            return v.visit(c, f, payload_of<VOIP_SLOT>(f));
+        case TRANSMIT_SLOT:
+            return v.visit(c, f, payload_of<TRANSMIT_SLOT>(f));
+        case BITRATE_MESSAGE:
+            return v.visit(c, f, payload_of<BITRATE_MESSAGE>(f));
+        case ROUND_COMPLETE_MESSAGE:
+            return v.visit(c, f, payload_of<ROUND_COMPLETE_MESSAGE>(f));
+        case DELAY_MESSAGE:
+            return v.visit(c, f, payload_of<DELAY_MESSAGE>(f));
+        default:
+            return v.visit_bad(c, f);
+    }
+}
+
 // Node IDs:
 const uint8_t BROADCAST_ID = 0;
 const uint8_t DRIVER_ID = 0;
@@ -125,10 +399,26 @@ const unsigned ETH_1000_MEGABIT__BYTES_PER_US = (MEGABIT__BYTES * 1000 /* hz */)
 const unsigned WIFI_20_MEGABIT__BYTES_PER_US = (MEGABIT__BYTES * 20 /* hz */) / 1000000 /* us/s */;
 const unsigned BITRATE__BYTES_PER_US = WIFI_20_MEGABIT__BYTES_PER_US;
 
-// VoIP-related constants:
+// VoIP-related constants: (the guard and per-flow size are for stations
+// which haven't sent a VoIP report)
 const uint32_t VOIP_SLOT_GUARD_SIZE__BYTES = 2 * BULK_MTU__BYTES;
 const uint32_t VOIP_SLOT_SIZE_PER_FLOW__BYTES = REQUEST_FRAME_SIZE__BYTES + VOIP_MTU__BYTES + VOIP_SLOT_GUARD_SIZE__BYTES;
-const uint32_t VOIP_SLOT_SIZE__BYTES = FLOWS_PER_VOIP_SLOT * VOIP_SLOT_SIZE_PER_FLOW__BYTES;
+const uint32_t VOIP_SLOT_SWITCH__US = 10;        // Radio RX/TX switch, added to measured guards
+const uint16_t VOIP_REPORT_NO_LATENCY = 0xffff;
+const unsigned DEFAULT_VOIP_QUEUES = 4;          // VoIP inputs of a station's JaldiGate
+
+// The guard the master leaves after a station's places in a VoIP slot, from
+// the latency in the station's VoIP report: the station may start up to its
+// latency late, and its frames take up to that long again to reach the
+// others. Never more than the guard for stations which haven't reported.
+inline uint32_t voip_guard_bytes(uint16_t latency_us)
+{
+    if (latency_us == VOIP_REPORT_NO_LATENCY)
+        return VOIP_SLOT_GUARD_SIZE__BYTES;
+
+    uint32_t guard_bytes = (2 * uint32_t(latency_us) + VOIP_SLOT_SWITCH__US) * BITRATE__BYTES_PER_US;
+    return guard_bytes < VOIP_SLOT_GUARD_SIZE__BYTES ? guard_bytes : VOIP_SLOT_GUARD_SIZE__BYTES;
+}
 
 // Round constraints:
 const uint32_t MIN_CHUNK_SIZE__BYTES = BITRATE__BYTES_PER_US * 1 /* ms */ * 1000 /* us/ms */;
@@ -137,8 +427,8 @@ const uint32_t CONTENTION_SLOT_DURATION__US = 50 /* ms */ * 1000 /* us/ms */;
 const uint32_t INTER_VOIP_SLOT_DISTANCE__BYTES = BITRATE__BYTES_PER_US * 40 /* ms */ * 1000 /* us/ms */;
 const uint32_t DEFAULT_CONTENTION_SLOT_ONLY_DISTANCE__US = 50 /* ms */ * 1000 /* us/ms */;
 
-// Other temporary constants:
-const unsigned STATION_COUNT = 4;
+// Most stations one master serves (they have IDs from FIRST_STATION_ID up):
+const unsigned MAX_STATION_COUNT = 64;
 
 }
 